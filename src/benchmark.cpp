@@ -0,0 +1,544 @@
+// Microbenchmarks of the ray tracing kernels
+//
+// Times the intersection tests, the BVH builders and traversals, the random
+// direction generators and full frames of the bundled scenes on fixed seeds,
+// and reports the median, minimum and spread over repeated runs. Results can
+// be written as JSON for comparing builds.
+//
+
+#include "rt_raytracing.h"
+#include "rt_aabb.h"
+#include "rt_bvh_node.h"
+#include "rt_hitable_list.h"
+#include "rt_sampler.h"
+#include "rt_sphere.h"
+#include "rt_triangle.h"
+#include "rt_triangle_mesh.h"
+#include "rt_weekend.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// Struct for command line options
+struct Options {
+    int repetitions = 5;
+    int num_threads = 0;  // 0 - Use all available cores
+    int width = 256;      // Resolution of the rendered frames
+    int height = 256;
+    int num_ops = 1 << 20;   // Operations per repetition of the kernel benchmarks
+    int num_rays = 1 << 16;  // Rays per repetition of the BVH traversal benchmarks
+    std::string filter;      // Only run benchmarks whose name contains this
+    std::string json;        // Empty - Do not write JSON
+    std::vector<std::string> models;
+};
+
+// Summary of the repeated measurements of one benchmark
+struct Result {
+    std::string name;
+    std::string unit;
+    std::vector<double> samples;
+    double median = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+    double mean = 0.0;
+    double stddev = 0.0;
+};
+
+// Written to after each timed loop, so that the compiler cannot remove it
+static volatile std::uint64_t g_sink = 0;
+
+std::string getEnvVar(const std::string &name)
+{
+    char const *value = std::getenv(name.c_str());
+    return value == nullptr ? std::string() : std::string(value);
+}
+
+std::string modelDir(void)
+{
+    std::string rootDir = getEnvVar("RT_VIEWER_ROOT");
+    if (rootDir.empty()) { return "3d_models/"; }
+    return rootDir + "/3d_models/";
+}
+
+// Returns the OBJ files of the model directory, sorted by name
+std::vector<std::string> bundledModels(void)
+{
+    std::vector<std::string> names;
+#if defined(__unix__) || defined(__APPLE__)
+    if (DIR *dir = opendir(modelDir().c_str())) {
+        while (dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0) { names.push_back(name); }
+        }
+        closedir(dir);
+    }
+#endif
+    if (names.empty()) { names = { "armadillo_lowpoly.obj", "bunny_lowpoly.obj", "gargo_lowpoly.obj" }; }
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); ++i) { names[i] = modelDir() + names[i]; }
+    return names;
+}
+
+// Returns the file name of a path without the directory and extension
+std::string baseName(const std::string &path)
+{
+    size_t begin = path.find_last_of("/\\");
+    begin = begin == std::string::npos ? 0 : begin + 1;
+    size_t end = path.find_last_of('.');
+    if (end == std::string::npos || end < begin) { end = path.size(); }
+    return path.substr(begin, end - begin);
+}
+
+void printUsage(const char *program)
+{
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --repetitions N  Timed runs of each benchmark, after one warm-up run (default: 5)\n"
+              << "  --threads N      Render and BVH build threads (default: all cores)\n"
+              << "  --size WxH       Resolution of the rendered frames (default: 256x256)\n"
+              << "  --ops N          Operations per run of the kernel benchmarks (default: 1048576)\n"
+              << "  --rays N         Rays per run of the BVH traversal benchmarks (default: 65536)\n"
+              << "  --model FILE     OBJ mesh, may be repeated (default: all of 3d_models/*.obj)\n"
+              << "  --filter TEXT    Only run the benchmarks whose name contains TEXT\n"
+              << "  --json FILE      Write the results as JSON\n"
+              << "  --help           Show this message\n";
+}
+
+bool parseOptions(int argc, char *argv[], Options &opt)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") { return false; }
+        if (i + 1 >= argc) {
+            std::cerr << "Error: missing value for " << arg << std::endl;
+            return false;
+        }
+        if (arg == "--repetitions") {
+            opt.repetitions = std::atoi(argv[++i]);
+        } else if (arg == "--threads") {
+            opt.num_threads = std::atoi(argv[++i]);
+        } else if (arg == "--size") {
+            if (std::sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2) {
+                std::cerr << "Error: expected WxH for --size" << std::endl;
+                return false;
+            }
+        } else if (arg == "--ops") {
+            opt.num_ops = std::atoi(argv[++i]);
+        } else if (arg == "--rays") {
+            opt.num_rays = std::atoi(argv[++i]);
+        } else if (arg == "--model") {
+            opt.models.push_back(argv[++i]);
+        } else if (arg == "--filter") {
+            opt.filter = argv[++i];
+        } else if (arg == "--json") {
+            opt.json = argv[++i];
+        } else {
+            std::cerr << "Error: unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (opt.repetitions <= 0 || opt.width <= 0 || opt.height <= 0 || opt.num_ops <= 0 || opt.num_rays <= 0) {
+        std::cerr << "Error: repetitions, size, ops and rays must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Hides the progress messages that scene setup writes to std::cout
+class QuietOutput {
+  public:
+    QuietOutput() : buffer(std::cout.rdbuf(nullptr)) {}
+    ~QuietOutput() { std::cout.rdbuf(buffer); }
+
+  private:
+    std::streambuf *buffer;
+};
+
+// Runs and measures benchmarks. A benchmark is a function that performs one
+// run and returns its measurement in the given unit.
+class Runner {
+  public:
+    explicit Runner(const Options &opt) : opt(opt) {}
+
+    bool enabled(const std::string &name) const {
+        return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+    }
+
+    void run(const std::string &name, const std::string &unit, const std::function<double()> &benchmark) {
+        if (!enabled(name)) return;
+        Result result;
+        result.name = name;
+        result.unit = unit;
+        benchmark();  // Warm-up: fills caches and lets the CPU clock up
+        for (int i = 0; i < opt.repetitions; ++i) { result.samples.push_back(benchmark()); }
+
+        std::vector<double> sorted = result.samples;
+        std::sort(sorted.begin(), sorted.end());
+        size_t n = sorted.size();
+        result.median = n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+        result.min = sorted.front();
+        result.max = sorted.back();
+        for (size_t i = 0; i < n; ++i) { result.mean += sorted[i] / n; }
+        for (size_t i = 0; i < n; ++i) { result.stddev += (sorted[i] - result.mean) * (sorted[i] - result.mean); }
+        result.stddev = n > 1 ? std::sqrt(result.stddev / (n - 1)) : 0.0;
+
+        std::printf("%-48s %12.3f %12.3f %8.2f %%  %s\n", name.c_str(), result.median, result.min,
+                    result.mean > 0.0 ? 100.0 * result.stddev / result.mean : 0.0, unit.c_str());
+        std::fflush(stdout);
+        results.push_back(result);
+    }
+
+    bool write_json(const std::string &filename, int num_threads) const {
+        FILE *file = std::fopen(filename.c_str(), "w");
+        if (file == nullptr) {
+            std::cerr << "Error: cannot write " << filename << std::endl;
+            return false;
+        }
+        std::fprintf(file, "{\n  \"context\": {\n");
+#ifdef __VERSION__
+        std::fprintf(file, "    \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+        std::fprintf(file, "    \"threads\": %d,\n", num_threads);
+        std::fprintf(file, "    \"repetitions\": %d,\n", opt.repetitions);
+        std::fprintf(file, "    \"frame_size\": [%d, %d],\n", opt.width, opt.height);
+        std::fprintf(file, "    \"ops\": %d,\n", opt.num_ops);
+        std::fprintf(file, "    \"rays\": %d\n", opt.num_rays);
+        std::fprintf(file, "  },\n  \"benchmarks\": [");
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            std::fprintf(file, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.6g, \"min\": %.6g, "
+                         "\"max\": %.6g, \"mean\": %.6g, \"stddev\": %.6g, \"samples\": [",
+                         i ? "," : "", r.name.c_str(), r.unit.c_str(), r.median, r.min, r.max, r.mean, r.stddev);
+            for (size_t k = 0; k < r.samples.size(); ++k) {
+                std::fprintf(file, "%s%.6g", k ? ", " : "", r.samples[k]);
+            }
+            std::fprintf(file, "]}");
+        }
+        std::fprintf(file, "\n  ]\n}\n");
+        bool ok = std::ferror(file) == 0;
+        return std::fclose(file) == 0 && ok;
+    }
+
+  private:
+    const Options &opt;
+    std::vector<Result> results;
+};
+
+double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+glm::vec3 randomPoint(rt::Sampler &sampler, const glm::vec3 &bmin, const glm::vec3 &bmax)
+{
+    glm::vec3 u(sampler.next_float(), sampler.next_float(), sampler.next_float());
+    return bmin + u * (bmax - bmin);
+}
+
+// Rays from random points around a box towards random points inside it, so
+// that a part of them miss the geometry in the box
+std::vector<rt::Ray> raysTowards(const rt::AABB &box, int count, std::uint64_t seed)
+{
+    rt::Sampler sampler(seed);
+    glm::vec3 center = 0.5f * (box.min() + box.max());
+    float radius = glm::length(box.max() - box.min());
+    std::vector<rt::Ray> rays(count);
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 origin = center + radius * glm::normalize(rt::random_in_unit_sphere(sampler) + glm::vec3(1e-6f));
+        glm::vec3 target = randomPoint(sampler, box.min(), box.max());
+        rays[i] = rt::Ray(origin, target - origin);
+    }
+    return rays;
+}
+
+// Intersection tests of single primitives against rays that hit about half
+// of the time, cycling through arrays that stay in the L1/L2 cache
+void benchmarkKernels(Runner &runner, const Options &opt, const cg::OBJMesh &mesh)
+{
+    const int count = 4096;  // Power of two
+    const int num_ops = opt.num_ops;
+    rt::RTContext rtx;
+    rt::Sampler sampler(1);
+
+    std::vector<rt::AABB> boxes(count);
+    std::vector<rt::Sphere> spheres(count);
+    std::vector<rt::Ray> box_rays(count), sphere_rays(count);
+    std::vector<glm::vec3> inv_dirs(count);
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 center = randomPoint(sampler, glm::vec3(-1.0f), glm::vec3(1.0f));
+        glm::vec3 extent = randomPoint(sampler, glm::vec3(0.05f), glm::vec3(0.5f));
+        boxes[i] = rt::AABB(center - extent, center + extent);
+        glm::vec3 origin = randomPoint(sampler, glm::vec3(-4.0f), glm::vec3(4.0f));
+        box_rays[i] = rt::Ray(origin, center + 2.0f * extent * (randomPoint(sampler, glm::vec3(-1.0f), glm::vec3(1.0f))) - origin);
+        inv_dirs[i] = 1.0f / box_rays[i].direction();
+
+        float radius = 0.05f + 0.45f * sampler.next_float();
+        spheres[i] = rt::Sphere(center, radius, 0);
+        sphere_rays[i] = rt::Ray(origin, center + 1.5f * radius * rt::random_in_unit_sphere(sampler) - origin);
+    }
+
+    // Triangles of the mesh, with rays towards random barycentric
+    // coordinates in [0,1)^2, which lie inside the triangle half of the time
+    std::vector<rt::Triangle> triangles;
+    std::vector<rt::Ray> triangle_rays;
+    for (size_t i = 0; i + 2 < mesh.indices.size() && int(triangles.size()) < count; i += 3) {
+        glm::vec3 a = mesh.vertices[mesh.indices[i]], b = mesh.vertices[mesh.indices[i + 1]];
+        glm::vec3 c = mesh.vertices[mesh.indices[i + 2]];
+        triangles.push_back(rt::Triangle(a, b, c, 0));
+        glm::vec3 target = a + sampler.next_float() * (b - a) + sampler.next_float() * (c - a);
+        glm::vec3 origin = target + 2.0f * glm::normalize(rt::random_in_unit_sphere(sampler) + glm::vec3(1e-6f));
+        triangle_rays.push_back(rt::Ray(origin, target - origin));
+    }
+    int num_triangles = int(triangles.size());
+    while (num_triangles & (num_triangles - 1)) { num_triangles &= num_triangles - 1; }  // Power of two
+
+    runner.run("kernel/aabb_hit", "ns/op", [&]() {
+        Clock::time_point start = Clock::now();
+        std::uint64_t hits = 0;
+        for (int i = 0; i < num_ops; ++i) {
+            hits += boxes[(i * 7) & (count - 1)].hit(box_rays[i & (count - 1)], 1e-4f, 1e30f);
+        }
+        double seconds = secondsSince(start);
+        g_sink = hits;
+        return seconds * 1e9 / num_ops;
+    });
+
+    runner.run("kernel/aabb_hit_slabs", "ns/op", [&]() {
+        Clock::time_point start = Clock::now();
+        std::uint64_t hits = 0;
+        for (int i = 0; i < num_ops; ++i) {
+            const rt::AABB &box = boxes[(i * 7) & (count - 1)];
+            const rt::Ray &r = box_rays[i & (count - 1)];
+            float t_enter;
+            hits += rt::hit_slabs(box.min(), box.max(), r.origin(), inv_dirs[i & (count - 1)], 1e-4f, 1e30f, t_enter);
+        }
+        double seconds = secondsSince(start);
+        g_sink = hits;
+        return seconds * 1e9 / num_ops;
+    });
+
+    runner.run("kernel/sphere_hit", "ns/op", [&]() {
+        Clock::time_point start = Clock::now();
+        std::uint64_t hits = 0;
+        rt::HitRecord rec;
+        for (int i = 0; i < num_ops; ++i) {
+            hits += spheres[i & (count - 1)].hit(rtx, sphere_rays[i & (count - 1)], 1e-4f, 1e30f, rec);
+        }
+        double seconds = secondsSince(start);
+        g_sink = hits;
+        return seconds * 1e9 / num_ops;
+    });
+
+    if (num_triangles > 0) {
+        runner.run("kernel/triangle_hit", "ns/op", [&]() {
+            Clock::time_point start = Clock::now();
+            std::uint64_t hits = 0;
+            rt::HitRecord rec;
+            for (int i = 0; i < num_ops; ++i) {
+                hits += triangles[i & (num_triangles - 1)].hit(rtx, triangle_rays[i & (num_triangles - 1)], 1e-4f,
+                                                                1e30f, rec);
+            }
+            double seconds = secondsSince(start);
+            g_sink = hits;
+            return seconds * 1e9 / num_ops;
+        });
+    }
+
+    // Random directions, from rand() as in the original code and from the
+    // per-pixel Sampler used for rendering
+    struct Generator {
+        const char *name;
+        std::function<glm::vec3(rt::Sampler &)> generate;
+    };
+    const glm::vec3 normal = glm::normalize(glm::vec3(0.3f, 1.0f, -0.2f));
+    const Generator generators[] = {
+        { "random/in_unit_sphere_rand", [](rt::Sampler &) { return rt::random_in_unit_sphere(); } },
+        { "random/unit_vector_rand", [](rt::Sampler &) { return rt::random_unit_vector(); } },
+        { "random/in_hemisphere_rand", [&](rt::Sampler &) { return rt::random_in_hemisphere(normal); } },
+        { "random/in_unit_sphere", [](rt::Sampler &s) { return rt::random_in_unit_sphere(s); } },
+        { "random/unit_vector", [](rt::Sampler &s) { return rt::random_unit_vector(s); } },
+        { "random/in_hemisphere", [&](rt::Sampler &s) { return rt::random_in_hemisphere(normal, s); } },
+    };
+    for (const Generator &generator : generators) {
+        runner.run(generator.name, "ns/op", [&]() {
+            std::srand(1);
+            rt::Sampler s(1);
+            Clock::time_point start = Clock::now();
+            glm::vec3 sum(0.0f);
+            for (int i = 0; i < num_ops; ++i) { sum += generator.generate(s); }
+            double seconds = secondsSince(start);
+            g_sink = std::uint64_t(std::abs(sum.x + sum.y + sum.z));
+            return seconds * 1e9 / num_ops;
+        });
+    }
+}
+
+// BVH builds and closest-hit traversals over the triangles of a mesh, for the
+// BvhNode tree of Hitable objects and for each builder and width of the flat
+// BVH of TriangleMesh
+void benchmarkBvh(Runner &runner, const Options &opt, const std::string &model, const cg::OBJMesh &obj_mesh)
+{
+    const std::string name = baseName(model);
+    rt::RTContext rtx;
+
+    rt::HitableList list;
+    for (size_t i = 0; i + 2 < obj_mesh.indices.size(); i += 3) {
+        list.add(std::make_shared<rt::Triangle>(obj_mesh.vertices[obj_mesh.indices[i]],
+                                                obj_mesh.vertices[obj_mesh.indices[i + 1]],
+                                                obj_mesh.vertices[obj_mesh.indices[i + 2]], 0));
+    }
+    rt::AABB box;
+    if (!list.bounding_box(0, 0, box)) return;
+    std::vector<rt::Ray> rays = raysTowards(box, opt.num_rays, 2);
+
+    auto traverse = [&](const rt::Hitable &hitable) {
+        Clock::time_point start = Clock::now();
+        std::uint64_t hits = 0;
+        rt::HitRecord rec;
+        for (size_t i = 0; i < rays.size(); ++i) { hits += hitable.hit(rtx, rays[i], 1e-4f, 1e30f, rec); }
+        double seconds = secondsSince(start);
+        g_sink = hits;
+        return seconds * 1e9 / rays.size();
+    };
+
+    std::shared_ptr<rt::BvhNode> tree;
+    auto build_tree = [&]() {
+        std::srand(1);  // The split axes are random
+        Clock::time_point start = Clock::now();
+        tree = std::make_shared<rt::BvhNode>(list, 0, 1);
+        return secondsSince(start) * 1e3;
+    };
+    runner.run("bvh/bvh_node/" + name + "/build", "ms", build_tree);
+    if (runner.enabled("bvh/bvh_node/" + name + "/traverse")) {
+        if (!tree) build_tree();
+        runner.run("bvh/bvh_node/" + name + "/traverse", "ns/ray", [&]() { return traverse(*tree); });
+    }
+
+    const char *builders[] = { "median", "sah", "lbvh" };
+    const int widths[] = { 2, 4, 8 };
+    rt::TriangleMesh mesh(obj_mesh, glm::vec3(0.0f), 0);
+    for (int builder = 0; builder < 3; ++builder) {
+        for (int width : widths) {
+            std::string prefix = std::string("bvh/") + builders[builder] + "_w" + std::to_string(width) + "/" + name;
+            rt::BvhBuildOptions options;
+            options.builder = builder;
+            options.width = width;
+            runner.run(prefix + "/build", "ms", [&]() {
+                std::srand(1);
+                Clock::time_point start = Clock::now();
+                mesh.build(options);
+                return secondsSince(start) * 1e3;
+            });
+            if (runner.enabled(prefix + "/traverse")) {
+                mesh.build(options);
+                runner.run(prefix + "/traverse", "ns/ray", [&]() { return traverse(mesh); });
+            }
+        }
+    }
+}
+
+// Full frames of a scene at one sample per pixel through the color()
+// function of each render path. Each run renders the first frame again, so
+// the same rays are traced every time.
+void benchmarkRender(Runner &runner, const Options &opt, int num_threads, int scene, const std::string &model)
+{
+    struct Path {
+        const char *name;
+        int packet_size;
+        bool wavefront;
+    };
+    const Path paths[] = { { "scalar", 1, false }, { "packet", 16, false }, { "wavefront", 1, true } };
+
+    std::string prefix = std::string("render/") + rt::sceneName(scene);
+    if (!model.empty()) { prefix += "/" + baseName(model); }
+    bool enabled = false;
+    for (const Path &path : paths) { enabled |= runner.enabled(prefix + "/" + path.name); }
+    if (!enabled) return;
+
+    rt::RTContext rtx;
+    rtx.width = opt.width;
+    rtx.height = opt.height;
+    rtx.num_threads = num_threads;
+    rtx.scene = scene;
+    rtx.view = glm::lookAt(glm::vec3(0.0f, 0.5f, 2.5f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    {
+        QuietOutput quiet;
+        std::srand(1);  // Scene setup places objects at random
+        rt::setupScene(rtx, model.empty() ? (modelDir() + "bunny_lowpoly.obj").c_str() : model.c_str());
+    }
+
+    for (const Path &path : paths) {
+        runner.run(prefix + "/" + path.name, "Mrays/s", [&]() {
+            rtx.packet_size = path.packet_size;
+            rtx.wavefront = path.wavefront;
+            rt::resetImage(rtx);
+            Clock::time_point start = Clock::now();
+            rt::updateFrame(rtx);
+            return double(rtx.num_rays) / secondsSince(start) * 1e-6;
+        });
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    if (!parseOptions(argc, argv, opt)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (opt.models.empty()) { opt.models = bundledModels(); }
+
+#ifdef _OPENMP
+    if (opt.num_threads > 0) { omp_set_num_threads(opt.num_threads); }
+#endif
+    int num_threads = opt.num_threads;
+    if (num_threads <= 0) { num_threads = std::max(1, int(std::thread::hardware_concurrency())); }
+
+    std::vector<cg::OBJMesh> meshes(opt.models.size());
+    for (size_t i = 0; i < opt.models.size(); ++i) {
+        QuietOutput quiet;
+        if (!cg::objMeshLoad(meshes[i], opt.models[i])) {
+            std::cerr << "Error: cannot load " << opt.models[i] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::printf("%-48s %12s %12s %10s  %s\n", "Benchmark", "Median", "Min", "Stddev", "Unit");
+    Runner runner(opt);
+    benchmarkKernels(runner, opt, meshes[0]);
+    for (size_t i = 0; i < opt.models.size(); ++i) { benchmarkBvh(runner, opt, opt.models[i], meshes[i]); }
+    benchmarkRender(runner, opt, num_threads, rt::SCENE_RANDOM, std::string());
+    for (size_t i = 0; i < opt.models.size(); ++i) {
+        benchmarkRender(runner, opt, num_threads, rt::SCENE_SEMI_RANDOM, opt.models[i]);
+        benchmarkRender(runner, opt, num_threads, rt::SCENE_BUNNY_FIELD, opt.models[i]);
+    }
+
+    if (!opt.json.empty()) {
+        if (!runner.write_json(opt.json, num_threads)) { return EXIT_FAILURE; }
+        std::printf("Wrote %s\n", opt.json.c_str());
+    }
+    return EXIT_SUCCESS;
+}
@@ -4,16 +4,26 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/constants.hpp>
 #include <glm/gtx/quaternion.hpp>
+#include <glm/gtc/type_precision.hpp>
 
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <iterator>
 #include <string>
 #include <vector>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
 #include <algorithm>
-#include <map>
+#include <thread>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace cg {
 
@@ -137,50 +147,370 @@ static glm::mat4 trackballGetRotationMatrix(Trackball &trackball)
     return glm::mat4_cast(trackball.qCurrent);
 }
 
-// Read an OBJMesh from an .obj file
-static bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
+// Contents of a file, memory-mapped where possible
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &filename)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0) {
+            size_ = size_t(st.st_size);
+            if (size_ == 0) {
+                data_ = "";
+            }
+            else {
+                void *p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ::madvise(p, size_, MADV_SEQUENTIAL);
+                    data_ = static_cast<const char *>(p);
+                    mapped_ = true;
+                }
+            }
+        }
+        ::close(fd);
+        if (data_) return;
+#endif
+        // Fall back to reading the whole file
+        std::ifstream f(filename.c_str(), std::ios::binary);
+        if (!f.is_open()) return;
+        buffer_.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        size_ = buffer_.size();
+        data_ = buffer_.empty() ? "" : &buffer_[0];
+    }
+
+    ~MappedFile()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapped_) ::munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+
+    bool is_open() const { return data_ != nullptr; }
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<char> buffer_;
+};
+
+namespace {
+// Parser for a range of lines of an OBJ file. Face corners are stored as
+// (vertex, texcoord, normal) indices that are zero-based and absolute, -1
+// if missing, or relative_base + i for the i:th element of the range (from
+// negative, relative indices). i is negative if the element is in an earlier
+// range, and is made absolute and range checked when the ranges are merged.
+struct OBJChunk {
+    static const std::int64_t relative_base = -(std::int64_t(1) << 40);
+
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec3> texcoords;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::i64vec3> corners;  // Three per triangle
+    bool error = false;
+
+    void parse(const char *p, const char *end, bool attributes)
+    {
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t')) ++p;
+            if (p + 1 < end && p[0] == 'v' && isBlank(p[1])) {
+                vertices.push_back(parseVec3(p + 2, end, &p));
+            }
+            else if (attributes && p + 2 < end && p[0] == 'v' && p[1] == 't' && isBlank(p[2])) {
+                texcoords.push_back(parseVec3(p + 3, end, &p));
+            }
+            else if (attributes && p + 2 < end && p[0] == 'v' && p[1] == 'n' && isBlank(p[2])) {
+                normals.push_back(parseVec3(p + 3, end, &p));
+            }
+            else if (p + 1 < end && p[0] == 'f' && isBlank(p[1])) {
+                parseFace(p + 2, end, attributes, &p);
+            }
+            while (p < end && *p != '\n') ++p;  // Ignore the rest of the line
+            ++p;
+        }
+    }
+
+    static bool isBlank(char c) { return c == ' ' || c == '\t'; }
+
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    // Parses a float like strtod, but without locale, allocation or the
+    // need for a terminating null character. Numbers with up to 19 digits
+    // and small exponents are converted exactly by one multiplication or
+    // division (as in Clinger's fast path), and others by strtod.
+    static float parseFloat(const char *p, const char *end, const char **next)
+    {
+        while (p < end && isBlank(*p)) ++p;
+        const char *start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+        std::uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        for (; p < end && isDigit(*p); ++p, ++digits) mantissa = mantissa * 10 + (*p - '0');
+        if (p < end && *p == '.') {
+            for (++p; p < end && isDigit(*p); ++p, ++digits, --exponent) mantissa = mantissa * 10 + (*p - '0');
+        }
+        if (digits > 0 && p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negative_exponent = false;
+            if (q < end && (*q == '-' || *q == '+')) negative_exponent = *q++ == '-';
+            if (q < end && isDigit(*q)) {
+                int e = 0;
+                for (; q < end && isDigit(*q); ++q) e = std::min(e * 10 + (*q - '0'), 100000);
+                exponent += negative_exponent ? -e : e;
+                p = q;
+            }
+        }
+        static const double powers[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+        if (digits > 0 && digits <= 19 && mantissa < (std::uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+            double value = double(mantissa);
+            value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+            *next = p;
+            return float(negative ? -value : value);
+        }
+
+        // Slow path (e.g., many digits, inf or nan), on a null-terminated copy
+        char token[64];
+        size_t length = 0;
+        for (p = start; p < end && length + 1 < sizeof(token) && !isBlank(*p) && *p != '\n' && *p != '\r'; ++p) {
+            token[length++] = *p;
+        }
+        token[length] = '\0';
+        char *token_end = token;
+        double value = std::strtod(token, &token_end);
+        *next = start + (token_end - token);
+        return float(value);
+    }
+
+    // Parses up to three floats, where missing ones are zero
+    static glm::vec3 parseVec3(const char *p, const char *end, const char **next)
+    {
+        glm::vec3 v(0.0f);
+        for (int i = 0; i < 3; ++i) {
+            const char *q = p;
+            v[i] = parseFloat(p, end, &q);
+            if (q == p) break;
+            p = q;
+        }
+        *next = p;
+        return v;
+    }
+
+    // Parses a one-based OBJ index into the format of corners, where count
+    // is the number of elements of its kind in the range so far. Returns
+    // false if there is none.
+    bool parseIndex(const char *&p, const char *end, size_t count, std::int64_t &index)
+    {
+        bool negative = p < end && *p == '-';
+        if (negative) ++p;
+        if (p >= end || !isDigit(*p)) return false;
+        std::int64_t value = 0;
+        for (; p < end && isDigit(*p); ++p) value = std::min<std::int64_t>(value * 10 + (*p - '0'), INT32_MAX);
+        if (negative) {
+            if (value == 0) error = true;
+            index = relative_base + std::int64_t(count) - value;
+        }
+        else {
+            if (value == 0) error = true;
+            index = value - 1;
+        }
+        return true;
+    }
+
+    // Parses a face "f v[/t][/n] ..." with three or more corners, which is
+    // split into a fan of triangles
+    void parseFace(const char *p, const char *end, bool attributes, const char **next)
+    {
+        glm::i64vec3 first(-1), previous(-1);
+        int num_corners = 0;
+        while (true) {
+            while (p < end && isBlank(*p)) ++p;
+            glm::i64vec3 corner(-1);
+            if (!parseIndex(p, end, vertices.size(), corner.x)) break;
+            if (attributes) {
+                if (p < end && *p == '/') {
+                    ++p;
+                    parseIndex(p, end, texcoords.size(), corner.y);
+                    if (p < end && *p == '/') {
+                        ++p;
+                        parseIndex(p, end, normals.size(), corner.z);
+                    }
+                }
+            }
+            else {
+                while (p < end && (*p == '/' || *p == '-' || isDigit(*p))) ++p;
+            }
+            if (num_corners >= 2) {
+                corners.push_back(first);
+                corners.push_back(previous);
+                corners.push_back(corner);
+            }
+            if (num_corners == 0) first = corner;
+            previous = corner;
+            ++num_corners;
+        }
+        *next = p;
+    }
+};
+
+// Makes a corner index of a chunk absolute, where offset is the number of
+// elements in earlier chunks. Returns false if it is out of range.
+inline bool resolveOBJIndex(std::int64_t &index, size_t offset, size_t count)
 {
-    const std::string VERTEX_LINE("v ");
-    const std::string FACE_LINE("f ");
+    if (index == -1) return true;
+    if (index < -1) index = std::int64_t(offset) + (index - OBJChunk::relative_base);
+    return index >= 0 && index < std::int64_t(count) && index <= INT32_MAX;
+}
 
-    // Open OBJ file
-    std::ifstream f(filename.c_str());
-    if (!f.is_open()) {
+// Parses the file in parallel, in chunks of whole lines, and makes the face
+// corners absolute indices. The number of chunks is chosen from the file size
+// and the number of cores, unless num_chunks is given.
+bool parseOBJ(const std::string &filename, bool attributes, std::vector<OBJChunk> &chunks, size_t num_chunks = 0)
+{
+    MappedFile file(filename);
+    if (!file.is_open()) {
         std::cerr << "Could not open " << filename << std::endl;
         return false;
     }
 
-    // Extract vertices and indices
-    std::string line;
-    glm::vec3 vertex;
-    std::uint32_t vertexIndex0, vertexIndex1, vertexIndex2;
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == VERTEX_LINE) {
-            std::istringstream vertexLine(line.substr(2));
-            vertexLine >> vertex.x;
-            vertexLine >> vertex.y;
-            vertexLine >> vertex.z;
-            mesh.vertices.push_back(vertex);
+    const char *data = file.data();
+    const size_t size = file.size();
+    const size_t min_chunk_size = size_t(1) << 20;
+    if (num_chunks == 0) {
+        num_chunks = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), size / min_chunk_size));
+    }
+    std::vector<size_t> bounds(num_chunks + 1, size);
+    bounds[0] = 0;
+    for (size_t i = 1; i < num_chunks; ++i) {
+        size_t b = std::max(bounds[i - 1], size * i / num_chunks);
+        while (b > 0 && b < size && data[b - 1] != '\n') ++b;
+        bounds[i] = b;
+    }
+
+    chunks.assign(num_chunks, OBJChunk());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_chunks; ++i) {
+        threads.push_back(std::thread([&, i]() { chunks[i].parse(data + bounds[i], data + bounds[i + 1], attributes); }));
+    }
+    chunks[0].parse(data + bounds[0], data + bounds[1], attributes);
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+
+    size_t num_vertices = 0, num_texcoords = 0, num_normals = 0;
+    for (size_t i = 0; i < num_chunks; ++i) {
+        num_vertices += chunks[i].vertices.size();
+        num_texcoords += chunks[i].texcoords.size();
+        num_normals += chunks[i].normals.size();
+    }
+    size_t vertex_offset = 0, texcoord_offset = 0, normal_offset = 0;
+    bool ok = true;
+    for (size_t i = 0; i < num_chunks; ++i) {
+        OBJChunk &chunk = chunks[i];
+        ok &= !chunk.error;
+        for (size_t j = 0; j < chunk.corners.size(); ++j) {
+            glm::i64vec3 &c = chunk.corners[j];
+            ok &= resolveOBJIndex(c.x, vertex_offset, num_vertices) && c.x >= 0;
+            ok &= resolveOBJIndex(c.y, texcoord_offset, num_texcoords);
+            ok &= resolveOBJIndex(c.z, normal_offset, num_normals);
         }
-        else if (line.substr(0, 2) == FACE_LINE) {
-            std::istringstream faceLine(line.substr(2));
-            faceLine >> vertexIndex0;
-            faceLine >> vertexIndex1;
-            faceLine >> vertexIndex2;
-            mesh.indices.push_back(vertexIndex0 - 1);
-            mesh.indices.push_back(vertexIndex1 - 1);
-            mesh.indices.push_back(vertexIndex2 - 1);
+        vertex_offset += chunk.vertices.size();
+        texcoord_offset += chunk.texcoords.size();
+        normal_offset += chunk.normals.size();
+    }
+    if (!ok) std::cerr << "Invalid face indices in " << filename << std::endl;
+    return ok;
+}
+
+template <typename T>
+void concatenate(std::vector<OBJChunk> &chunks, std::vector<T> OBJChunk::*member, std::vector<T> &output)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) n += (chunks[i].*member).size();
+    output.clear();
+    output.reserve(n);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        output.insert(output.end(), (chunks[i].*member).begin(), (chunks[i].*member).end());
+        std::vector<T>().swap(chunks[i].*member);
+    }
+}
+
+// Open-addressing hash map from face corners to the indices of unique
+// corners, which are numbered in the order of insertion
+class OBJCornerMap {
+  public:
+    explicit OBJCornerMap(size_t expected)
+    {
+        size_t capacity = 16;
+        while (capacity < 2 * expected) capacity *= 2;
+        slots.assign(capacity, 0u);
+        keys.reserve(expected);
+    }
+
+    // Returns the index of the corner, and whether it was inserted
+    std::pair<std::uint32_t, bool> insert(const glm::ivec3 &key)
+    {
+        if (2 * (keys.size() + 1) > slots.size()) grow();
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+            if (slots[i] == 0u) {
+                keys.push_back(key);
+                slots[i] = std::uint32_t(keys.size());
+                return std::make_pair(slots[i] - 1, true);
+            }
+            if (keys[slots[i] - 1] == key) return std::make_pair(slots[i] - 1, false);
         }
-        else {
-            // Ignore line
+    }
+
+  private:
+    static size_t hash(const glm::ivec3 &v)
+    {
+        std::uint64_t h = std::uint32_t(v.x) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ std::uint32_t(v.y)) * 0xC2B2AE3D27D4EB4Full;
+        h = (h ^ std::uint32_t(v.z)) * 0x165667B19E3779F9ull;
+        return size_t(h ^ (h >> 29));
+    }
+
+    void grow()
+    {
+        slots.assign(slots.size() * 2, 0u);
+        size_t mask = slots.size() - 1;
+        for (size_t k = 0; k < keys.size(); ++k) {
+            size_t i = hash(keys[k]) & mask;
+            while (slots[i] != 0u) i = (i + 1) & mask;
+            slots[i] = std::uint32_t(k + 1);
         }
     }
 
-    // Close OBJ file
-    f.close();
+    std::vector<std::uint32_t> slots;  // Indices of the corners in keys plus one, 0 if empty
+    std::vector<glm::ivec3> keys;
+};
+} // namespace
+
+// Read an OBJMesh from an .obj file. Only vertex positions and the vertex
+// indices of faces are read, and polygons are split into triangles.
+static bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
+{
+    std::vector<OBJChunk> chunks;
+    if (!parseOBJ(filename, false, chunks)) return false;
+
+    // Merge chunks
+    concatenate(chunks, &OBJChunk::vertices, mesh.vertices);
+    mesh.indices.clear();
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const std::vector<glm::i64vec3> &corners = chunks[i].corners;
+        for (size_t j = 0; j < corners.size(); ++j) mesh.indices.push_back(std::uint32_t(corners[j].x));
+    }
 
     // Compute normals
+    mesh.normals.clear();
     computeNormals(mesh.vertices, mesh.indices, &mesh.normals);
 
     // Display log message
@@ -191,68 +521,20 @@ static bool objMeshLoad(OBJMesh &mesh, const std::string &filename)
     return true;
 }
 
-struct uvec3Less {
-    bool operator() (const glm::uvec3 &a, const glm::uvec3 &b) const
-    {
-        return (a.x < b.x) |
-               ((a.x == b.x) & (a.y < b.y)) |
-               ((a.x == b.x) & (a.y == b.y) & (a.z < b.z));
-    }
-};
-
 // Read an OBJMeshUV from an .obj file. This function can read texture
 // coordinates and/or normals, in addition to vertex positions.
 static bool objMeshUVLoad(OBJMeshUV &mesh, const std::string &filename)
 {
-    const std::string VERTEX_LINE("v ");
-    const std::string TEXCOORD_LINE("vt ");
-    const std::string NORMAL_LINE("vn ");
-    const std::string FACE_LINE("f ");
-
-    std::string line;
-    glm::vec3 vertex;
-    glm::vec3 normal;
-    glm::vec3 texcoord;
-    std::uint32_t vindex[3];
-    std::uint32_t tindex[3];
-    std::uint32_t nindex[3];
-
-    // Open OBJ file
-    std::ifstream f(filename.c_str());
-    if (!f.is_open()) {
-        std::cerr << "Could not open " << filename << std::endl;
-        return false;
-    }
+    std::vector<OBJChunk> chunks;
+    if (!parseOBJ(filename, true, chunks)) return false;
 
-    // First pass: read vertex data into temporary mesh
     OBJMeshUV tmp_mesh;
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == VERTEX_LINE) {
-            std::istringstream ss(line.substr(2));
-            ss >> vertex.x >> vertex.y >> vertex.z;
-            tmp_mesh.vertices.push_back(vertex);
-        }
-        else if (line.substr(0, 3) == TEXCOORD_LINE) {
-            std::istringstream ss(line.substr(3));
-            ss >> texcoord.x >> texcoord.y >> texcoord.z;
-            tmp_mesh.texcoords.push_back(texcoord);
-        }
-        else if (line.substr(0, 3) == NORMAL_LINE) {
-            std::istringstream ss(line.substr(3));
-            ss >> normal.x >> normal.y >> normal.z;
-            tmp_mesh.normals.push_back(normal);
-        }
-        else {
-            // Ignore line
-        }
-    }
+    concatenate(chunks, &OBJChunk::vertices, tmp_mesh.vertices);
+    concatenate(chunks, &OBJChunk::texcoords, tmp_mesh.texcoords);
+    concatenate(chunks, &OBJChunk::normals, tmp_mesh.normals);
 
-    // Rewind file
-    f.clear();
-    f.seekg(0);
-
-    // Clear old mesh and pre-allocate space for new mesh data
+    size_t num_corners = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) num_corners += chunks[i].corners.size();
     mesh.vertices.clear();
     mesh.vertices.reserve(tmp_mesh.vertices.size());
     mesh.texcoords.clear();
@@ -260,71 +542,22 @@ static bool objMeshUVLoad(OBJMeshUV &mesh, const std::string &filename)
     mesh.normals.clear();
     mesh.normals.reserve(tmp_mesh.normals.size());
     mesh.indices.clear();
-
-    // Set up dictionary for mapping unique tuples to indices
-    std::map<glm::uvec3, unsigned, uvec3Less> visited;
-    unsigned next_index = 0;
-    glm::uvec3 key;
-
-    // Second pass: read faces and construct per-vertex texcoords/normals.
-    // Note: OBJ-indices start at one, so we need to subtract indices by one.
-    while (!f.eof()) {
-        std::getline(f, line);
-        if (line.substr(0, 2) == FACE_LINE) {
-            if (std::sscanf(line.c_str(), "f %d %d %d",
-                            &vindex[0], &vindex[1], &vindex[2]) == 3) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], 0, 0);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-            else if (std::sscanf(line.c_str(), "f %d/%d %d/%d %d/%d",
-                                 &vindex[0], &tindex[0],
-                                 &vindex[1], &tindex[1],
-                                 &vindex[2], &tindex[2]) == 6) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], tindex[i], 0);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                        mesh.texcoords.push_back(tmp_mesh.texcoords[tindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-            else if (std::sscanf(line.c_str(), "f %d//%d %d//%d %d//%d",
-                                 &vindex[0], &nindex[0],
-                                 &vindex[1], &nindex[1],
-                                 &vindex[2], &nindex[2]) == 6) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], nindex[i], 0);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                        mesh.normals.push_back(tmp_mesh.normals[nindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
-            }
-            else if (std::sscanf(line.c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                                 &vindex[0], &tindex[0], &nindex[0],
-                                 &vindex[1], &tindex[1], &nindex[1],
-                                 &vindex[2], &tindex[2], &nindex[2]) == 9) {
-                for (unsigned i = 0; i < 3; ++i) {
-                    key = glm::uvec3(vindex[i], tindex[i], nindex[i]);
-                    if (visited.count(key) == 0) {
-                        visited[key] = next_index++;
-                        mesh.vertices.push_back(tmp_mesh.vertices[vindex[i] - 1]);
-                        mesh.texcoords.push_back(tmp_mesh.texcoords[tindex[i] - 1]);
-                        mesh.normals.push_back(tmp_mesh.normals[nindex[i] - 1]);
-                    }
-                    mesh.indices.push_back(visited[key]);
-                }
+    mesh.indices.reserve(num_corners);
+
+    // Each unique (vertex, texcoord, normal) tuple becomes a vertex, in the
+    // order of first use
+    OBJCornerMap visited(std::max(tmp_mesh.vertices.size(), num_corners / 6));
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const std::vector<glm::i64vec3> &corners = chunks[i].corners;
+        for (size_t j = 0; j < corners.size(); ++j) {
+            const glm::ivec3 key(corners[j]);
+            std::pair<std::uint32_t, bool> inserted = visited.insert(key);
+            if (inserted.second) {
+                mesh.vertices.push_back(tmp_mesh.vertices[key.x]);
+                if (key.y >= 0) mesh.texcoords.push_back(tmp_mesh.texcoords[key.y]);
+                if (key.z >= 0) mesh.normals.push_back(tmp_mesh.normals[key.z]);
             }
+            mesh.indices.push_back(inserted.first);
         }
     }
 
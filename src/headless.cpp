@@ -0,0 +1,420 @@
+// Headless batch renderer
+//
+// Renders the ray tracing scene to a PNG file without opening a window or
+// creating an OpenGL context, and reports timing and throughput numbers.
+//
+
+#include "rt_raytracing.h"
+
+#include <lodepng.h>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Struct for command line options
+struct Options {
+    int width = 500;
+    int height = 500;
+    int samples = 64;
+    int max_bounces = 3;
+    int num_threads = 0;  // 0 - Use all available cores
+    int bvh_builder = 1;
+    int bvh_max_leaf_size = 4;
+    float bvh_traversal_cost = 1.0f;
+    int bvh_width = 4;
+    int packet_size = 16;
+    unsigned seed = 0;
+    float vfov = 90.0f;
+    glm::vec3 eye = glm::vec3(0.0f, 0.0f, 2.0f);
+    glm::vec3 target = glm::vec3(0.0f);
+    std::string model;
+    std::string output = "render.png";
+    std::string aov_prefix;  // Empty - Do not write AOVs
+    std::string cache_dir;   // Empty - Do not cache meshes and BVHs
+    std::string counters_csv;  // Empty - Do not log the performance counters
+    bool collect_counters = true;
+    int scene = rt::SCENE_SEMI_RANDOM;
+    std::string environment_map;  // Empty - Sky and ground colors
+    float environment_intensity = 1.0f;
+    bool light_sampling = true;
+    bool prefiltered_environment = false;
+    bool show_normals = false;
+    int heatmap = rt::HEATMAP_OFF;
+    int heatmap_metric = rt::HEATMAP_NODES_AND_TESTS;
+    float heatmap_max = 64.0f;
+    bool heatmap_log = false;
+    bool wavefront = false;
+    float adaptive_threshold = 0.0f;  // 0 - Adaptive sampling disabled
+    int adaptive_min_samples = 16;
+    bool denoise = false;
+    bool perform_antialiasing = true;
+    bool perform_gamma_correction = true;
+};
+
+// Returns the value of an environment variable
+std::string getEnvVar(const std::string &name)
+{
+    char const *value = std::getenv(name.c_str());
+    if (value == nullptr) {
+        return std::string();
+    } else {
+        return std::string(value);
+    }
+}
+
+// Returns the absolute path to the 3D model directory, or a path relative to
+// the working directory if RT_VIEWER_ROOT is not set
+std::string modelDir(void)
+{
+    std::string rootDir = getEnvVar("RT_VIEWER_ROOT");
+    if (rootDir.empty()) { return "3d_models/"; }
+    return rootDir + "/3d_models/";
+}
+
+void printUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --width N        Image width (default: 500)\n"
+              << "  --height N       Image height (default: 500)\n"
+              << "  --spp N          Samples per pixel (default: 64)\n"
+              << "  --bounces N      Max bounces (default: 3)\n"
+              << "  --fov DEG        Vertical field-of-view (default: 90)\n"
+              << "  --eye X,Y,Z      Camera position (default: 0,0,2)\n"
+              << "  --target X,Y,Z   Camera look-at point (default: 0,0,0)\n"
+              << "  --model FILE     OBJ mesh (default: bunny_lowpoly.obj)\n"
+              << "  --scene NAME     Scene: semi-random, custom, random, bunnies, lights\n"
+              << "                   (default: semi-random)\n"
+              << "  --environment DIR  Light the scene with the cubemap in DIR, e.g., cubemaps/Forrest\n"
+              << "  --environment-intensity X  Scale of the environment radiance (default: 1)\n"
+              << "  --no-light-sampling  Do not sample lights with shadow rays at diffuse hits\n"
+              << "  --prefiltered    Fast preview: look up the prefiltered levels of the environment\n"
+              << "                   for diffuse and glossy bounces that miss\n"
+              << "  --output FILE    Output PNG (default: render.png)\n"
+              << "  --threads N      Number of threads (default: all cores)\n"
+              << "  --bvh NAME       BVH builder: median, sah, lbvh (default: sah)\n"
+              << "  --leaf-size N    Maximum primitives per BVH leaf (default: 4)\n"
+              << "  --traversal-cost C  BVH node cost relative to a primitive test (default: 1)\n"
+              << "  --bvh-width N    Children per BVH node: 2, 4, 8 (default: 4)\n"
+              << "  --packet N       Primary rays per packet: 1 (off), 4, 8, 16 (default: 16)\n"
+              << "  --seed N         Random seed (default: 0)\n"
+              << "  --wavefront      Use the wavefront (stream) integrator\n"
+              << "  --adaptive T     Stop sampling pixels with relative error below T (max samples: --spp)\n"
+              << "  --min-spp N      Samples per pixel before testing convergence (default: 16)\n"
+              << "  --denoise        Write the denoised image\n"
+              << "  --aovs PREFIX    Also write the image and AOVs (depth, normal, ...) as PREFIX_<name>.pfm\n"
+              << "  --cache DIR      Cache loaded meshes and built BVHs in DIR for faster startup\n"
+              << "  --counters FILE  Append the performance counters of each pass to FILE as CSV\n"
+              << "  --no-counters    Do not count rays, BVH node visits, primitive tests and hits\n"
+              << "  --normals        Render normals instead of shading\n"
+              << "  --heatmap MODE   Render the traversal cost of rays: primary, path (default: off)\n"
+              << "  --heatmap-metric M  Cost shown by the heatmap: nodes, tests, both (default: both)\n"
+              << "  --heatmap-max C  Cost at the top of the heatmap color scale (default: 64)\n"
+              << "  --heatmap-log    Logarithmic heatmap color scale\n"
+              << "  --no-aa          Disable antialiasing\n"
+              << "  --no-gamma       Disable gamma correction\n";
+}
+
+bool parseVec3(const char *str, glm::vec3 &v)
+{
+    return std::sscanf(str, "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+bool parseOptions(int argc, char *argv[], Options &opt)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        } else if (arg == "--normals") {
+            opt.show_normals = true;
+        } else if (arg == "--wavefront") {
+            opt.wavefront = true;
+        } else if (arg == "--denoise") {
+            opt.denoise = true;
+        } else if (arg == "--no-aa") {
+            opt.perform_antialiasing = false;
+        } else if (arg == "--no-gamma") {
+            opt.perform_gamma_correction = false;
+        } else if (arg == "--heatmap-log") {
+            opt.heatmap_log = true;
+        } else if (arg == "--no-counters") {
+            opt.collect_counters = false;
+        } else if (arg == "--no-light-sampling") {
+            opt.light_sampling = false;
+        } else if (arg == "--prefiltered") {
+            opt.prefiltered_environment = true;
+        } else if (!has_value) {
+            std::cerr << "Error: unknown option or missing value: " << arg << std::endl;
+            return false;
+        } else if (arg == "--aovs") {
+            opt.aov_prefix = argv[++i];
+        } else if (arg == "--heatmap") {
+            std::string name = argv[++i];
+            opt.heatmap = -1;
+            for (int m = 0; m < rt::NUM_HEATMAP_MODES; ++m) {
+                if (name == rt::heatmapModeName(m)) { opt.heatmap = m; }
+            }
+            if (opt.heatmap < 0) {
+                std::cerr << "Error: unknown heatmap mode: " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--heatmap-metric") {
+            std::string name = argv[++i];
+            opt.heatmap_metric = -1;
+            for (int m = 0; m < rt::NUM_HEATMAP_METRICS; ++m) {
+                if (name == rt::heatmapMetricName(m)) { opt.heatmap_metric = m; }
+            }
+            if (opt.heatmap_metric < 0) {
+                std::cerr << "Error: unknown heatmap metric: " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--heatmap-max") {
+            opt.heatmap_max = float(std::atof(argv[++i]));
+        } else if (arg == "--counters") {
+            opt.counters_csv = argv[++i];
+        } else if (arg == "--environment") {
+            opt.environment_map = argv[++i];
+        } else if (arg == "--environment-intensity") {
+            opt.environment_intensity = float(std::atof(argv[++i]));
+        } else if (arg == "--scene") {
+            std::string name = argv[++i];
+            opt.scene = -1;
+            for (int s = 0; s < rt::NUM_SCENES; ++s) {
+                if (name == rt::sceneName(s)) { opt.scene = s; }
+            }
+            if (opt.scene < 0) {
+                std::cerr << "Error: unknown scene: " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--cache") {
+            opt.cache_dir = argv[++i];
+        } else if (arg == "--width") {
+            opt.width = std::atoi(argv[++i]);
+        } else if (arg == "--height") {
+            opt.height = std::atoi(argv[++i]);
+        } else if (arg == "--spp") {
+            opt.samples = std::atoi(argv[++i]);
+        } else if (arg == "--bounces") {
+            opt.max_bounces = std::atoi(argv[++i]);
+        } else if (arg == "--fov") {
+            opt.vfov = float(std::atof(argv[++i]));
+        } else if (arg == "--threads") {
+            opt.num_threads = std::atoi(argv[++i]);
+        } else if (arg == "--bvh") {
+            std::string name = argv[++i];
+            if (name == "median") {
+                opt.bvh_builder = 0;
+            } else if (name == "sah") {
+                opt.bvh_builder = 1;
+            } else if (name == "lbvh") {
+                opt.bvh_builder = 2;
+            } else {
+                std::cerr << "Error: unknown BVH builder: " << name << std::endl;
+                return false;
+            }
+        } else if (arg == "--leaf-size") {
+            opt.bvh_max_leaf_size = std::atoi(argv[++i]);
+        } else if (arg == "--traversal-cost") {
+            opt.bvh_traversal_cost = float(std::atof(argv[++i]));
+        } else if (arg == "--bvh-width") {
+            opt.bvh_width = std::atoi(argv[++i]);
+            if (opt.bvh_width != 2 && opt.bvh_width != 4 && opt.bvh_width != 8) {
+                std::cerr << "Error: BVH width must be 2, 4 or 8" << std::endl;
+                return false;
+            }
+        } else if (arg == "--packet") {
+            opt.packet_size = std::atoi(argv[++i]);
+            if (opt.packet_size != 1 && opt.packet_size != 4 && opt.packet_size != 8 && opt.packet_size != 16) {
+                std::cerr << "Error: packet size must be 1, 4, 8 or 16" << std::endl;
+                return false;
+            }
+        } else if (arg == "--seed") {
+            opt.seed = unsigned(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--adaptive") {
+            opt.adaptive_threshold = float(std::atof(argv[++i]));
+        } else if (arg == "--min-spp") {
+            opt.adaptive_min_samples = std::atoi(argv[++i]);
+        } else if (arg == "--model") {
+            opt.model = argv[++i];
+        } else if (arg == "--output") {
+            opt.output = argv[++i];
+        } else if (arg == "--eye") {
+            if (!parseVec3(argv[++i], opt.eye)) {
+                std::cerr << "Error: expected X,Y,Z for --eye" << std::endl;
+                return false;
+            }
+        } else if (arg == "--target") {
+            if (!parseVec3(argv[++i], opt.target)) {
+                std::cerr << "Error: expected X,Y,Z for --target" << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Error: unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (opt.width <= 0 || opt.height <= 0 || opt.samples <= 0) {
+        std::cerr << "Error: width, height and spp must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Resolves an accumulated image into 8-bit RGBA (same as the display
+// shader) and writes it to a PNG file. The image is stored bottom-up.
+bool savePNG(const rt::RTContext &rtx, const std::vector<glm::vec4> &image, const std::string &filename)
+{
+    std::vector<unsigned char> pixels(rtx.width * rtx.height * 4);
+    for (int y = 0; y < rtx.height; ++y) {
+        for (int x = 0; x < rtx.width; ++x) {
+            glm::vec4 c = image[y * rtx.width + x];
+            glm::vec3 rgb = glm::vec3(c) / glm::max(c.a, 1.0f);
+            if (rtx.perform_gamma_correction) { rgb = glm::pow(rgb, glm::vec3(1.0f / 2.2f)); }
+            rgb = glm::clamp(rgb, 0.0f, 1.0f);
+
+            unsigned char *dst = &pixels[((rtx.height - 1 - y) * rtx.width + x) * 4];
+            dst[0] = (unsigned char)(rgb.r * 255.0f + 0.5f);
+            dst[1] = (unsigned char)(rgb.g * 255.0f + 0.5f);
+            dst[2] = (unsigned char)(rgb.b * 255.0f + 0.5f);
+            dst[3] = 255;
+        }
+    }
+
+    unsigned error = lodepng::encode(filename, pixels, rtx.width, rtx.height);
+    if (error != 0) {
+        std::cerr << "Error: " << lodepng_error_text(error) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    if (!parseOptions(argc, argv, opt)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (opt.model.empty()) { opt.model = modelDir() + "bunny_lowpoly.obj"; }
+
+    // OpenMP is used for building the BVH, and a pool of std::threads for
+    // rendering
+#ifdef _OPENMP
+    if (opt.num_threads > 0) { omp_set_num_threads(opt.num_threads); }
+#endif
+    int num_threads = opt.num_threads;
+    if (num_threads <= 0) { num_threads = std::max(1, int(std::thread::hardware_concurrency())); }
+
+    typedef std::chrono::steady_clock Clock;
+
+    rt::RTContext rtx;
+    rtx.width = opt.width;
+    rtx.height = opt.height;
+    rtx.max_frames = opt.samples;
+    rtx.max_bounces = opt.max_bounces;
+    rtx.vfov = opt.vfov;
+    rtx.show_normals = opt.show_normals;
+    rtx.heatmap = opt.heatmap;
+    rtx.heatmap_metric = opt.heatmap_metric;
+    rtx.heatmap_max = opt.heatmap_max;
+    rtx.heatmap_log = opt.heatmap_log;
+    rtx.perform_antialiasing = opt.perform_antialiasing;
+    rtx.perform_gamma_correction = opt.perform_gamma_correction;
+    rtx.bvh_builder = opt.bvh_builder;
+    rtx.bvh_max_leaf_size = opt.bvh_max_leaf_size;
+    rtx.bvh_traversal_cost = opt.bvh_traversal_cost;
+    rtx.bvh_width = opt.bvh_width;
+    rtx.packet_size = opt.packet_size;
+    rtx.seed = opt.seed;
+    rtx.wavefront = opt.wavefront;
+    rtx.adaptive_sampling = opt.adaptive_threshold > 0.0f;
+    rtx.adaptive_threshold = opt.adaptive_threshold;
+    rtx.adaptive_min_samples = opt.adaptive_min_samples;
+    rtx.num_threads = num_threads;
+    rtx.scene = opt.scene;
+    rtx.scene_cache_dir = opt.cache_dir;
+    rtx.environment_map = opt.environment_map;
+    rtx.environment_intensity = opt.environment_intensity;
+    rtx.light_sampling = opt.light_sampling;
+    rtx.prefiltered_environment = opt.prefiltered_environment;
+    rtx.collect_counters = opt.collect_counters || !opt.counters_csv.empty();
+    rtx.counters_csv = opt.counters_csv;
+    rtx.counters_csv_interval = 0.0f;
+    rtx.view = glm::lookAt(opt.eye, opt.target, glm::vec3(0.0f, 1.0f, 0.0f));
+
+    Clock::time_point setup_start = Clock::now();
+    rt::setupScene(rtx, opt.model.c_str());
+    double setup_seconds = std::chrono::duration<double>(Clock::now() - setup_start).count();
+
+    rt::resetImage(rtx);
+    std::cout << "Rendering " << rtx.width << "x" << rtx.height << " at " << opt.samples
+              << " spp with " << num_threads << " thread(s)" << std::endl;
+
+    Clock::time_point render_start = Clock::now();
+    while (rtx.current_frame < rtx.max_frames && rtx.converged_fraction < 1.0f) {
+        rt::updateFrame(rtx);
+    }
+    double render_seconds = std::chrono::duration<double>(Clock::now() - render_start).count();
+
+    double denoise_seconds = 0.0;
+    if (opt.denoise) {
+        Clock::time_point denoise_start = Clock::now();
+        rt::denoiseImage(rtx);
+        denoise_seconds = std::chrono::duration<double>(Clock::now() - denoise_start).count();
+    }
+
+    if (!savePNG(rtx, opt.denoise ? rtx.denoised_image : rtx.image, opt.output)) { return EXIT_FAILURE; }
+    if (!opt.aov_prefix.empty() && !rt::saveAovs(rtx, opt.aov_prefix)) { return EXIT_FAILURE; }
+
+    double num_samples = 0.0;
+    for (size_t i = 0; i < rtx.sample_stats.size(); ++i) {
+        num_samples += rtx.sample_stats[i].x;
+    }
+    std::printf("Scene setup:   %.3f s\n", setup_seconds);
+    std::printf("Render time:   %.3f s\n", render_seconds);
+    if (opt.denoise) { std::printf("Denoise time:  %.3f s\n", denoise_seconds); }
+    std::printf("Rays traced:   %llu\n", (unsigned long long)rtx.num_rays);
+    std::printf("Rays/s:        %.3f M\n", double(rtx.num_rays) / render_seconds * 1e-6);
+    std::printf("Samples/s:     %.3f M\n", num_samples / render_seconds * 1e-6);
+    if (rtx.adaptive_sampling) {
+        std::printf("Average spp:   %.1f\n", num_samples / (double(rtx.width) * rtx.height));
+        std::printf("Converged:     %.1f %%\n", rtx.converged_fraction * 100.0);
+    }
+    if (rtx.collect_counters) {
+        const rt::PerfCounters &c = rtx.counters;
+        std::printf("Time per pass: %.2f ms (%.2f ms of tracing per thread)\n", c.ms_per_pass(),
+                    c.passes ? c.sample_seconds * 1e3 / (double(c.passes) * num_threads) : 0.0);
+        std::printf("Rays by depth: ");
+        for (int i = 0; i < rt::PerfCounters::max_depth; ++i) {
+            if (c.rays[i]) { std::printf("%s%llu", i ? ", " : "", (unsigned long long)c.rays[i]); }
+        }
+        std::printf("\nNodes/ray:     %.2f\n", c.nodes_per_ray());
+        std::printf("Tests/ray:     %.2f\n", c.tests_per_ray());
+        std::printf("Hits:          ");
+        for (int i = 0; i < rt::PerfCounters::num_material_types; ++i) {
+            std::printf("%s%s %llu", i ? ", " : "", rt::materialTypeName(i), (unsigned long long)c.material_hits[i]);
+        }
+        std::printf("\n");
+    }
+    std::printf("Wrote %s\n", opt.output.c_str());
+    if (!opt.aov_prefix.empty()) { std::printf("Wrote %s_*.pfm\n", opt.aov_prefix.c_str()); }
+    if (!opt.counters_csv.empty()) { std::printf("Wrote %s\n", opt.counters_csv.c_str()); }
+
+    return EXIT_SUCCESS;
+}
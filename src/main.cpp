@@ -4,6 +4,7 @@
 //
 
 #include "rt_raytracing.h"
+#include "rt_render_thread.h"
 #include "cg_utils.h"
 #include "cg_utils2.h"
 
@@ -19,7 +20,11 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <memory>
 
 // Struct for resources and state
 struct Context {
@@ -32,6 +37,16 @@ struct Context {
     GLuint emptyVAO;
     rt::RTContext rtx;
     GLuint texture = 0;
+    int texture_width = 0;
+    int texture_height = 0;
+    int texture_format = -1;
+    GLuint pbo = 0;
+    bool use_pbo = false;            // Stream uploads through a pixel buffer object
+    std::size_t upload_bytes = 0;    // Uploaded for the latest pass
+    double upload_rate = 0.0;        // Smoothed, in bytes per second
+    std::unique_ptr<rt::RenderThread> renderer;
+    bool animate_instances = false;
+    int environment = 0;             // Index of the environment map in the GUI, 0 - None
     float elapsed_time;
 };
 
@@ -68,6 +83,17 @@ std::string modelDir(void)
     return rootDir + "/3d_models/";
 }
 
+// Returns the absolute path to the cubemap directory
+std::string cubemapDir(void)
+{
+    std::string rootDir = getEnvVar("RT_VIEWER_ROOT");
+    if (rootDir.empty()) {
+        std::cout << "Error: RT_VIEWER_ROOT is not set." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    return rootDir + "/cubemaps/";
+}
+
 void createImageTexture(GLuint *texture, int width, int height)
 {
     glDeleteTextures(1, texture);
@@ -81,6 +107,76 @@ void createImageTexture(GLuint *texture, int width, int height)
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+// Uploads the rows of a frame that changed since the previous frame, or all
+// rows if the texture had to be reallocated
+void uploadFrame(Context &ctx, const rt::RenderedFrame &frame)
+{
+    ctx.upload_bytes = 0;
+    if (frame.pixels.empty()) return;
+    static const GLint internal_formats[] = { GL_RGBA32F, GL_RGBA16F, GL_RGBA8 };
+    static const GLenum types[] = { GL_FLOAT, GL_HALF_FLOAT, GL_UNSIGNED_BYTE };
+    const std::size_t row_size = frame.width * rt::framePixelSize(frame.format);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, ctx.texture);
+    bool full = frame.width != ctx.texture_width || frame.height != ctx.texture_height ||
+                frame.format != ctx.texture_format;
+    if (full) {
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_formats[frame.format], frame.width, frame.height, 0, GL_RGBA,
+                     types[frame.format], nullptr);
+        ctx.texture_width = frame.width;
+        ctx.texture_height = frame.height;
+        ctx.texture_format = frame.format;
+    }
+
+    // Spans of consecutive dirty rows
+    std::vector<std::pair<int, int>> spans;
+    for (int y = 0; y < frame.height; ++y) {
+        bool dirty = full || (y < int(frame.dirty_rows.size()) && frame.dirty_rows[y]);
+        if (!dirty) continue;
+        if (!spans.empty() && spans.back().second == y) { spans.back().second = y + 1; }
+        else { spans.push_back(std::make_pair(y, y + 1)); }
+    }
+    for (std::size_t i = 0; i < spans.size(); ++i) {
+        ctx.upload_bytes += (spans[i].second - spans[i].first) * row_size;
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    if (ctx.use_pbo && ctx.upload_bytes > 0) {
+        // The buffer is orphaned before it is mapped, so that the driver can
+        // hand out new memory instead of waiting for the previous upload
+        if (!ctx.pbo) { glGenBuffers(1, &ctx.pbo); }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ctx.pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, ctx.upload_bytes, nullptr, GL_STREAM_DRAW);
+        unsigned char *dst = static_cast<unsigned char *>(glMapBufferRange(
+            GL_PIXEL_UNPACK_BUFFER, 0, ctx.upload_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (dst) {
+            std::size_t offset = 0;
+            for (std::size_t i = 0; i < spans.size(); ++i) {
+                std::size_t size = (spans[i].second - spans[i].first) * row_size;
+                std::memcpy(dst + offset, &frame.pixels[spans[i].first * row_size], size);
+                offset += size;
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            offset = 0;
+            for (std::size_t i = 0; i < spans.size(); ++i) {
+                int rows = spans[i].second - spans[i].first;
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, spans[i].first, frame.width, rows, GL_RGBA,
+                                types[frame.format], reinterpret_cast<const void *>(offset));
+                offset += rows * row_size;
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    else {
+        for (std::size_t i = 0; i < spans.size(); ++i) {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, spans[i].first, frame.width, spans[i].second - spans[i].first,
+                            GL_RGBA, types[frame.format], &frame.pixels[spans[i].first * row_size]);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 void initializeTrackball(Context &ctx)
 {
     double radius = double(std::min(ctx.width, ctx.height)) / 2.0;
@@ -95,39 +191,58 @@ void init(Context &ctx)
         cg::loadShaderProgram(shaderDir() + "draw_image.vert", shaderDir() + "draw_image.frag");
     createImageTexture(&ctx.texture, ctx.rtx.width, ctx.rtx.height);
 
-    // Set up ray tracing scene
+    // Set up ray tracing scene, where loaded meshes and their BVHs are
+    // cached for faster startup
+    ctx.rtx.scene_cache_dir = getEnvVar("RT_VIEWER_ROOT") + "/cache";
     rt::setupScene(ctx.rtx, (modelDir() + "bunny_lowpoly.obj").c_str());
+    ctx.renderer.reset(new rt::RenderThread(ctx.rtx));
 
     initializeTrackball(ctx);
 }
 
 void updateRayTracing(Context &ctx)
 {
-    // Check for convergence
-    if (ctx.rtx.current_frame >= ctx.rtx.max_frames) { return; }
-
-    // Render as much as we can within the current frame
-    float tic = glfwGetTime();
-    while (true) {
-        rt::updateImage(ctx.rtx);
-        if (glfwGetTime() - tic > (1.0f / 60.0f)) { break; }
+    // Rendering runs on a separate thread. The settings in ctx.rtx are sent
+    // to it every frame, where resetAccumulation() marks a reset (e.g., when
+    // the camera moved), and the progress is read back from the latest pass.
+    bool reset = ctx.rtx.current_frame < 0;
+    ctx.renderer->update(ctx.rtx, reset);
+    if (reset) { ctx.rtx.current_frame = 0; }
+    static double last_time = glfwGetTime();
+    double time = glfwGetTime();
+    std::size_t bytes = 0;
+    if (ctx.renderer->poll()) {
+        const rt::RenderedFrame &frame = ctx.renderer->frame();
+        ctx.rtx.current_frame = frame.current_frame;
+        ctx.rtx.converged_fraction = frame.converged_fraction;
+        ctx.rtx.num_rays = frame.num_rays;
+        ctx.rtx.counters = frame.counters;
+        ctx.rtx.pass_counters = frame.pass_counters;
+        uploadFrame(ctx, frame);
+        bytes = ctx.upload_bytes;
+    }
+    if (time > last_time) {
+        double alpha = glm::min(1.0, (time - last_time) * 2.0);
+        ctx.upload_rate += alpha * (bytes / (time - last_time) - ctx.upload_rate);
     }
+    last_time = time;
 }
 
 void drawImage(Context &ctx)
 {
-    // Bind texture and upload new image from the ray tracing
+    // Bind texture, which holds the latest pass from the render thread
+    // (the denoised image or an AOV if these are enabled)
+    const rt::RenderedFrame &frame = ctx.renderer->frame();
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, ctx.texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, ctx.rtx.width, ctx.rtx.height, 0, GL_RGBA, GL_FLOAT,
-                 &ctx.rtx.image[0]);
 
     // Activate program and pass uniform for texture unit
     glUseProgram(ctx.program);
     glUniform1i(glGetUniformLocation(ctx.program, "u_texture"), 0);
 
     // Pass other uniforms
-    glUniform1i(glGetUniformLocation(ctx.program, "u_performGammaCorrection"), ctx.rtx.perform_gamma_correction);
+    glUniform1i(glGetUniformLocation(ctx.program, "u_performGammaCorrection"),
+                ctx.rtx.perform_gamma_correction && !frame.gamma_corrected);
 
     // Draw fullscreen quad (without any vertex buffers)
     glBindVertexArray(ctx.emptyVAO);
@@ -144,9 +259,64 @@ void showGui(Context &ctx)
     if (ImGui::ColorEdit3("Ground color", &ctx.rtx.ground_color[0])) {
         rt::resetAccumulation(ctx.rtx);
     }
+    {
+        const char* environments[] = { "None (sky and ground)", "Forrest", "LarnacaCastle", "LarnacaCastle2", "RomeChurch" };
+        if (ImGui::Combo("Environment map", &ctx.environment, environments, 5)) {
+            std::string dirname = ctx.environment > 0 ? cubemapDir() + environments[ctx.environment] : std::string();
+            ctx.rtx.environment_map = dirname;
+            ctx.renderer->synchronize([&](rt::RTContext &rtx) {
+                rtx.environment_map = dirname;
+                rt::loadEnvironment(rtx);
+            }, true);
+            rt::resetAccumulation(ctx.rtx);
+        }
+        if (ctx.environment > 0 &&
+            ImGui::SliderFloat("Environment intensity", &ctx.rtx.environment_intensity, 0.0f, 4.0f)) {
+            rt::resetAccumulation(ctx.rtx);
+        }
+        if (ImGui::Checkbox("Light sampling", &ctx.rtx.light_sampling)) { rt::resetAccumulation(ctx.rtx); }
+        if (ctx.environment > 0 && ImGui::Checkbox("Prefiltered environment", &ctx.rtx.prefiltered_environment)) {
+            bool prefiltered = ctx.rtx.prefiltered_environment;
+            ctx.renderer->synchronize([&](rt::RTContext &rtx) {
+                rtx.prefiltered_environment = prefiltered;
+                rt::loadEnvironment(rtx);
+            }, true);
+            rt::resetAccumulation(ctx.rtx);
+        }
+    }
     // Add more settings and parameters here
+    {
+        const char* scenes[rt::NUM_SCENES];
+        for (int i = 0; i < rt::NUM_SCENES; ++i) scenes[i] = rt::sceneName(i);
+        if (ImGui::Combo("Scene", &ctx.rtx.scene, scenes, rt::NUM_SCENES)) {
+            std::string filename = modelDir() + "bunny_lowpoly.obj";
+            int scene = ctx.rtx.scene;
+            ctx.renderer->synchronize([&](rt::RTContext &rtx) {
+                rtx.scene = scene;
+                rt::setupScene(rtx, filename.c_str());
+            }, true);
+            rt::resetAccumulation(ctx.rtx);
+        }
+        if (ctx.rtx.scene == rt::SCENE_BUNNY_FIELD) {
+            ImGui::Checkbox("Animate instances", &ctx.animate_instances);
+        }
+    }
     if (ImGui::DragFloat("Vertical FOV", &ctx.rtx.vfov)) { rt::resetAccumulation(ctx.rtx); }
     if (ImGui::Checkbox("Show normals", &ctx.rtx.show_normals)) { rt::resetAccumulation(ctx.rtx); }
+    {
+        const char* modes[] = { "Off", "Primary ray", "Full path" };
+        bool changed = ImGui::Combo("Traversal heatmap", &ctx.rtx.heatmap, modes, rt::NUM_HEATMAP_MODES);
+        if (ctx.rtx.heatmap != rt::HEATMAP_OFF) {
+            const char* metrics[] = { "BVH nodes", "Primitive tests", "Nodes + tests" };
+            changed |= ImGui::Combo("Heatmap cost", &ctx.rtx.heatmap_metric, metrics, rt::NUM_HEATMAP_METRICS);
+            changed |= ImGui::SliderFloat("Heatmap max", &ctx.rtx.heatmap_max, 1.0f, 1000.0f, "%.0f", 3.0f);
+            changed |= ImGui::Checkbox("Logarithmic scale", &ctx.rtx.heatmap_log);
+            ImGui::Text("Blue: 0, green: %.0f, red: %.0f, white: over %.0f",
+                        ctx.rtx.heatmap_log ? std::pow(1.0f + ctx.rtx.heatmap_max, 0.5f) - 1.0f : ctx.rtx.heatmap_max * 0.5f,
+                        ctx.rtx.heatmap_max, ctx.rtx.heatmap_max);
+        }
+        if (changed) { rt::resetAccumulation(ctx.rtx); }
+    }
     if (ImGui::Checkbox("Perform Antialiasing", &ctx.rtx.perform_antialiasing)) { rt::resetAccumulation(ctx.rtx); }
     if (ImGui::Checkbox("Perform Gamma correction", &ctx.rtx.perform_gamma_correction)) { rt::resetAccumulation(ctx.rtx); }
     {
@@ -156,13 +326,103 @@ void showGui(Context &ctx)
             "Random in unit hemisphere" };
         ImGui::Combo("Diffuse method", &ctx.rtx.diffuse_method, items, 3);
     }
+    {
+        const char* builders[] = { "Median split", "Binned SAH", "Parallel LBVH" };
+        bool rebuild = ImGui::Combo("BVH builder", &ctx.rtx.bvh_builder, builders, 3);
+        rebuild |= ImGui::SliderInt("BVH max leaf size", &ctx.rtx.bvh_max_leaf_size, 1, 16);
+        rebuild |= ImGui::SliderFloat("BVH traversal cost", &ctx.rtx.bvh_traversal_cost, 0.1f, 4.0f);
+        std::string width4 = std::string("4 (") + rt::bvhSimdName(4) + ")";
+        std::string width8 = std::string("8 (") + rt::bvhSimdName(8) + ")";
+        const char* widths[] = { "2 (binary)", width4.c_str(), width8.c_str() };
+        int width_index = ctx.rtx.bvh_width == 8 ? 2 : (ctx.rtx.bvh_width == 4 ? 1 : 0);
+        if (ImGui::Combo("BVH width", &width_index, widths, 3)) {
+            ctx.rtx.bvh_width = 2 << width_index;
+            rebuild = true;
+        }
+        if (rebuild) {
+            const rt::RTContext &settings = ctx.rtx;
+            ctx.renderer->synchronize([&](rt::RTContext &rtx) {
+                rtx.bvh_builder = settings.bvh_builder;
+                rtx.bvh_max_leaf_size = settings.bvh_max_leaf_size;
+                rtx.bvh_traversal_cost = settings.bvh_traversal_cost;
+                rtx.bvh_width = settings.bvh_width;
+                rt::rebuildBvh(rtx);
+            }, true);
+            rt::resetAccumulation(ctx.rtx);
+        }
+    }
+    {
+        const char* sizes[] = { "Off", "4 rays", "8 rays", "16 rays" };
+        int size_index = ctx.rtx.packet_size >= 16 ? 3 : (ctx.rtx.packet_size >= 8 ? 2 : (ctx.rtx.packet_size >= 4 ? 1 : 0));
+        if (ImGui::Combo("Primary ray packets", &size_index, sizes, 4)) {
+            ctx.rtx.packet_size = size_index == 0 ? 1 : 2 << size_index;
+        }
+    }
+    ImGui::Checkbox("Wavefront integrator", &ctx.rtx.wavefront);
+    if (ImGui::Checkbox("Adaptive sampling", &ctx.rtx.adaptive_sampling)) { rt::resetAccumulation(ctx.rtx); }
+    if (ImGui::SliderFloat("Noise threshold", &ctx.rtx.adaptive_threshold, 0.001f, 0.1f, "%.3f")) {
+        rt::resetAccumulation(ctx.rtx);
+    }
+    {
+        ImGui::Checkbox("Denoise", &ctx.rtx.denoise);
+        if (ctx.rtx.denoise) {
+            ImGui::SliderInt("Denoiser passes", &ctx.rtx.denoise_iterations, 1, 8);
+            ImGui::SliderFloat("Luminance sigma", &ctx.rtx.denoise_sigma_luminance, 0.5f, 16.0f);
+            ImGui::SliderFloat("Normal sigma", &ctx.rtx.denoise_sigma_normal, 1.0f, 256.0f);
+            ImGui::SliderFloat("Depth sigma", &ctx.rtx.denoise_sigma_depth, 0.1f, 8.0f);
+            ImGui::SliderFloat("Albedo sigma", &ctx.rtx.denoise_sigma_albedo, 0.01f, 1.0f);
+        }
+    }
+    {
+        const char* names[rt::NUM_AOVS + 1] = { "Image" };
+        for (int i = 0; i < rt::NUM_AOVS; ++i) names[i + 1] = rt::aovName(rt::Aov(i));
+        int index = ctx.rtx.display_aov + 1;
+        if (ImGui::Combo("Display", &index, names, rt::NUM_AOVS + 1)) { ctx.rtx.display_aov = index - 1; }
+        if (ImGui::Button("Export AOVs")) {
+            ctx.renderer->synchronize([](rt::RTContext &rtx) { rt::saveAovs(rtx, "aov"); }, false);
+        }
+    }
+    {
+        const char* formats[] = { "RGBA32F", "RGBA16F", "RGBA8" };
+        ImGui::Combo("Upload format", &ctx.rtx.display_format, formats, 3);
+        ImGui::Checkbox("Stream through PBO", &ctx.use_pbo);
+        ImGui::Text("Upload: %.1f KB/pass, %.1f MB/s", ctx.upload_bytes / 1024.0, ctx.upload_rate / 1e6);
+    }
+    if (ImGui::CollapsingHeader("Performance counters")) {
+        ImGui::Checkbox("Collect counters", &ctx.rtx.collect_counters);
+        const rt::PerfCounters &pass = ctx.rtx.pass_counters;
+        const rt::PerfCounters &total = ctx.rtx.counters;
+        ImGui::Text("Last pass: %.2f ms, %.2f Mrays/s", pass.ms_per_pass(), pass.rays_per_second() * 1e-6);
+        ImGui::Text("Average of %llu passes: %.2f ms, %.2f Mrays/s", (unsigned long long)total.passes,
+                    total.ms_per_pass(), total.rays_per_second() * 1e-6);
+        ImGui::Text("BVH nodes/ray: %.2f, primitive tests/ray: %.2f", total.nodes_per_ray(), total.tests_per_ray());
+        float rays[rt::PerfCounters::max_depth];
+        int num_depths = glm::clamp(ctx.rtx.max_bounces + 1, 1, int(rt::PerfCounters::max_depth));
+        for (int i = 0; i < num_depths; ++i) rays[i] = float(pass.rays[i]);
+        ImGui::PlotHistogram("Rays by depth", rays, num_depths, 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+        for (int i = 0; i < rt::PerfCounters::num_material_types; ++i) {
+            ImGui::Text("Hits (%s): %llu", rt::materialTypeName(i), (unsigned long long)pass.material_hits[i]);
+        }
+        bool log = !ctx.rtx.counters_csv.empty();
+        if (ImGui::Checkbox("Log to counters.csv", &log)) { ctx.rtx.counters_csv = log ? "counters.csv" : ""; }
+        ImGui::SliderFloat("Log interval (s)", &ctx.rtx.counters_csv_interval, 0.0f, 10.0f);
+    }
     // ...
 
-    ImGui::Text("Progress");
-    ImGui::ProgressBar(float(ctx.rtx.current_frame) / ctx.rtx.max_frames);
+    if (ctx.rtx.adaptive_sampling) {
+        ImGui::Text("Converged pixels");
+        ImGui::ProgressBar(ctx.rtx.converged_fraction);
+    }
+    else {
+        ImGui::Text("Progress");
+        ImGui::ProgressBar(float(ctx.rtx.current_frame) / ctx.rtx.max_frames);
+    }
     if (ImGui::Button("Freeze/Resume")) { ctx.rtx.freeze = !ctx.rtx.freeze; }
     ImGui::SameLine();
-    if (ImGui::Button("Reset")) { rt::resetImage(ctx.rtx); }
+    if (ImGui::Button("Reset")) {
+        ctx.renderer->synchronize([](rt::RTContext &rtx) { rt::resetImage(rtx); }, true);
+        ctx.rtx.freeze = false;
+    }
 }
 
 void display(Context &ctx)
@@ -176,6 +436,14 @@ void display(Context &ctx)
     ctx.rtx.view = glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
     if (ctx.trackball.tracking) { rt::resetAccumulation(ctx.rtx); }
 
+    // Moving instances only rebuilds the top-level BVH, which is fast
+    // enough to do every frame. The render thread poses them at the new
+    // time before its next pass, so the GUI does not wait for it.
+    if (ctx.animate_instances && ctx.rtx.scene == rt::SCENE_BUNNY_FIELD) {
+        ctx.rtx.instance_time = ctx.elapsed_time;
+        rt::resetAccumulation(ctx.rtx);
+    }
+
     // Update and draw ray tracing image
     updateRayTracing(ctx);
     drawImage(ctx);
@@ -265,9 +533,10 @@ void resizeCallback(GLFWwindow *window, int width, int height)
     ctx->trackball.center = glm::vec2(width, height) / 2.0f;
     glViewport(0, 0, width, height);
 
+    // The render thread reallocates its image when the size changes
     ctx->rtx.width = width;
     ctx->rtx.height = height;
-    rt::resetImage(ctx->rtx);
+    rt::resetAccumulation(ctx->rtx);
 }
 
 void scroll_callback(GLFWwindow *window, double x, double y)
@@ -333,6 +602,7 @@ int main(void)
     }
 
     // Shutdown
+    ctx.renderer.reset();
     glfwDestroyWindow(ctx.window);
     glfwTerminate();
     std::exit(EXIT_SUCCESS);
@@ -14,6 +14,11 @@ class AABB {
         glm::vec3 min() const { return minimum; }
         glm::vec3 max() const { return maximum; }
 
+        float surface_area() const {
+            glm::vec3 d = maximum - minimum;
+            return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+
         // "Standard" bounding box hit method
         // bool hit(const Ray& r, double t_min, double t_max) const {
         //     for (int a = 0; a < 3; a++) {
@@ -49,7 +54,21 @@ class AABB {
         glm::vec3 maximum;
 };
 
-AABB surrounding_box(AABB box0, AABB box1) {
+// Slab test against the box [bmin, bmax] with a precomputed inverse ray
+// direction, which avoids the per-axis divide in AABB::hit(). On a hit,
+// t_enter is set to the distance where the ray enters the box.
+inline bool hit_slabs(const glm::vec3& bmin, const glm::vec3& bmax, const glm::vec3& origin,
+                      const glm::vec3& inv_dir, float t_min, float t_max, float& t_enter) {
+    glm::vec3 t0 = (bmin - origin) * inv_dir;
+    glm::vec3 t1 = (bmax - origin) * inv_dir;
+    glm::vec3 t_near = glm::min(t0, t1);
+    glm::vec3 t_far = glm::max(t0, t1);
+    t_enter = glm::max(t_min, glm::max(t_near.x, glm::max(t_near.y, t_near.z)));
+    float t_exit = glm::min(t_max, glm::min(t_far.x, glm::min(t_far.y, t_far.z)));
+    return t_enter <= t_exit;
+}
+
+inline AABB surrounding_box(AABB box0, AABB box1) {
     glm::vec3 small(fmin(box0.min().x, box1.min().x),
                     fmin(box0.min().y, box1.min().y),
                     fmin(box0.min().z, box1.min().z));
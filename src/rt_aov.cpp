@@ -0,0 +1,133 @@
+#include "rt_raytracing.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+namespace rt {
+
+const char *aovName(Aov aov)
+{
+    const char *names[NUM_AOVS] = { "depth", "normal", "albedo", "material_id", "object_id", "primitive_id", "bounces" };
+    return aov >= 0 && aov < NUM_AOVS ? names[aov] : "";
+}
+
+// Pixel values of the AOVs, averaged over the samples. IDs are returned as
+// floats, with -1 for the background.
+static float aovValue(const AovBuffers &aovs, Aov aov, size_t i, int channel)
+{
+    float count = glm::max(aovs.num_samples[i], 1.0f);
+    switch (aov) {
+    case AOV_DEPTH: return aovs.depth[i] / count;
+    case AOV_NORMAL: {
+        glm::vec3 n = aovs.normal[i];
+        float len = glm::length(n);
+        return len > 0.0f ? n[channel] / len : 0.0f;
+    }
+    case AOV_ALBEDO: return aovs.albedo[i][channel] / count;
+    case AOV_MATERIAL_ID: return aovs.material_id[i] == ~0u ? -1.0f : float(aovs.material_id[i]);
+    case AOV_OBJECT_ID: return aovs.object_id[i] == ~0u ? -1.0f : float(aovs.object_id[i]);
+    case AOV_PRIMITIVE_ID: return aovs.primitive_id[i] == ~0u ? -1.0f : float(aovs.primitive_id[i]);
+    case AOV_BOUNCES: return aovs.bounces[i] / count;
+    default: return 0.0f;
+    }
+}
+
+static int aovChannels(Aov aov)
+{
+    return aov == AOV_NORMAL || aov == AOV_ALBEDO ? 3 : 1;
+}
+
+// Color for an ID, from a hash so that neighbouring IDs differ
+static glm::vec3 idColor(std::uint32_t id)
+{
+    if (id == ~0u) return glm::vec3(0.0f);
+    std::uint32_t h = id * 2654435761u;
+    h ^= h >> 15;
+    h *= 2246822519u;
+    h ^= h >> 13;
+    return glm::vec3(float(h & 255u), float((h >> 8) & 255u), float((h >> 16) & 255u)) / 255.0f;
+}
+
+// Writes a false-color image of an AOV to output, e.g., for display
+void aovImage(const RTContext &rtx, Aov aov, std::vector<glm::vec4> &output)
+{
+    const AovBuffers &aovs = rtx.aovs;
+    const size_t n = size_t(rtx.width) * size_t(rtx.height);
+    output.assign(n, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    if (aovs.num_samples.size() < n) return;
+
+    // Depth is shown relative to the farthest surface, where the background
+    // is black
+    float max_depth = 0.0f;
+    if (aov == AOV_DEPTH) {
+        for (size_t i = 0; i < n; ++i) {
+            float depth = aovValue(aovs, aov, i, 0);
+            if (depth < 1e3f) max_depth = glm::max(max_depth, depth);
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        glm::vec3 c(0.0f);
+        switch (aov) {
+        case AOV_DEPTH: {
+            float depth = aovValue(aovs, aov, i, 0);
+            c = glm::vec3(depth < 1e3f && max_depth > 0.0f ? 1.0f - depth / max_depth : 0.0f);
+            break;
+        }
+        case AOV_NORMAL:
+            for (int k = 0; k < 3; ++k) c[k] = aovValue(aovs, aov, i, k) * 0.5f + 0.5f;
+            break;
+        case AOV_ALBEDO:
+            for (int k = 0; k < 3; ++k) c[k] = aovValue(aovs, aov, i, k);
+            break;
+        case AOV_MATERIAL_ID: c = idColor(aovs.material_id[i]); break;
+        case AOV_OBJECT_ID: c = idColor(aovs.object_id[i]); break;
+        case AOV_PRIMITIVE_ID: c = idColor(aovs.primitive_id[i]); break;
+        case AOV_BOUNCES: c = glm::vec3(aovValue(aovs, aov, i, 0) / float(glm::max(rtx.max_bounces, 1))); break;
+        default: break;
+        }
+        output[i] = glm::vec4(c, 1.0f);
+    }
+}
+
+// Writes channels of float pixels to a PFM file, whose rows are stored
+// bottom-up like the image
+static bool savePFM(const std::string &filename, int width, int height, int channels, const std::vector<float> &data)
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: cannot write " << filename << std::endl;
+        return false;
+    }
+    file << (channels == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";  // Little endian
+    file.write(reinterpret_cast<const char *>(&data[0]), data.size() * sizeof(float));
+    return bool(file);
+}
+
+// Writes the image and all AOVs as <prefix>_<name>.pfm files
+bool saveAovs(const RTContext &rtx, const std::string &prefix)
+{
+    const size_t n = size_t(rtx.width) * size_t(rtx.height);
+    if (n == 0 || rtx.image.size() < n || rtx.aovs.num_samples.size() < n) return false;
+
+    std::vector<float> data(n * 3);
+    for (size_t i = 0; i < n; ++i) {
+        const glm::vec4 &c = rtx.image[i];
+        for (int k = 0; k < 3; ++k) data[i * 3 + k] = c[k] / glm::max(c.a, 1.0f);
+    }
+    bool ok = savePFM(prefix + "_color.pfm", rtx.width, rtx.height, 3, data);
+
+    for (int a = 0; a < NUM_AOVS; ++a) {
+        Aov aov = Aov(a);
+        int channels = aovChannels(aov);
+        data.resize(n * channels);
+        for (size_t i = 0; i < n; ++i) {
+            for (int k = 0; k < channels; ++k) data[i * channels + k] = aovValue(rtx.aovs, aov, i, k);
+        }
+        ok &= savePFM(prefix + "_" + aovName(aov) + ".pfm", rtx.width, rtx.height, channels, data);
+    }
+    return ok;
+}
+
+}  // namespace rt
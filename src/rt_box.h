@@ -7,18 +7,18 @@ namespace rt {
 class Box : public Hitable {
   public:
     Box() {}
-    Box(const glm::vec3 &cen, const glm::vec3 r, shared_ptr<Material> m) : center(cen), radius(r), mat_ptr(m){};
+    Box(const glm::vec3 &cen, const glm::vec3 r, std::uint32_t m) : center(cen), radius(r), mat_id(m){};
     
     virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const;
 
     glm::vec3 center;
     glm::vec3 radius;
-    shared_ptr<Material> mat_ptr;
+    std::uint32_t mat_id;
 };
 
 // Ray-box test adapted from branchless code at
 // https://tavianator.com/fast-branchless-raybounding-box-intersections/
-bool Box::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const
+inline bool Box::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const
 {
     glm::vec3 oc = r.origin() - center;
     glm::vec3 t0 = (-radius - oc) / r.direction();
@@ -32,7 +32,8 @@ bool Box::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord
         glm::vec3 npc = (rec.p - center) / radius;
         rec.normal = glm::sign(npc) * glm::step(glm::compMax(glm::abs(npc)), glm::abs(npc));
         rec.set_face_normal(r, rec.normal);
-        rec.mat_ptr = mat_ptr;
+        rec.mat_id = mat_id;
+        rec.prim_id = 0;
         return true;
     }
     return false;
@@ -2,6 +2,7 @@
 
 #include "rt_weekend.h"
 
+#include "rt_counters.h"
 #include "rt_hitable.h"
 #include "rt_hitable_list.h"
 
@@ -14,19 +15,29 @@ class BvhNode : public Hitable {
     public:
         BvhNode();
 
-        BvhNode(const HitableList& list, double time0, double time1)
-            : BvhNode(list.objects, 0, list.objects.size(), time0, time1)
-        {}
+        BvhNode(const HitableList& list, double time0, double time1) {
+            auto objects = list.objects; // Create a modifiable array of the source scene objects
+            build(objects, 0, objects.size(), time0, time1);
+        }
 
+        // Sorts the objects in [start, end) in place, so the array is only
+        // copied once for the whole tree
         BvhNode(
-            const std::vector<shared_ptr<Hitable>>& src_objects,
-            size_t start, size_t end, double time0, double time1);
+            std::vector<shared_ptr<Hitable>>& objects,
+            size_t start, size_t end, double time0, double time1) {
+            build(objects, start, end, time0, time1);
+        }
 
         virtual bool hit(
             RTContext &rtx, const Ray& r, float t_min, float t_max, HitRecord& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, AABB& output_box) const override;
 
+    private:
+        void build(
+            std::vector<shared_ptr<Hitable>>& objects,
+            size_t start, size_t end, double time0, double time1);
+
     public:
         shared_ptr<Hitable> left;
         shared_ptr<Hitable> right;
@@ -44,24 +55,22 @@ inline bool box_compare(const shared_ptr<Hitable> a, const shared_ptr<Hitable> b
 }
 
 
-bool box_x_compare (const shared_ptr<Hitable> a, const shared_ptr<Hitable> b) {
+inline bool box_x_compare (const shared_ptr<Hitable> a, const shared_ptr<Hitable> b) {
     return box_compare(a, b, 0);
 }
 
-bool box_y_compare (const shared_ptr<Hitable> a, const shared_ptr<Hitable> b) {
+inline bool box_y_compare (const shared_ptr<Hitable> a, const shared_ptr<Hitable> b) {
     return box_compare(a, b, 1);
 }
 
-bool box_z_compare (const shared_ptr<Hitable> a, const shared_ptr<Hitable> b) {
+inline bool box_z_compare (const shared_ptr<Hitable> a, const shared_ptr<Hitable> b) {
     return box_compare(a, b, 2);
 }
 
-BvhNode::BvhNode(
-    const std::vector<shared_ptr<Hitable>>& src_objects,
+inline void BvhNode::build(
+    std::vector<shared_ptr<Hitable>>& objects,
     size_t start, size_t end, double time0, double time1
 ) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
-
     int axis = random_int(0,2);
     auto comparator = (axis == 0) ? box_x_compare
                     : (axis == 1) ? box_y_compare
@@ -97,12 +106,13 @@ BvhNode::BvhNode(
     box = surrounding_box(box_left, box_right);
 }
 
-bool BvhNode::bounding_box(double time0, double time1, AABB& output_box) const {
+inline bool BvhNode::bounding_box(double time0, double time1, AABB& output_box) const {
     output_box = box;
     return true;
 }
 
-bool BvhNode::hit(RTContext &rtx, const Ray& r, float t_min, float t_max, HitRecord& rec) const {
+inline bool BvhNode::hit(RTContext &rtx, const Ray& r, float t_min, float t_max, HitRecord& rec) const {
+    if (PerfCounters *counters = threadCounters()) counters->node_visits += 1;
     if (!box.hit(r, t_min, t_max))
         return false;
 
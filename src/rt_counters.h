@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+namespace rt {
+
+// Counters of the work done by the renderer. Each render thread counts into
+// a PerfCounters of its own without atomics or shared cache lines, and the
+// counters of the threads are merged after each pass (see updateFrame()).
+struct PerfCounters {
+    static const int max_depth = 16;          // Rays of deeper bounces are counted at max_depth - 1
+    static const int num_material_types = 5;  // Same as NUM_MATERIAL_TYPES
+
+    std::uint64_t rays[max_depth];  // Rays traced per bounce depth, where 0 is the primary rays
+    std::uint64_t node_visits;      // BVH nodes visited, in the scene and in meshes (once per ray packet)
+    std::uint64_t primitive_tests;  // Objects and triangles tested in BVH leaves (once per ray packet)
+    std::uint64_t material_hits[num_material_types];  // Hits shaded per MaterialType
+    std::uint64_t passes;
+    double sample_seconds;  // Time spent tracing tiles, summed over the threads
+    double pass_seconds;    // Wall-clock time of the passes
+
+    PerfCounters() { reset(); }
+
+    void reset() {
+        std::fill(rays, rays + max_depth, 0);
+        std::fill(material_hits, material_hits + num_material_types, 0);
+        node_visits = primitive_tests = passes = 0;
+        sample_seconds = pass_seconds = 0.0;
+    }
+
+    void add(const PerfCounters &other) {
+        for (int i = 0; i < max_depth; ++i) rays[i] += other.rays[i];
+        for (int i = 0; i < num_material_types; ++i) material_hits[i] += other.material_hits[i];
+        node_visits += other.node_visits;
+        primitive_tests += other.primitive_tests;
+        passes += other.passes;
+        sample_seconds += other.sample_seconds;
+        pass_seconds += other.pass_seconds;
+    }
+
+    std::uint64_t total_rays() const {
+        std::uint64_t total = 0;
+        for (int i = 0; i < max_depth; ++i) total += rays[i];
+        return total;
+    }
+
+    double rays_per_second() const { return pass_seconds > 0.0 ? total_rays() / pass_seconds : 0.0; }
+    double nodes_per_ray() const { return total_rays() ? double(node_visits) / total_rays() : 0.0; }
+    double tests_per_ray() const { return total_rays() ? double(primitive_tests) / total_rays() : 0.0; }
+    double ms_per_pass() const { return passes ? pass_seconds * 1e3 / passes : 0.0; }
+};
+
+inline const char *materialTypeName(int material_type)
+{
+    const char *names[PerfCounters::num_material_types] = { "lambertian", "metal", "dielectric", "emissive", "other" };
+    return material_type >= 0 && material_type < PerfCounters::num_material_types ? names[material_type] : "";
+}
+
+// Counters of the calling render thread, or nullptr if nothing is counted
+inline PerfCounters *&threadCounters()
+{
+    static thread_local PerfCounters *counters = nullptr;
+    return counters;
+}
+
+inline void countRays(int depth, std::uint64_t n = 1)
+{
+    if (PerfCounters *counters = threadCounters()) {
+        counters->rays[std::min(std::max(depth, 0), PerfCounters::max_depth - 1)] += n;
+    }
+}
+
+inline void countHits(int material_type, std::uint64_t n = 1)
+{
+    PerfCounters *counters = threadCounters();
+    if (counters && material_type >= 0 && material_type < PerfCounters::num_material_types) {
+        counters->material_hits[material_type] += n;
+    }
+}
+
+// Node visits and primitive tests of one BVH traversal. They are counted in
+// registers and added to the counters of the thread when the traversal ends.
+struct TraversalCount {
+    std::uint32_t nodes = 0;
+    std::uint32_t primitives = 0;
+
+    ~TraversalCount() {
+        if (PerfCounters *counters = threadCounters()) {
+            counters->node_visits += nodes;
+            counters->primitive_tests += primitives;
+        }
+    }
+};
+
+// Appends the counters as a row of a CSV file, with a header if the file is
+// new. time is the time of the row, e.g., seconds since the start.
+inline bool appendCountersCsv(const std::string &filename, const PerfCounters &c, double time)
+{
+    bool is_new;
+    {
+        std::ifstream existing(filename.c_str(), std::ios::binary | std::ios::ate);
+        is_new = !existing || existing.tellg() <= 0;
+    }
+    std::ofstream file(filename.c_str(), std::ios::app);
+    if (!file) return false;
+    if (is_new) {
+        file << "time_s,passes,pass_s,sample_s,rays";
+        for (int i = 0; i < PerfCounters::max_depth; ++i) file << ",rays_depth" << i;
+        file << ",node_visits,primitive_tests";
+        for (int i = 0; i < PerfCounters::num_material_types; ++i) file << ",hits_" << materialTypeName(i);
+        file << ",mrays_per_s,nodes_per_ray,tests_per_ray,ms_per_pass\n";
+    }
+    file << time << "," << c.passes << "," << c.pass_seconds << "," << c.sample_seconds << "," << c.total_rays();
+    for (int i = 0; i < PerfCounters::max_depth; ++i) file << "," << c.rays[i];
+    file << "," << c.node_visits << "," << c.primitive_tests;
+    for (int i = 0; i < PerfCounters::num_material_types; ++i) file << "," << c.material_hits[i];
+    file << "," << c.rays_per_second() * 1e-6 << "," << c.nodes_per_ray() << "," << c.tests_per_ray() << ","
+         << c.ms_per_pass() << "\n";
+    return bool(file);
+}
+
+}  // namespace rt
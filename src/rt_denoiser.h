@@ -0,0 +1,244 @@
+#pragma once
+
+#include "rt_raytracing.h"
+#include "rt_tile_scheduler.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+namespace rt {
+
+// Edge-aware a-trous wavelet denoiser for the progressive image, after the
+// spatial filter of "Spatiotemporal Variance-Guided Filtering" (Schied et
+// al., HPG 2017). Each pass blurs the image with a 5x5 B3-spline kernel whose
+// taps are spread 1, 2, 4, ... pixels apart. The weight of a tap falls off
+// with the difference in first-hit normal, depth and albedo, and with the
+// difference in luminance relative to the estimated noise of the pixel, so
+// that edges and converged detail are kept.
+//
+// The image is filtered into a separate buffer, and the accumulated samples
+// are not modified.
+class Denoiser {
+  public:
+    // Writes the denoised rtx.image to output, with alpha 1
+    void denoise(const RTContext &rtx, TileScheduler &scheduler, std::vector<glm::vec4> &output) {
+        width = rtx.width;
+        height = rtx.height;
+        const size_t n = size_t(width) * size_t(height);
+        output.resize(n);
+        if (n == 0 || rtx.image.size() < n || rtx.sample_stats.size() < n || rtx.aovs.num_samples.size() < n) {
+            return;
+        }
+        for (int k = 0; k < 2; ++k) color[k].resize(n);
+        guides.resize(n);
+
+        // Rows are processed in bands, one band per scheduler tile
+        const int band_size = 8;
+        const int num_bands = (height + band_size - 1) / band_size;
+        rows.resize(scheduler.size());
+
+        scheduler.run(num_bands, [&](int band, int) {
+            for (int y = band * band_size; y < glm::min(height, (band + 1) * band_size); ++y) {
+                for (int x = 0; x < width; ++x) load(rtx, y * width + x);
+            }
+        });
+        scheduler.run(num_bands, [&](int band, int) {
+            for (int y = band * band_size; y < glm::min(height, (band + 1) * band_size); ++y) {
+                for (int x = 0; x < width; ++x) depth_gradient(x, y);
+            }
+        });
+
+        int src = 0;
+        for (int i = 0; i < rtx.denoise_iterations; ++i) {
+            scheduler.run(num_bands, [&](int band, int worker) {
+                for (int y = band * band_size; y < glm::min(height, (band + 1) * band_size); ++y) {
+                    filter_row(rtx, y, 1 << i, color[src], color[1 - src], rows[worker]);
+                }
+            });
+            src = 1 - src;
+        }
+
+        const Planes &result = color[src];
+        for (size_t i = 0; i < n; ++i) {
+            output[i] = glm::vec4(result.r[i], result.g[i], result.b[i], 1.0f);
+        }
+    }
+
+  private:
+    // Filtered color, its luminance, and the variance of the luminance
+    struct Planes {
+        std::vector<float> r, g, b, lum, var;
+
+        void resize(size_t n) {
+            r.resize(n); g.resize(n); b.resize(n);
+            lum.resize(n); var.resize(n);
+        }
+    };
+
+    // Per-pixel guides: first-hit normal, distance with its screen-space
+    // gradient, and albedo
+    struct Guides {
+        std::vector<float> nx, ny, nz;
+        std::vector<float> depth, grad_x, grad_y;
+        std::vector<float> ar, ag, ab;
+
+        void resize(size_t n) {
+            nx.resize(n); ny.resize(n); nz.resize(n);
+            depth.resize(n); grad_x.resize(n); grad_y.resize(n);
+            ar.resize(n); ag.resize(n); ab.resize(n);
+        }
+    };
+
+    // Scratch rows of a worker: inverse luminance tolerance and weighted sums
+    struct Rows {
+        std::vector<float> inv_sigma, w, r, g, b, var;
+    };
+
+    static float luminance(float r, float g, float b) { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
+
+    // Approximates exp(-x) for x >= 0 as (1 + x/16)^-16, which unlike expf
+    // vectorizes without -ffast-math
+    static float exp_neg(float x) {
+        float y = 1.0f / (1.0f + x * (1.0f / 16.0f));
+        y *= y; y *= y; y *= y; y *= y;
+        return y;
+    }
+
+    // Resolves the accumulated color and guides of pixel i. The variance is
+    // that of the mean luminance, i.e., the squared standard error.
+    void load(const RTContext &rtx, size_t i) {
+        Planes &c = color[0];
+        const glm::vec4 &pixel = rtx.image[i];
+        glm::vec3 rgb = pixel.a > 0.0f ? glm::vec3(pixel) / pixel.a : glm::vec3(0.0f);
+        c.r[i] = rgb.r;
+        c.g[i] = rgb.g;
+        c.b[i] = rgb.b;
+        c.lum[i] = luminance(rgb.r, rgb.g, rgb.b);
+
+        // Pixels with fewer than two samples have an unknown noise level,
+        // and are treated as very noisy
+        const glm::vec3 &stats = rtx.sample_stats[i];
+        float num = stats.x;
+        c.var[i] = 1.0f;
+        if (num >= 2.0f) { c.var[i] = stats.z / (num - 1.0f) / num; }
+
+        const AovBuffers &aovs = rtx.aovs;
+        float count = glm::max(aovs.num_samples[i], 1.0f);
+        glm::vec3 nrm = aovs.normal[i];
+        float len = glm::length(nrm);
+        nrm = len > 0.0f ? nrm / len : glm::vec3(0.0f);
+        guides.nx[i] = nrm.x;
+        guides.ny[i] = nrm.y;
+        guides.nz[i] = nrm.z;
+        guides.depth[i] = aovs.depth[i] / count;
+        guides.ar[i] = aovs.albedo[i].r / count;
+        guides.ag[i] = aovs.albedo[i].g / count;
+        guides.ab[i] = aovs.albedo[i].b / count;
+    }
+
+    // Change of depth per pixel, from the smaller of the one-sided
+    // differences so that it stays small on both sides of an edge
+    void depth_gradient(int x, int y) {
+        const std::vector<float> &d = guides.depth;
+        const size_t i = size_t(y) * width + x;
+        float left = x > 0 ? std::fabs(d[i] - d[i - 1]) : 1e30f;
+        float right = x + 1 < width ? std::fabs(d[i + 1] - d[i]) : 1e30f;
+        float down = y > 0 ? std::fabs(d[i] - d[i - width]) : 1e30f;
+        float up = y + 1 < height ? std::fabs(d[i + width] - d[i]) : 1e30f;
+        guides.grad_x[i] = width > 1 ? glm::min(left, right) : 0.0f;
+        guides.grad_y[i] = height > 1 ? glm::min(down, up) : 0.0f;
+    }
+
+    // Filters line y of src into dst with taps spaced step pixels apart
+    void filter_row(const RTContext &rtx, int y, int step, const Planes &src, Planes &dst, Rows &row) {
+        static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+        row.inv_sigma.resize(width);
+        row.w.assign(width, 0.0f);
+        row.r.assign(width, 0.0f);
+        row.g.assign(width, 0.0f);
+        row.b.assign(width, 0.0f);
+        row.var.assign(width, 0.0f);
+
+        // The luminance tolerance comes from the variance blurred with a
+        // 3x3 Gaussian, since the estimate of a single pixel is noisy
+        for (int x = 0; x < width; ++x) {
+            float sum = 0.0f, sum_w = 0.0f;
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int qx = x + dx, qy = y + dy;
+                    if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                    float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                    sum += w * src.var[size_t(qy) * width + qx];
+                    sum_w += w;
+                }
+            }
+            row.inv_sigma[x] = 1.0f / (rtx.denoise_sigma_luminance * std::sqrt(sum / sum_w) + 1e-4f);
+        }
+
+        const float sigma_normal = rtx.denoise_sigma_normal;
+        const float sigma_depth = rtx.denoise_sigma_depth;
+        const float inv_sigma_albedo2 = 1.0f / glm::max(1e-8f, rtx.denoise_sigma_albedo * rtx.denoise_sigma_albedo);
+        const size_t p0 = size_t(y) * width;
+        const float *lum = &src.lum[0], *var = &src.var[0];
+        const float *r = &src.r[0], *g = &src.g[0], *b = &src.b[0];
+        const float *nx = &guides.nx[0], *ny = &guides.ny[0], *nz = &guides.nz[0];
+        const float *depth = &guides.depth[0], *grad_x = &guides.grad_x[0], *grad_y = &guides.grad_y[0];
+        const float *ar = &guides.ar[0], *ag = &guides.ag[0], *ab = &guides.ab[0];
+        const float *inv_sigma = &row.inv_sigma[0];
+        float *sum_w = &row.w[0], *sum_r = &row.r[0], *sum_g = &row.g[0], *sum_b = &row.b[0];
+        float *sum_var = &row.var[0];
+
+        for (int ky = 0; ky < 5; ++ky) {
+            const int qy = y + (ky - 2) * step;
+            if (qy < 0 || qy >= height) continue;
+            for (int kx = 0; kx < 5; ++kx) {
+                // Taps outside the image are skipped, so the pixels of one
+                // tap form a contiguous range that is filtered with SIMD
+                const int offset = (kx - 2) * step;
+                const int x_begin = glm::max(0, -offset);
+                const int x_end = glm::min(width, width - offset);
+                const float h = kernel[kx] * kernel[ky];
+                const float dist_x = float(std::abs(kx - 2) * step), dist_y = float(std::abs(ky - 2) * step);
+                const size_t q0 = size_t(qy) * width + offset;
+
+                #pragma omp simd
+                for (int x = x_begin; x < x_end; ++x) {
+                    const size_t p = p0 + x, q = q0 + x;
+                    const float e_lum = std::fabs(lum[p] - lum[q]) * inv_sigma[x];
+                    const float n_dot = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q];
+                    const float e_normal = sigma_normal * glm::max(0.0f, 1.0f - n_dot);
+                    const float e_depth = std::fabs(depth[p] - depth[q]) /
+                        (sigma_depth * (grad_x[p] * dist_x + grad_y[p] * dist_y) + 1e-3f * depth[p] + 1e-6f);
+                    const float dr = ar[p] - ar[q], dg = ag[p] - ag[q], db = ab[p] - ab[q];
+                    const float e_albedo = (dr * dr + dg * dg + db * db) * inv_sigma_albedo2;
+                    const float w = h * exp_neg(e_lum + e_normal + e_depth + e_albedo);
+                    sum_w[x] += w;
+                    sum_r[x] += w * r[q];
+                    sum_g[x] += w * g[q];
+                    sum_b[x] += w * b[q];
+                    sum_var[x] += w * w * var[q];
+                }
+            }
+        }
+
+        // The center tap has weight h > 0, so the sums are never zero
+        for (int x = 0; x < width; ++x) {
+            const size_t p = p0 + x;
+            const float inv_w = 1.0f / sum_w[x];
+            dst.r[p] = sum_r[x] * inv_w;
+            dst.g[p] = sum_g[x] * inv_w;
+            dst.b[p] = sum_b[x] * inv_w;
+            dst.lum[p] = luminance(dst.r[p], dst.g[p], dst.b[p]);
+            dst.var[p] = sum_var[x] * inv_w * inv_w;
+        }
+    }
+
+    int width = 0;
+    int height = 0;
+    Planes color[2];  // Ping-pong buffers of the filter passes
+    Guides guides;
+    std::vector<Rows> rows;  // Per worker
+};
+
+}  // namespace rt
@@ -0,0 +1,318 @@
+#pragma once
+
+#include "rt_weekend.h"
+#include "rt_sampler.h"
+
+#include <lodepng.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace rt {
+
+// Environment map on the six faces of a cube, loaded from the PNG files
+// posx.png, negx.png, posy.png, negy.png, posz.png and negz.png of a
+// directory (e.g., cubemaps/Forrest), with the face orientations of OpenGL
+// cubemaps. The 8-bit sRGB texels are converted to linear radiance.
+//
+// For importance sampling, each texel is drawn with a probability
+// proportional to its luminance times its solid angle, in O(1) with an alias
+// table, and then a point is drawn uniformly in the texel.
+class Environment {
+  public:
+    // Loads the faces in dirname. Returns false (and leaves the map empty)
+    // if a face is missing, or the faces are not squares of the same size.
+    // Maps that are only looked up can skip the sampling tables.
+    bool load(const std::string &dirname, bool sampling = true) {
+        clear();
+        const char *filenames[] = { "posx.png", "negx.png", "posy.png", "negy.png", "posz.png", "negz.png" };
+        float srgb_to_linear[256];
+        for (int i = 0; i < 256; ++i) {
+            float c = i / 255.0f;
+            srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+
+        std::vector<glm::vec3> faces;
+        unsigned face_size = 0;
+        for (int face = 0; face < 6; ++face) {
+            std::vector<unsigned char> data;
+            unsigned width, height;
+            std::string filename = dirname + "/" + filenames[face];
+            unsigned error = lodepng::decode(data, width, height, filename);
+            if (error != 0) {
+                std::cerr << "Error: " << filename << ": " << lodepng_error_text(error) << std::endl;
+                return false;
+            }
+            if (width != height || width == 0 || (face > 0 && width != face_size)) {
+                std::cerr << "Error: " << filename << ": cubemap faces must be squares of the same size" << std::endl;
+                return false;
+            }
+            face_size = width;
+            for (size_t i = 0; i < size_t(width) * height; ++i) {
+                faces.push_back(glm::vec3(srgb_to_linear[data[4 * i]], srgb_to_linear[data[4 * i + 1]],
+                                          srgb_to_linear[data[4 * i + 2]]));
+            }
+        }
+        texels.swap(faces);
+        size = int(face_size);
+        if (sampling) build_sampling();
+        return true;
+    }
+
+    void clear() {
+        size = 0;
+        texels.clear();
+        texel_pdf.clear();
+        alias_probability.clear();
+        alias.clear();
+    }
+
+    bool empty() const { return size == 0; }
+
+    // Bilinearly filtered radiance in a direction, which need not be
+    // normalized. Texels are not filtered across the edges of the faces.
+    glm::vec3 radiance(const glm::vec3 &direction) const {
+        float u, v;
+        int face = faceCoordinates(direction, u, v);
+        float x = glm::clamp(u * size - 0.5f, 0.0f, float(size - 1));
+        float y = glm::clamp(v * size - 0.5f, 0.0f, float(size - 1));
+        int x0 = glm::min(int(x), size - 1), y0 = glm::min(int(y), size - 1);
+        int x1 = glm::min(x0 + 1, size - 1), y1 = glm::min(y0 + 1, size - 1);
+        float fx = x - x0, fy = y - y0;
+        const glm::vec3 *texel = &texels[size_t(face) * size * size];
+        return glm::mix(glm::mix(texel[y0 * size + x0], texel[y0 * size + x1], fx),
+                        glm::mix(texel[y1 * size + x0], texel[y1 * size + x1], fx), fy);
+    }
+
+    // Average radiance over the sphere of directions
+    glm::vec3 mean() const {
+        glm::vec3 sum(0.0f);
+        float weights = 0.0f;
+        for (size_t i = 0; i < texels.size(); ++i) {
+            int y = int(i % (size * size)) / size;
+            int x = int(i % size);
+            float s = 2.0f * (x + 0.5f) / size - 1.0f;
+            float t = 2.0f * (y + 0.5f) / size - 1.0f;
+            float solid_angle = 1.0f / std::pow(1.0f + s * s + t * t, 1.5f);
+            sum += solid_angle * texels[i];
+            weights += solid_angle;
+        }
+        return weights > 0.0f ? sum / weights : sum;
+    }
+
+    // Samples a normalized direction, with its density over solid angle
+    bool sample(Sampler &sampler, glm::vec3 &direction, float &pdf) const {
+        if (empty() || alias.empty()) return false;
+        std::uint32_t n = std::uint32_t(alias.size());
+        float u = sampler.next_float() * n;
+        std::uint32_t i = glm::min(std::uint32_t(u), n - 1);
+        std::uint32_t texel = (u - i) < alias_probability[i] ? i : alias[i];
+
+        int face = int(texel / (size * size));
+        int y = int(texel % (size * size)) / size;
+        int x = int(texel % size);
+        float s = 2.0f * (x + sampler.next_float()) / size - 1.0f;
+        float t = 2.0f * (y + sampler.next_float()) / size - 1.0f;
+        direction = glm::normalize(faceDirection(face, s, t));
+        pdf = density(texel, s, t);
+        return pdf > 0.0f;
+    }
+
+    // Density of sample() in a direction, which need not be normalized
+    float pdf(const glm::vec3 &direction) const {
+        if (empty() || texel_pdf.empty()) return 0.0f;
+        float u, v;
+        int face = faceCoordinates(direction, u, v);
+        int x = glm::min(int(u * size), size - 1);
+        int y = glm::min(int(v * size), size - 1);
+        return density(std::uint32_t((face * size + y) * size + x), 2.0f * u - 1.0f, 2.0f * v - 1.0f);
+    }
+
+  private:
+    // Face (0 - posx, 1 - negx, ..., 5 - negz) and texture coordinates in
+    // [0, 1] of a direction, where v = 0 is the top row of the face
+    static int faceCoordinates(const glm::vec3 &d, float &u, float &v) {
+        glm::vec3 a = glm::abs(d);
+        int face;
+        float ma, s, t;
+        if (a.x >= a.y && a.x >= a.z) {
+            face = d.x > 0.0f ? 0 : 1;
+            ma = a.x;
+            s = d.x > 0.0f ? -d.z : d.z;
+            t = -d.y;
+        } else if (a.y >= a.z) {
+            face = d.y > 0.0f ? 2 : 3;
+            ma = a.y;
+            s = d.x;
+            t = d.y > 0.0f ? d.z : -d.z;
+        } else {
+            face = d.z > 0.0f ? 4 : 5;
+            ma = a.z;
+            s = d.z > 0.0f ? d.x : -d.x;
+            t = -d.y;
+        }
+        u = glm::clamp(0.5f * (s / ma + 1.0f), 0.0f, 1.0f);
+        v = glm::clamp(0.5f * (t / ma + 1.0f), 0.0f, 1.0f);
+        return face;
+    }
+
+    // Inverse of faceCoordinates(), for s = 2u - 1 and t = 2v - 1
+    static glm::vec3 faceDirection(int face, float s, float t) {
+        switch (face) {
+        case 0: return glm::vec3(1.0f, -t, -s);
+        case 1: return glm::vec3(-1.0f, -t, s);
+        case 2: return glm::vec3(s, 1.0f, t);
+        case 3: return glm::vec3(s, -1.0f, -t);
+        case 4: return glm::vec3(s, -t, 1.0f);
+        default: return glm::vec3(-s, -t, -1.0f);
+        }
+    }
+
+    // Density over solid angle at (s, t) of a texel. The solid angle of an
+    // area ds dt on a face is ds dt / (1 + s^2 + t^2)^(3/2).
+    float density(std::uint32_t texel, float s, float t) const {
+        float texel_area = 4.0f / float(size * size);
+        return texel_pdf[texel] / texel_area * std::pow(1.0f + s * s + t * t, 1.5f);
+    }
+
+    // Builds the texel probabilities and the alias table (Vose's method)
+    void build_sampling() {
+        std::uint32_t n = std::uint32_t(texels.size());
+        texel_pdf.resize(n);
+        double sum = 0.0;
+        for (std::uint32_t i = 0; i < n; ++i) {
+            int y = int(i % (size * size)) / size;
+            int x = int(i % size);
+            float s = 2.0f * (x + 0.5f) / size - 1.0f;
+            float t = 2.0f * (y + 0.5f) / size - 1.0f;
+            float luminance = glm::dot(texels[i], glm::vec3(0.2126f, 0.7152f, 0.0722f));
+            texel_pdf[i] = luminance / std::pow(1.0f + s * s + t * t, 1.5f);
+            sum += texel_pdf[i];
+        }
+        for (std::uint32_t i = 0; i < n; ++i) {
+            texel_pdf[i] = sum > 0.0 ? float(texel_pdf[i] / sum) : 1.0f / n;
+        }
+
+        alias_probability.resize(n);
+        alias.resize(n);
+        std::vector<std::uint32_t> small, large;
+        std::vector<double> scaled(n);
+        for (std::uint32_t i = 0; i < n; ++i) {
+            scaled[i] = double(texel_pdf[i]) * n;
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            std::uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            alias_probability[s] = float(scaled[s]);
+            alias[s] = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Left over because of rounding
+        for (std::uint32_t i : large) { alias_probability[i] = 1.0f; alias[i] = i; }
+        for (std::uint32_t i : small) { alias_probability[i] = 1.0f; alias[i] = i; }
+    }
+
+    int size = 0;                   // Width and height of the faces
+    std::vector<glm::vec3> texels;  // Linear radiance, face by face, in rows from the top
+    std::vector<float> texel_pdf;   // Probability of drawing each texel
+    std::vector<float> alias_probability;
+    std::vector<std::uint32_t> alias;
+};
+
+// Prefiltered versions of an environment map, for shading glossy and
+// diffuse reflections of the environment with a lookup instead of sampling.
+// The levels are convolved with Phong lobes of the exponents in the names of
+// their directories (2048 is the sharpest, 0.125 the blurriest), as in the
+// prefiltered/ directories of cubemaps/ or at the top of LarnacaCastle2/.
+// An irradiance/ directory, if any, holds the cosine-weighted convolution.
+//
+// Convolving with a normalized lobe keeps the average radiance over the
+// sphere, but the levels of the 8-bit maps were filtered in sRGB and get
+// darker as they get blurrier, so match_mean() scales them back.
+class PrefilteredEnvironment {
+  public:
+    // Loads the levels of dirname (or of dirname/prefiltered). Returns false
+    // if there are none.
+    bool load(const std::string &dirname) {
+        clear();
+        const char *names[] = { "0.125", "0.5", "2", "8", "32", "128", "512", "2048" };
+        std::string prefix = dirname + "/prefiltered";
+        if (!std::ifstream((prefix + "/2048/posx.png").c_str())) prefix = dirname;
+        for (const char *name : names) {
+            if (!std::ifstream((prefix + "/" + name + "/posx.png").c_str())) continue;
+            Environment level;
+            if (!level.load(prefix + "/" + name, false)) continue;
+            exponents.push_back(float(std::atof(name)));
+            levels.push_back(level);
+            scales.push_back(glm::vec3(1.0f));
+        }
+        if (std::ifstream((dirname + "/irradiance/posx.png").c_str())) {
+            irradiance_map.load(dirname + "/irradiance", false);
+        }
+        return !empty();
+    }
+
+    // Scales the levels and the irradiance map to the average radiance of
+    // the environment map
+    void match_mean(const Environment &map) {
+        glm::vec3 mean = map.mean();
+        auto scale = [&](const Environment &level) {
+            glm::vec3 level_mean = level.mean();
+            return glm::vec3(level_mean.x > 0.0f ? mean.x / level_mean.x : 1.0f,
+                             level_mean.y > 0.0f ? mean.y / level_mean.y : 1.0f,
+                             level_mean.z > 0.0f ? mean.z / level_mean.z : 1.0f);
+        };
+        for (size_t i = 0; i < levels.size(); ++i) scales[i] = scale(levels[i]);
+        if (!irradiance_map.empty()) irradiance_scale = scale(irradiance_map);
+    }
+
+    void clear() {
+        exponents.clear();
+        levels.clear();
+        scales.clear();
+        irradiance_map.clear();
+        irradiance_scale = glm::vec3(1.0f);
+    }
+
+    bool empty() const { return levels.empty(); }
+
+    // Radiance around a direction, convolved with a Phong lobe of the given
+    // exponent. Levels are interpolated in log2 of the exponent.
+    glm::vec3 glossy(const glm::vec3 &direction, float exponent) const {
+        if (exponent <= exponents.front()) return level(0, direction);
+        for (size_t i = 1; i < levels.size(); ++i) {
+            if (exponent <= exponents[i]) {
+                float t = std::log2(exponent / exponents[i - 1]) / std::log2(exponents[i] / exponents[i - 1]);
+                return glm::mix(level(i - 1, direction), level(i, direction), t);
+            }
+        }
+        return level(levels.size() - 1, direction);
+    }
+
+    // Cosine-weighted average of the radiance around a normal, which times
+    // the albedo is the light that a Lambertian surface reflects. Without an
+    // irradiance map, it is the level of a Phong lobe of exponent 1.
+    glm::vec3 irradiance(const glm::vec3 &normal) const {
+        return irradiance_map.empty() ? glossy(normal, 1.0f) : irradiance_scale * irradiance_map.radiance(normal);
+    }
+
+  private:
+    glm::vec3 level(size_t i, const glm::vec3 &direction) const { return scales[i] * levels[i].radiance(direction); }
+
+    std::vector<float> exponents;  // Of the levels, in increasing order
+    std::vector<Environment> levels;
+    std::vector<glm::vec3> scales;  // See match_mean()
+    Environment irradiance_map;
+    glm::vec3 irradiance_scale = glm::vec3(1.0f);
+};
+
+}  // namespace rt
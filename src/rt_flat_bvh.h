@@ -0,0 +1,709 @@
+#pragma once
+
+#include "rt_weekend.h"
+
+#include "rt_counters.h"
+#include "rt_hitable.h"
+#include "rt_hitable_list.h"
+#include "rt_ray_packet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace rt {
+
+// Node of a flattened BVH, packed into 32 bytes. The two children of an
+// interior node are stored next to each other, so only the index of the left
+// child is needed. Leaf nodes instead store a range of primitive indices.
+struct FlatBvhNode {
+    glm::vec3 bmin;
+    std::uint32_t left_first;  // Index of left child (interior) or first primitive (leaf)
+    glm::vec3 bmax;
+    std::uint32_t count;       // Number of primitives, or 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(FlatBvhNode) == 32, "FlatBvhNode should be 32 bytes");
+
+// Strategies for building a FlatBvh
+enum BvhBuilder {
+    BVH_BUILDER_MEDIAN = 0,  // Median split along a random axis (like BvhNode)
+    BVH_BUILDER_SAH = 1,     // Binned surface area heuristic
+    BVH_BUILDER_LBVH = 2     // Parallel linear BVH from sorted Morton codes
+};
+
+struct BvhBuildOptions {
+    int builder = BVH_BUILDER_SAH;
+    int max_leaf_size = 4;        // Leaves with more primitives are always split
+    float traversal_cost = 1.0f;  // Cost of visiting a node, relative to one primitive test
+    int num_bins = 16;            // Number of bins per axis for the SAH builder
+    int width = 2;                // Children per node: 2, or 4/8 for a collapsed WideBvh
+};
+
+// Bounding volume hierarchy stored as a contiguous array of nodes. The BVH is
+// built from the bounding boxes of the primitives and only refers to them by
+// index, so the same structure can be used for any kind of primitive.
+class FlatBvh {
+  public:
+    // Maximum depth of the traversal stack
+    static const int max_stack_depth = 128;
+
+    // Maximum depth of SAH splits, after which the builder falls back to
+    // median splits to keep the tree within the traversal stack
+    static const int max_sah_depth = 64;
+
+    // Builds the hierarchy over the given primitive bounding boxes
+    void build(const std::vector<AABB> &boxes, const BvhBuildOptions &options = BvhBuildOptions()) {
+        nodes.clear();
+        if (options.builder == BVH_BUILDER_LBVH) {
+            build_lbvh(boxes);
+            return;
+        }
+
+        prim_indices.resize(boxes.size());
+        for (std::uint32_t i = 0; i < prim_indices.size(); ++i) { prim_indices[i] = i; }
+        if (boxes.empty()) return;
+
+        nodes.reserve(2 * boxes.size());
+        nodes.push_back(FlatBvhNode());
+        if (options.builder == BVH_BUILDER_MEDIAN) {
+            build_median(boxes, 0, 0, std::uint32_t(boxes.size()));
+        } else {
+            std::vector<glm::vec3> centroids(boxes.size());
+            for (size_t i = 0; i < boxes.size(); ++i) {
+                centroids[i] = 0.5f * (boxes[i].min() + boxes[i].max());
+            }
+            build_sah(boxes, centroids, options, 0, 0, std::uint32_t(boxes.size()), 0);
+        }
+    }
+
+    // Returns the expected cost of tracing a ray through the hierarchy
+    // according to the surface area heuristic, in units of primitive tests
+    float sah_cost(float traversal_cost) const {
+        if (nodes.empty()) return 0.0f;
+        float root_area = AABB(nodes[0].bmin, nodes[0].bmax).surface_area();
+        if (root_area <= 0.0f) return 0.0f;
+
+        float cost = 0.0f;
+        for (const FlatBvhNode &node : nodes) {
+            float area = AABB(node.bmin, node.bmax).surface_area() / root_area;
+            cost += area * (node.is_leaf() ? float(node.count) : traversal_cost);
+        }
+        return cost;
+    }
+
+    // Checks that the nodes form a tree that traverse() can visit without
+    // reading out of bounds: children and primitive ranges are in range, no
+    // node is reached twice, and the tree fits the traversal stack. Used for
+    // BVHs that were read from a file.
+    bool valid(size_t num_primitives) const {
+        for (std::uint32_t prim : prim_indices) {
+            if (prim >= num_primitives) return false;
+        }
+        if (nodes.empty()) return true;
+
+        std::vector<std::uint8_t> visited(nodes.size(), 0);
+        std::vector<std::pair<std::uint32_t, int>> stack(1, std::make_pair(0u, 1));  // Node and depth
+        while (!stack.empty()) {
+            std::uint32_t index = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (index >= nodes.size() || visited[index] || depth > max_stack_depth) return false;
+            visited[index] = 1;
+            const FlatBvhNode &node = nodes[index];
+            if (node.is_leaf()) {
+                if (std::uint64_t(node.left_first) + node.count > prim_indices.size()) return false;
+            } else {
+                if (std::uint64_t(node.left_first) + 1 >= nodes.size()) return false;
+                stack.push_back(std::make_pair(node.left_first, depth + 1));
+                stack.push_back(std::make_pair(node.left_first + 1, depth + 1));
+            }
+        }
+        return true;
+    }
+
+    // Visits the nodes whose boxes are hit by the ray, nearest child first,
+    // and calls intersect(prim_index, t_min, t_max) for the primitives in the
+    // leaves. The intersect function should return true and shrink t_max on a
+    // hit, which is then used to cull nodes that are farther away.
+    template <typename IntersectFn>
+    bool traverse(const Ray &r, float t_min, float &t_max, IntersectFn intersect) const {
+        if (nodes.empty()) return false;
+
+        const glm::vec3 origin = r.origin();
+        const glm::vec3 inv_dir = 1.0f / r.direction();
+
+        float t_enter;
+        if (!hit_slabs(nodes[0].bmin, nodes[0].bmax, origin, inv_dir, t_min, t_max, t_enter))
+            return false;
+
+        struct StackEntry {
+            std::uint32_t node;
+            float t_enter;
+        } stack[max_stack_depth];
+        int stack_size = 0;
+
+        TraversalCount count;
+        bool hit_anything = false;
+        std::uint32_t node_index = 0;
+        while (true) {
+            const FlatBvhNode &node = nodes[node_index];
+            count.nodes += 1;
+            if (node.is_leaf()) {
+                count.primitives += node.count;
+                for (std::uint32_t i = node.left_first; i < node.left_first + node.count; ++i) {
+                    if (intersect(prim_indices[i], t_min, t_max)) hit_anything = true;
+                }
+            } else {
+                std::uint32_t near_child = node.left_first;
+                std::uint32_t far_child = node.left_first + 1;
+                float t_near, t_far;
+                bool hit_near = hit_slabs(nodes[near_child].bmin, nodes[near_child].bmax, origin,
+                                          inv_dir, t_min, t_max, t_near);
+                bool hit_far = hit_slabs(nodes[far_child].bmin, nodes[far_child].bmax, origin,
+                                         inv_dir, t_min, t_max, t_far);
+                if (hit_near && hit_far) {
+                    if (t_far < t_near) {
+                        std::swap(near_child, far_child);
+                        std::swap(t_near, t_far);
+                    }
+                    stack[stack_size].node = far_child;
+                    stack[stack_size].t_enter = t_far;
+                    stack_size += 1;
+                    node_index = near_child;
+                    continue;
+                }
+                if (hit_near || hit_far) {
+                    node_index = hit_near ? near_child : far_child;
+                    continue;
+                }
+            }
+
+            // Pop the next node, skipping nodes behind the closest hit so far
+            do {
+                if (stack_size == 0) return hit_anything;
+                stack_size -= 1;
+            } while (stack[stack_size].t_enter > t_max);
+            node_index = stack[stack_size].node;
+        }
+    }
+
+    // Packet version of traverse(). The children of a node are tested
+    // against the frustum of the packet and then against the active lanes,
+    // and the lanes that hit a child are pushed with it. Children are
+    // visited in order of the smallest entry distance of their lanes, with
+    // ties ordered along the mean direction of the packet, and a child is
+    // skipped when all its lanes have found a closer hit by the time it is
+    // popped. intersect(prim_index, lanes) is called with the mask of the
+    // lanes that reached the leaf. The intersect function should shrink
+    // t_max of the lanes it hits and return their mask.
+    template <typename IntersectFn>
+    int traverse_packet(const RayPacket &packet, float t_min, float *t_max, int mask,
+                        IntersectFn intersect) const {
+        if (nodes.empty() || mask == 0) return 0;
+
+        struct StackEntry {
+            std::uint32_t node;
+            int mask;
+            float t_enter;
+        } stack[max_stack_depth];
+        StackEntry root = { 0, 0, 0.0f };
+        if (packet.frustum_overlaps(nodes[0].bmin, nodes[0].bmax, t_min, packet.max_t(t_min, t_max, mask)))
+            root.mask = packet.hit_box(nodes[0].bmin, nodes[0].bmax, t_min, t_max, mask, root.t_enter);
+        if (root.mask == 0) return 0;
+        stack[0] = root;
+        int stack_size = 1;
+
+        TraversalCount count;
+        int hit_mask = 0;
+        while (stack_size > 0) {
+            const StackEntry entry = stack[--stack_size];
+            float t_far = packet.max_t(t_min, t_max, entry.mask);
+            if (entry.t_enter > t_far) continue;
+
+            const FlatBvhNode &node = nodes[entry.node];
+            count.nodes += 1;
+            if (node.is_leaf()) {
+                count.primitives += node.count;
+                for (std::uint32_t i = node.left_first; i < node.left_first + node.count; ++i) {
+                    hit_mask |= intersect(prim_indices[i], entry.mask);
+                }
+                continue;
+            }
+
+            StackEntry child[2];
+            for (int k = 0; k < 2; ++k) {
+                const FlatBvhNode &box = nodes[node.left_first + k];
+                child[k].node = node.left_first + k;
+                child[k].mask = 0;
+                child[k].t_enter = 0.0f;
+                if (packet.frustum_overlaps(box.bmin, box.bmax, t_min, t_far))
+                    child[k].mask = packet.hit_box(box.bmin, box.bmax, t_min, t_max, entry.mask, child[k].t_enter);
+            }
+
+            // Push the far child first, so that the near one is popped next
+            int near = 0;
+            if (child[0].mask && child[1].mask) {
+                if (child[1].t_enter < child[0].t_enter) {
+                    near = 1;
+                } else if (child[1].t_enter == child[0].t_enter) {
+                    const FlatBvhNode &left = nodes[node.left_first];
+                    const FlatBvhNode &right = nodes[node.left_first + 1];
+                    glm::vec3 offset = (right.bmin + right.bmax) - (left.bmin + left.bmax);
+                    near = glm::dot(offset, packet.mean_dir) < 0.0f ? 1 : 0;
+                }
+            }
+            if (child[1 - near].mask) stack[stack_size++] = child[1 - near];
+            if (child[near].mask) stack[stack_size++] = child[near];
+        }
+        return hit_mask;
+    }
+
+  private:
+    void set_bounds(const std::vector<AABB> &boxes, std::uint32_t node_index,
+                    std::uint32_t start, std::uint32_t end) {
+        AABB box = boxes[prim_indices[start]];
+        for (std::uint32_t i = start + 1; i < end; ++i) {
+            box = surrounding_box(box, boxes[prim_indices[i]]);
+        }
+        nodes[node_index].bmin = box.min();
+        nodes[node_index].bmax = box.max();
+    }
+
+    void make_leaf(std::uint32_t node_index, std::uint32_t start, std::uint32_t end) {
+        nodes[node_index].left_first = start;
+        nodes[node_index].count = end - start;
+    }
+
+    std::uint32_t make_children(std::uint32_t node_index) {
+        std::uint32_t left = std::uint32_t(nodes.size());
+        nodes[node_index].left_first = left;
+        nodes[node_index].count = 0;
+        nodes.push_back(FlatBvhNode());
+        nodes.push_back(FlatBvhNode());
+        return left;
+    }
+
+    void build_median(const std::vector<AABB> &boxes, std::uint32_t node_index,
+                      std::uint32_t start, std::uint32_t end) {
+        set_bounds(boxes, node_index, start, end);
+
+        std::uint32_t object_span = end - start;
+        if (object_span <= 2) {
+            make_leaf(node_index, start, end);
+            return;
+        }
+
+        int axis = random_int(0,2);
+        std::sort(prim_indices.begin() + start, prim_indices.begin() + end,
+                  [&](std::uint32_t a, std::uint32_t b) {
+                      return boxes[a].min()[axis] < boxes[b].min()[axis];
+                  });
+
+        std::uint32_t left = make_children(node_index);
+        std::uint32_t mid = start + object_span/2;
+        build_median(boxes, left, start, mid);
+        build_median(boxes, left + 1, mid, end);
+    }
+
+    // Binned SAH builder. Primitives are assigned to bins by their centroids,
+    // and the split between bins with the lowest estimated cost is chosen. The
+    // node becomes a leaf if that is cheaper than splitting it.
+    void build_sah(const std::vector<AABB> &boxes, const std::vector<glm::vec3> &centroids,
+                   const BvhBuildOptions &options, std::uint32_t node_index,
+                   std::uint32_t start, std::uint32_t end, int depth) {
+        set_bounds(boxes, node_index, start, end);
+
+        std::uint32_t object_span = end - start;
+        if (object_span == 1) {
+            make_leaf(node_index, start, end);
+            return;
+        }
+
+        glm::vec3 cmin = centroids[prim_indices[start]];
+        glm::vec3 cmax = cmin;
+        for (std::uint32_t i = start + 1; i < end; ++i) {
+            cmin = glm::min(cmin, centroids[prim_indices[i]]);
+            cmax = glm::max(cmax, centroids[prim_indices[i]]);
+        }
+
+        const float inf = std::numeric_limits<float>::infinity();
+        const int num_bins = glm::clamp(options.num_bins, 2, 64);
+        struct Bin {
+            glm::vec3 bmin, bmax;
+            std::uint32_t count;
+        } bins[64];
+        float right_area[64];
+        std::uint32_t right_count[64];
+
+        float best_cost = inf;
+        int best_axis = -1;
+        int best_bin = 0;
+        for (int axis = 0; axis < 3 && depth < max_sah_depth; ++axis) {
+            float extent = cmax[axis] - cmin[axis];
+            if (extent <= 0.0f) continue;
+
+            for (int b = 0; b < num_bins; ++b) {
+                bins[b].bmin = glm::vec3(inf);
+                bins[b].bmax = glm::vec3(-inf);
+                bins[b].count = 0;
+            }
+            float scale = float(num_bins) / extent;
+            for (std::uint32_t i = start; i < end; ++i) {
+                std::uint32_t prim = prim_indices[i];
+                int b = glm::min(num_bins - 1, int((centroids[prim][axis] - cmin[axis]) * scale));
+                bins[b].bmin = glm::min(bins[b].bmin, boxes[prim].min());
+                bins[b].bmax = glm::max(bins[b].bmax, boxes[prim].max());
+                bins[b].count += 1;
+            }
+
+            // Sweep from the right to get the area and count of each right side,
+            // then from the left to evaluate the cost of each split plane
+            glm::vec3 bmin = glm::vec3(inf), bmax = glm::vec3(-inf);
+            std::uint32_t count = 0;
+            for (int b = num_bins - 1; b > 0; --b) {
+                bmin = glm::min(bmin, bins[b].bmin);
+                bmax = glm::max(bmax, bins[b].bmax);
+                count += bins[b].count;
+                right_area[b] = count > 0 ? AABB(bmin, bmax).surface_area() : 0.0f;
+                right_count[b] = count;
+            }
+            bmin = glm::vec3(inf);
+            bmax = glm::vec3(-inf);
+            count = 0;
+            for (int b = 0; b < num_bins - 1; ++b) {
+                bmin = glm::min(bmin, bins[b].bmin);
+                bmax = glm::max(bmax, bins[b].bmax);
+                count += bins[b].count;
+                if (count == 0 || right_count[b + 1] == 0) continue;
+                float cost = count * AABB(bmin, bmax).surface_area() +
+                             right_count[b + 1] * right_area[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        if (best_axis < 0) {
+            // All centroids coincide (or the tree is too deep), so binning
+            // cannot separate the primitives
+            if (object_span <= std::uint32_t(options.max_leaf_size)) {
+                make_leaf(node_index, start, end);
+            } else {
+                split_median(boxes, centroids, options, node_index, start, end, depth);
+            }
+            return;
+        }
+
+        float area = AABB(nodes[node_index].bmin, nodes[node_index].bmax).surface_area();
+        float split_cost = options.traversal_cost + (area > 0.0f ? best_cost / area : 0.0f);
+        float leaf_cost = float(object_span);
+        if (leaf_cost <= split_cost && object_span <= std::uint32_t(options.max_leaf_size)) {
+            make_leaf(node_index, start, end);
+            return;
+        }
+
+        float extent = cmax[best_axis] - cmin[best_axis];
+        float scale = float(num_bins) / extent;
+        std::uint32_t *mid_ptr = std::partition(
+            prim_indices.data() + start, prim_indices.data() + end, [&](std::uint32_t prim) {
+                int b = glm::min(num_bins - 1, int((centroids[prim][best_axis] - cmin[best_axis]) * scale));
+                return b <= best_bin;
+            });
+        std::uint32_t mid = std::uint32_t(mid_ptr - prim_indices.data());
+        if (mid == start || mid == end) {
+            split_median(boxes, centroids, options, node_index, start, end, depth);
+            return;
+        }
+
+        std::uint32_t left = make_children(node_index);
+        build_sah(boxes, centroids, options, left, start, mid, depth + 1);
+        build_sah(boxes, centroids, options, left + 1, mid, end, depth + 1);
+    }
+
+    // Splits the primitives in half along the axis where the centroids are
+    // most spread out, and continues with the SAH builder for the children
+    void split_median(const std::vector<AABB> &boxes, const std::vector<glm::vec3> &centroids,
+                      const BvhBuildOptions &options, std::uint32_t node_index,
+                      std::uint32_t start, std::uint32_t end, int depth) {
+        glm::vec3 cmin = centroids[prim_indices[start]];
+        glm::vec3 cmax = cmin;
+        for (std::uint32_t i = start + 1; i < end; ++i) {
+            cmin = glm::min(cmin, centroids[prim_indices[i]]);
+            cmax = glm::max(cmax, centroids[prim_indices[i]]);
+        }
+        glm::vec3 extent = cmax - cmin;
+        int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+
+        std::uint32_t mid = start + (end - start)/2;
+        std::nth_element(prim_indices.begin() + start, prim_indices.begin() + mid,
+                         prim_indices.begin() + end, [&](std::uint32_t a, std::uint32_t b) {
+                             return centroids[a][axis] < centroids[b][axis];
+                         });
+
+        std::uint32_t left = make_children(node_index);
+        build_sah(boxes, centroids, options, left, start, mid, depth + 1);
+        build_sah(boxes, centroids, options, left + 1, mid, end, depth + 1);
+    }
+
+    // Linear BVH builder (Karras 2012, "Maximizing Parallelism in the
+    // Construction of BVHs, Octrees, and k-d Trees"). The primitives are
+    // sorted by the Morton codes of their centroids, and every internal node
+    // of the resulting radix tree is found independently of the others, so
+    // all steps run in parallel. Leaves contain a single primitive.
+    void build_lbvh(const std::vector<AABB> &boxes) {
+        const std::int64_t n = std::int64_t(boxes.size());
+        prim_indices.resize(n);
+        if (n == 0) return;
+        if (n == 1) {
+            prim_indices[0] = 0;
+            nodes.resize(1);
+            nodes[0].bmin = boxes[0].min();
+            nodes[0].bmax = boxes[0].max();
+            make_leaf(0, 0, 1);
+            return;
+        }
+
+        // Bounds of the centroids, used to quantize them for the Morton codes
+        float cmin_x = std::numeric_limits<float>::max(), cmax_x = -cmin_x;
+        float cmin_y = cmin_x, cmax_y = cmax_x;
+        float cmin_z = cmin_x, cmax_z = cmax_x;
+        #pragma omp parallel for reduction(min:cmin_x,cmin_y,cmin_z) reduction(max:cmax_x,cmax_y,cmax_z)
+        for (std::int64_t i = 0; i < n; ++i) {
+            glm::vec3 c = 0.5f * (boxes[i].min() + boxes[i].max());
+            cmin_x = glm::min(cmin_x, c.x); cmax_x = glm::max(cmax_x, c.x);
+            cmin_y = glm::min(cmin_y, c.y); cmax_y = glm::max(cmax_y, c.y);
+            cmin_z = glm::min(cmin_z, c.z); cmax_z = glm::max(cmax_z, c.z);
+        }
+        const glm::vec3 cmin(cmin_x, cmin_y, cmin_z);
+        const glm::vec3 extent = glm::vec3(cmax_x, cmax_y, cmax_z) - cmin;
+        const glm::vec3 inv_extent = glm::vec3(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+                                               extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+                                               extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+        // 30-bit codes (10 bits per axis) are enough for small inputs, while
+        // large meshes use 63-bit codes (21 bits per axis) to avoid duplicates
+        const bool wide_codes = n > (std::int64_t(1) << 18);
+        const int bits_per_axis = wide_codes ? 21 : 10;
+        const float grid_max = float((1u << bits_per_axis) - 1);
+        std::vector<std::uint64_t> codes(n);
+        #pragma omp parallel for
+        for (std::int64_t i = 0; i < n; ++i) {
+            glm::vec3 c = 0.5f * (boxes[i].min() + boxes[i].max());
+            glm::vec3 q = glm::clamp((c - cmin) * inv_extent, 0.0f, 1.0f) * grid_max;
+            codes[i] = morton_code(std::uint32_t(q.x), std::uint32_t(q.y), std::uint32_t(q.z));
+            prim_indices[i] = std::uint32_t(i);
+        }
+        radix_sort(codes, prim_indices, 3 * bits_per_axis);
+
+        // Length of the common prefix of the codes at i and j, using the
+        // indices to break ties between duplicate codes
+        auto delta = [&](std::int64_t i, std::int64_t j) -> int {
+            if (j < 0 || j >= n) return -1;
+            if (codes[i] == codes[j]) return 64 + count_leading_zeros(std::uint64_t(i ^ j) << 32);
+            return count_leading_zeros(codes[i] ^ codes[j]);
+        };
+
+        // Emit the internal nodes of the radix tree. Children are tagged with
+        // leaf_flag if they are leaves (primitive i in sorted order).
+        const std::uint32_t leaf_flag = 0x80000000u;
+        const std::uint32_t no_parent = 0xffffffffu;
+        const std::int64_t num_internal = n - 1;
+        std::vector<std::uint32_t> children(2 * num_internal);
+        std::vector<std::uint32_t> splits(num_internal);
+        std::vector<std::uint32_t> internal_parent(num_internal);
+        std::vector<std::uint32_t> leaf_parent(n);
+        internal_parent[0] = no_parent;
+        #pragma omp parallel for
+        for (std::int64_t i = 0; i < num_internal; ++i) {
+            // Direction of the range covered by the node
+            int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+
+            // Upper bound for the length of the range, then the exact end j
+            int delta_min = delta(i, i - d);
+            std::int64_t l_max = 2;
+            while (delta(i, i + l_max * d) > delta_min) l_max *= 2;
+            std::int64_t l = 0;
+            for (std::int64_t t = l_max / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (l + t) * d) > delta_min) l += t;
+            }
+            std::int64_t j = i + l * d;
+
+            // Split position, i.e., the last code sharing the node's prefix
+            // plus one more bit
+            int delta_node = delta(i, j);
+            std::int64_t s = 0;
+            for (std::int64_t div = 2; ; div *= 2) {
+                std::int64_t t = (l + div - 1) / div;
+                if (delta(i, i + (s + t) * d) > delta_node) s += t;
+                if (t <= 1) break;
+            }
+            std::int64_t gamma = i + s * d + std::min(d, 0);
+
+            std::uint32_t left = std::uint32_t(gamma);
+            std::uint32_t right = std::uint32_t(gamma + 1);
+            if (std::min(i, j) == gamma) {
+                leaf_parent[left] = std::uint32_t(i);
+                left |= leaf_flag;
+            } else {
+                internal_parent[left] = std::uint32_t(i);
+            }
+            if (std::max(i, j) == gamma + 1) {
+                leaf_parent[right] = std::uint32_t(i);
+                right |= leaf_flag;
+            } else {
+                internal_parent[right] = std::uint32_t(i);
+            }
+            children[2 * i] = left;
+            children[2 * i + 1] = right;
+            splits[i] = std::uint32_t(gamma);
+        }
+
+        // Compute the bounds bottom-up. Each leaf walks towards the root, and
+        // only the second child to arrive at a node continues, since the
+        // bounds of both children are known at that point.
+        std::vector<AABB> internal_boxes(num_internal);
+        std::vector<std::atomic<int>> visits(num_internal);
+        for (std::int64_t i = 0; i < num_internal; ++i) visits[i].store(0, std::memory_order_relaxed);
+        auto child_box = [&](std::uint32_t child) -> const AABB & {
+            return (child & leaf_flag) ? boxes[prim_indices[child & ~leaf_flag]] : internal_boxes[child];
+        };
+        #pragma omp parallel for
+        for (std::int64_t i = 0; i < n; ++i) {
+            std::uint32_t node = leaf_parent[i];
+            while (node != no_parent) {
+                if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+                internal_boxes[node] = surrounding_box(child_box(children[2 * node]),
+                                                       child_box(children[2 * node + 1]));
+                node = internal_parent[node];
+            }
+        }
+
+        // Convert to the flattened layout, where siblings must be adjacent.
+        // The children of internal node i are placed at 1 + 2 * split(i),
+        // which is unique for every internal node.
+        nodes.resize(2 * n - 1);
+        nodes[0].bmin = internal_boxes[0].min();
+        nodes[0].bmax = internal_boxes[0].max();
+        nodes[0].left_first = 1 + 2 * splits[0];
+        nodes[0].count = 0;
+        #pragma omp parallel for
+        for (std::int64_t i = 0; i < num_internal; ++i) {
+            for (int c = 0; c < 2; ++c) {
+                std::uint32_t child = children[2 * i + c];
+                FlatBvhNode &node = nodes[1 + 2 * splits[i] + c];
+                const AABB &box = child_box(child);
+                node.bmin = box.min();
+                node.bmax = box.max();
+                if (child & leaf_flag) {
+                    node.left_first = child & ~leaf_flag;
+                    node.count = 1;
+                } else {
+                    node.left_first = 1 + 2 * splits[child];
+                    node.count = 0;
+                }
+            }
+        }
+    }
+
+    // Interleaves the lowest 21 bits of x, y, and z into a 63-bit code
+    static std::uint64_t morton_code(std::uint32_t x, std::uint32_t y, std::uint32_t z) {
+        return expand_bits(x) | (expand_bits(y) << 1) | (expand_bits(z) << 2);
+    }
+
+    // Inserts two zero bits after each of the lowest 21 bits of v
+    static std::uint64_t expand_bits(std::uint32_t v) {
+        std::uint64_t x = v & 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    static int count_leading_zeros(std::uint64_t x) {
+        if (x == 0) return 64;
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_clzll(x);
+#else
+        int n = 0;
+        while (!(x & (std::uint64_t(1) << 63))) {
+            x <<= 1;
+            n += 1;
+        }
+        return n;
+#endif
+    }
+
+    // Parallel LSD radix sort of (key, value) pairs on the lowest num_bits of
+    // the keys, 8 bits per pass. Each thread counts the digits of its own
+    // chunk, so the scatter is stable without any atomics.
+    static void radix_sort(std::vector<std::uint64_t> &keys, std::vector<std::uint32_t> &values, int num_bits) {
+        const std::int64_t n = std::int64_t(keys.size());
+        const int num_buckets = 256;
+#ifdef _OPENMP
+        const int max_threads = omp_get_max_threads();
+#else
+        const int max_threads = 1;
+#endif
+        std::vector<std::uint64_t> keys_tmp(n);
+        std::vector<std::uint32_t> values_tmp(n);
+        std::vector<std::int64_t> offsets(max_threads * num_buckets);
+
+        for (int shift = 0; shift < num_bits; shift += 8) {
+            #pragma omp parallel num_threads(max_threads)
+            {
+#ifdef _OPENMP
+                const int thread = omp_get_thread_num();
+                const int num_threads = omp_get_num_threads();
+#else
+                const int thread = 0;
+                const int num_threads = 1;
+#endif
+                const std::int64_t begin = n * thread / num_threads;
+                const std::int64_t end = n * (thread + 1) / num_threads;
+                std::int64_t *offset = &offsets[thread * num_buckets];
+                std::fill(offset, offset + num_buckets, 0);
+                for (std::int64_t i = begin; i < end; ++i) offset[(keys[i] >> shift) & 0xff] += 1;
+
+                #pragma omp barrier
+                #pragma omp single
+                {
+                    std::int64_t sum = 0;
+                    for (int b = 0; b < num_buckets; ++b) {
+                        for (int t = 0; t < num_threads; ++t) {
+                            std::int64_t count = offsets[t * num_buckets + b];
+                            offsets[t * num_buckets + b] = sum;
+                            sum += count;
+                        }
+                    }
+                }
+
+                for (std::int64_t i = begin; i < end; ++i) {
+                    std::int64_t dst = offset[(keys[i] >> shift) & 0xff]++;
+                    keys_tmp[dst] = keys[i];
+                    values_tmp[dst] = values[i];
+                }
+            }
+            keys.swap(keys_tmp);
+            values.swap(values_tmp);
+        }
+    }
+
+  public:
+    std::vector<FlatBvhNode> nodes;
+    std::vector<std::uint32_t> prim_indices;
+};
+
+}  // namespace rt
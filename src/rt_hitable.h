@@ -2,17 +2,22 @@
 
 #include "rt_weekend.h"
 #include "rt_aabb.h"
+#include "rt_ray_packet.h"
+
+#include <cstdint>
 
 namespace rt {
 
 class Material;
 
 struct HitRecord {
-    float t;
+    float t = 0.0f;
     glm::vec3 p;
     glm::vec3 normal;
     bool front_face;
-    shared_ptr<Material> mat_ptr;
+    std::uint32_t mat_id = ~0u;     // Index in the MaterialTable of the scene
+    std::uint32_t object_id = ~0u;  // Index of the object in the BVH of the scene
+    std::uint32_t prim_id = ~0u;    // Index of the primitive (e.g., triangle) in the object
 
     inline void set_face_normal(const Ray& r, const glm::vec3& outward_normal) {
         front_face = glm::dot(r.direction(), outward_normal) < 0;
@@ -20,10 +25,72 @@ struct HitRecord {
     }
 };
 
+// Arbitrary output variables (AOVs) of one sample: the surface seen by its
+// primary ray, and the number of bounces of its path. Also used as guides
+// by the denoiser.
+struct SampleAovs {
+    glm::vec3 normal;  // Normalized, facing against the ray
+    float distance;    // Distance from the ray origin
+    glm::vec3 albedo;
+    std::uint32_t material_id;  // IDs are ~0u if the ray missed
+    std::uint32_t object_id;
+    std::uint32_t primitive_id;
+    int bounces = 0;
+
+    static SampleAovs surface(const Ray &r, const HitRecord &rec, const glm::vec3 &albedo) {
+        SampleAovs aovs;
+        aovs.normal = glm::normalize(rec.normal);
+        aovs.distance = rec.t * glm::length(r.direction());
+        aovs.albedo = albedo;
+        aovs.material_id = rec.mat_id;
+        aovs.object_id = rec.object_id;
+        aovs.primitive_id = rec.prim_id;
+        return aovs;
+    }
+
+    // A ray that missed sees the background, far away and facing the camera
+    static SampleAovs miss(const Ray &r, const glm::vec3 &background) {
+        SampleAovs aovs;
+        aovs.normal = -glm::normalize(r.direction());
+        aovs.distance = 1e4f;
+        aovs.albedo = background;
+        aovs.material_id = aovs.object_id = aovs.primitive_id = ~0u;
+        return aovs;
+    }
+};
+
 class Hitable {
 public:
     virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const = 0;
     virtual bool bounding_box(double time0, double time1, AABB& output_box) const = 0;
+
+    // Intersects the lanes in mask of a ray packet, where each lane has its
+    // own t_max and hit record. Returns the mask of lanes with a new closest
+    // hit. The default implementation traces the lanes one by one.
+    virtual int hit_packet(RTContext &rtx, const RayPacket &packet, float t_min, float *t_max,
+                           HitRecord *rec, int mask) const {
+        int hit_mask = 0;
+        for (int i = 0; i < packet.size; ++i) {
+            if (!(mask & (1 << i))) continue;
+            if (hit(rtx, packet.ray(i), t_min, t_max[i], rec[i])) {
+                t_max[i] = rec[i].t;
+                hit_mask |= 1 << i;
+            }
+        }
+        return hit_mask;
+    }
+
+    // Light sampling of emissive objects (see LightList). Samples a direction
+    // from origin towards the object, with its density over solid angle in
+    // pdf. Returns false if the object cannot be sampled from origin.
+    virtual bool sample_direction(const glm::vec3 &origin, Sampler &sampler, glm::vec3 &direction,
+                                  float &pdf) const {
+        return false;
+    }
+
+    // Density of sample_direction() from the origin of r, for a ray r that
+    // hit the object at rec
+    virtual float direction_pdf(const Ray &r, const HitRecord &rec) const { return 0.0f; }
 };
 
 } // namespace rt
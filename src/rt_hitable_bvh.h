@@ -0,0 +1,81 @@
+#pragma once
+
+#include "rt_hitable.h"
+#include "rt_hitable_list.h"
+#include "rt_flat_bvh.h"
+#include "rt_wide_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace rt {
+
+// Hitable that intersects a list of objects through a FlatBvh, or a 4/8-wide
+// BVH collapsed from it. Replaces the tree of BvhNode objects, which needs a
+// heap allocation and a virtual call for every node.
+class HitableBvh : public Hitable {
+  public:
+    HitableBvh() {}
+    HitableBvh(const HitableList &list, const BvhBuildOptions &options = BvhBuildOptions())
+        : objects(list.objects)
+    {
+        build(options);
+    }
+
+    void build(const BvhBuildOptions &options) {
+        std::vector<AABB> boxes(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i) {
+            if (!objects[i]->bounding_box(0, 0, boxes[i]))
+                std::cerr << "No bounding box in HitableBvh constructor.\n";
+        }
+        bvh.build(boxes, options);
+
+        width = options.width;
+        bvh4.nodes.clear();
+        bvh8.nodes.clear();
+        if (width == 4) bvh4.collapse(bvh);
+        if (width == 8) bvh8.collapse(bvh);
+    }
+
+    virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const override {
+        HitRecord temp_rec;
+        auto intersect = [&](std::uint32_t prim, float t_lo, float &t_hi) {
+            if (!objects[prim]->hit(rtx, r, t_lo, t_hi, temp_rec)) return false;
+            t_hi = temp_rec.t;
+            rec = temp_rec;
+            rec.object_id = prim;
+            return true;
+        };
+        if (width == 8) return bvh8.traverse(r, t_min, t_max, intersect);
+        if (width == 4) return bvh4.traverse(r, t_min, t_max, intersect);
+        return bvh.traverse(r, t_min, t_max, intersect);
+    }
+
+    virtual int hit_packet(RTContext &rtx, const RayPacket &packet, float t_min, float *t_max,
+                           HitRecord *rec, int mask) const override {
+        auto intersect = [&](std::uint32_t prim, int lanes) {
+            int hit_mask = objects[prim]->hit_packet(rtx, packet, t_min, t_max, rec, lanes);
+            for (int i = 0; i < packet.size; ++i) {
+                if (hit_mask & (1 << i)) rec[i].object_id = prim;
+            }
+            return hit_mask;
+        };
+        if (width == 8) return bvh8.traverse_packet(packet, t_min, t_max, mask, intersect);
+        if (width == 4) return bvh4.traverse_packet(packet, t_min, t_max, mask, intersect);
+        return bvh.traverse_packet(packet, t_min, t_max, mask, intersect);
+    }
+
+    virtual bool bounding_box(double time0, double time1, AABB &output_box) const override {
+        if (bvh.nodes.empty()) return false;
+        output_box = AABB(bvh.nodes[0].bmin, bvh.nodes[0].bmax);
+        return true;
+    }
+
+    std::vector<shared_ptr<Hitable>> objects;
+    FlatBvh bvh;
+    WideBvh<4> bvh4;
+    WideBvh<8> bvh8;
+    int width = 2;
+};
+
+}  // namespace rt
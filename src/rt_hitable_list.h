@@ -27,11 +27,14 @@ class HitableList : public Hitable {
         virtual bool bounding_box(
             double time0, double time1, AABB& output_box) const override;
 
+        virtual int hit_packet(
+            RTContext &rtx, const RayPacket& packet, float t_min, float *t_max, HitRecord *rec, int mask) const override;
+
     public:
         std::vector<shared_ptr<Hitable>> objects;
 };
 
-bool HitableList::hit(RTContext &rtx, const Ray& r, float t_min, float t_max, HitRecord& rec) const {
+inline bool HitableList::hit(RTContext &rtx, const Ray& r, float t_min, float t_max, HitRecord& rec) const {
     HitRecord temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
@@ -47,7 +50,15 @@ bool HitableList::hit(RTContext &rtx, const Ray& r, float t_min, float t_max, Hi
     return hit_anything;
 }
 
-bool HitableList::bounding_box(double time0, double time1, AABB& output_box) const {
+inline int HitableList::hit_packet(RTContext &rtx, const RayPacket& packet, float t_min, float *t_max, HitRecord *rec, int mask) const {
+    int hit_mask = 0;
+    for (const auto& object : objects) {
+        hit_mask |= object->hit_packet(rtx, packet, t_min, t_max, rec, mask);
+    }
+    return hit_mask;
+}
+
+inline bool HitableList::bounding_box(double time0, double time1, AABB& output_box) const {
     if (objects.empty()) return false;
 
     AABB temp_box;
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "rt_hitable.h"
+#include "rt_ray_packet.h"
+
+#include <limits>
+#include <memory>
+
+namespace rt {
+
+// Placement of a shared object (e.g., a TriangleMesh with its own BVH) in
+// the world with an affine transform. Rays are transformed into object space
+// at the instance, so any number of instances share the geometry and BVH of
+// the object, and moving an instance only requires rebuilding the BVH that
+// contains the instances.
+//
+// Ray directions are transformed without normalization, so hit distances are
+// the same in world and object space.
+class Instance : public Hitable {
+  public:
+    Instance() {}
+    Instance(shared_ptr<Hitable> obj, const glm::mat4 &world_from_object, std::uint32_t m = ~0u)
+        : object(obj), mat_id(m) {
+        set_transform(world_from_object);
+    }
+
+    void set_transform(const glm::mat4 &world_from_object) {
+        transform = world_from_object;
+        glm::mat4 object_from_world = glm::inverse(world_from_object);
+        linear = glm::mat3(object_from_world);
+        translation = glm::vec3(object_from_world[3]);
+        normal_matrix = glm::transpose(linear);
+    }
+
+    virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const override {
+        Ray local(linear * r.origin() + translation, linear * r.direction());
+        if (!object->hit(rtx, local, t_min, t_max, rec)) return false;
+        to_world(r, rec);
+        return true;
+    }
+
+    virtual int hit_packet(RTContext &rtx, const RayPacket &packet, float t_min, float *t_max,
+                           HitRecord *rec, int mask) const override {
+        RayPacket local;
+        for (int i = 0; i < packet.size; ++i) {
+            local.set(i, Ray(linear * glm::vec3(packet.ox[i], packet.oy[i], packet.oz[i]) + translation,
+                             linear * glm::vec3(packet.dx[i], packet.dy[i], packet.dz[i])));
+        }
+        local.finalize(packet.size);
+        int hit_mask = object->hit_packet(rtx, local, t_min, t_max, rec, mask);
+        for (int i = 0; i < packet.size; ++i) {
+            if (hit_mask & (1 << i)) to_world(packet.ray(i), rec[i]);
+        }
+        return hit_mask;
+    }
+
+    virtual bool bounding_box(double time0, double time1, AABB &output_box) const override {
+        AABB box;
+        if (!object->bounding_box(time0, time1, box)) return false;
+        glm::vec3 bmin(std::numeric_limits<float>::max()), bmax(-std::numeric_limits<float>::max());
+        for (int i = 0; i < 8; ++i) {
+            glm::vec3 corner((i & 1) ? box.max().x : box.min().x, (i & 2) ? box.max().y : box.min().y,
+                             (i & 4) ? box.max().z : box.min().z);
+            glm::vec3 p = glm::vec3(transform * glm::vec4(corner, 1.0f));
+            bmin = glm::min(bmin, p);
+            bmax = glm::max(bmax, p);
+        }
+        output_box = AABB(bmin, bmax);
+        return true;
+    }
+
+    shared_ptr<Hitable> object;
+    glm::mat4 transform = glm::mat4(1.0f);  // World from object space
+    std::uint32_t mat_id = ~0u;             // Replaces the materials of the object, ~0u - Keep them
+
+  private:
+    // Moves a hit record from object space to world space. The normal keeps
+    // its side relative to the ray, since the dot product of a direction and
+    // a normal is invariant under the transform.
+    void to_world(const Ray &r, HitRecord &rec) const {
+        rec.p = r.point_at_parameter(rec.t);
+        rec.normal = normal_matrix * rec.normal;
+        if (mat_id != ~0u) rec.mat_id = mat_id;
+    }
+
+    glm::mat3 linear = glm::mat3(1.0f);         // Object from world space
+    glm::vec3 translation = glm::vec3(0.0f);
+    glm::mat3 normal_matrix = glm::mat3(1.0f);  // Inverse transpose of the world from object space
+};
+
+}  // namespace rt
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "rt_environment.h"
+#include "rt_hitable.h"
+#include "rt_material.h"
+#include "rt_sphere.h"
+#include "rt_triangle.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace rt {
+
+// Power heuristic (beta = 2) for the weight of a sample with density pdf_a,
+// that could also have been drawn with density pdf_b
+inline float powerHeuristic(float pdf_a, float pdf_b)
+{
+    float a = pdf_a * pdf_a;
+    float b = pdf_b * pdf_b;
+    if (std::isinf(b)) return 0.0f;
+    return a > 0.0f ? a / (a + b) : 0.0f;
+}
+
+// Lights of a scene: the spheres and triangles with an emissive material
+// among the objects of the BVH of the scene, and the environment map if one
+// is set. At each diffuse hit, one light is picked uniformly and sampled
+// with a shadow ray (next-event estimation). The light sample and the
+// emission that the scattered ray finds are weighted with multiple
+// importance sampling, so that each counts where its density is higher.
+// Both use Material::scattering_pdf(), so they agree for each diffuse method.
+class LightList {
+  public:
+    // Collects the lights among objects, which must be in the order of the
+    // BVH of the scene (see HitRecord::object_id)
+    void build(const std::vector<shared_ptr<Hitable>> &objects, const MaterialTable &materials) {
+        lights.clear();
+        light_objects.clear();
+        light_of_object.assign(objects.size(), -1);
+        for (size_t i = 0; i < objects.size(); ++i) {
+            std::uint32_t mat_id = ~0u;
+            if (auto sphere = std::dynamic_pointer_cast<Sphere>(objects[i])) mat_id = sphere->mat_id;
+            if (auto triangle = std::dynamic_pointer_cast<Triangle>(objects[i])) mat_id = triangle->mat_id;
+            if (mat_id >= materials.size() || materials[mat_id].type != MATERIAL_EMISSIVE) continue;
+            light_of_object[i] = int(lights.size());
+            lights.push_back(objects[i]);
+            light_objects.push_back(std::uint32_t(i));
+        }
+    }
+
+    // Sets the environment map that is sampled as a light, nullptr - None.
+    // Its radiance is that of the missed rays.
+    void set_environment(const Environment *map) { environment = map; }
+
+    bool empty() const { return lights.empty() && !environment; }
+
+    // Number of area lights
+    size_t size() const { return lights.size(); }
+
+    // Samples one light from the diffuse hit rec of material, where
+    // trace(ray, light_rec) traces the shadow ray to its closest hit, and
+    // background(ray) is the radiance of a ray that misses. Returns the
+    // weighted radiance of the light times the scattering density of the
+    // material over the density of the sample, so the direct light of a
+    // Lambertian surface is its albedo times the result.
+    template <typename TraceFn, typename BackgroundFn>
+    glm::vec3 sample_diffuse(const RTContext &rtx, const HitRecord &rec, const Material &material,
+                             const MaterialTable &materials, Sampler &sampler, TraceFn trace,
+                             BackgroundFn background) const {
+        std::uint32_t n = num_strategies();
+        std::uint32_t light = glm::min(std::uint32_t(sampler.next_float() * n), n - 1);
+        glm::vec3 direction;
+        float pdf;
+        bool sampled = light < lights.size() ? lights[light]->sample_direction(rec.p, sampler, direction, pdf)
+                                             : environment->sample(sampler, direction, pdf);
+        if (!sampled || !(pdf > 0.0f) || std::isinf(pdf)) return glm::vec3(0.0f);
+        float bsdf_pdf = material.scattering_pdf(rtx, rec, direction);
+        if (bsdf_pdf <= 0.0f) return glm::vec3(0.0f);
+
+        // An area light is visible if it is the closest hit of the shadow
+        // ray, and the environment if the shadow ray misses
+        Ray shadow_ray(rec.p, direction);
+        HitRecord light_rec;
+        glm::vec3 radiance;
+        if (light < lights.size()) {
+            if (!trace(shadow_ray, light_rec) || light_rec.object_id != light_objects[light]) return glm::vec3(0.0f);
+            radiance = materials[light_rec.mat_id].emitted(light_rec);
+        } else {
+            if (trace(shadow_ray, light_rec)) return glm::vec3(0.0f);
+            radiance = background(shadow_ray);
+        }
+        float light_pdf = pdf / float(n);
+        return radiance * (bsdf_pdf * powerHeuristic(light_pdf, bsdf_pdf) / light_pdf);
+    }
+
+    // Weight of the emission at rec, for a ray r that was scattered with
+    // density bsdf_pdf at a diffuse hit that also sampled the lights.
+    // bsdf_pdf is 0 for other rays (e.g., primary rays or specular bounces),
+    // whose emission counts fully.
+    float emission_weight(const Ray &r, const HitRecord &rec, float bsdf_pdf) const {
+        if (bsdf_pdf <= 0.0f || rec.object_id >= light_of_object.size()) return 1.0f;
+        int light = light_of_object[rec.object_id];
+        if (light < 0) return 1.0f;  // Emissive, but not sampled as a light
+        float light_pdf = lights[light]->direction_pdf(r, rec) / float(num_strategies());
+        return powerHeuristic(bsdf_pdf, light_pdf);
+    }
+
+    // Same for the radiance of the environment, for a ray r that missed
+    float miss_weight(const Ray &r, float bsdf_pdf) const {
+        if (bsdf_pdf <= 0.0f || !environment) return 1.0f;
+        return powerHeuristic(bsdf_pdf, environment->pdf(r.direction()) / float(num_strategies()));
+    }
+
+  private:
+    std::uint32_t num_strategies() const { return std::uint32_t(lights.size()) + (environment ? 1 : 0); }
+
+    std::vector<shared_ptr<Hitable>> lights;
+    std::vector<std::uint32_t> light_objects;  // Index of each light among the objects
+    std::vector<int> light_of_object;          // Index of each object among the lights, -1 - Not a light
+    const Environment *environment = nullptr;
+};
+
+}  // namespace rt
@@ -3,35 +3,69 @@
 #include "rt_ray.h"
 #include "rt_weekend.h"
 
+#include <cstdint>
+#include <vector>
+
 namespace rt {
 
 struct HitRecord;
 
+// Material types, used by the wavefront integrator to shade hits in batches
+// of the same type
+enum MaterialType {
+    MATERIAL_LAMBERTIAN = 0,
+    MATERIAL_METAL,
+    MATERIAL_DIELECTRIC,
+    MATERIAL_EMISSIVE,
+    MATERIAL_OTHER,
+    NUM_MATERIAL_TYPES
+};
+
 class Material {
     public:
+        Material(MaterialType t = MATERIAL_OTHER) : type(t) {}
+        virtual ~Material() {}
+
         virtual bool scatter(
-            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered
+            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered,
+            Sampler &sampler
         ) const = 0;
+
+        // Density over solid angle with which scatter() samples a direction
+        // at rec, or 0 if it does not sample a density (e.g., a mirror)
+        virtual float scattering_pdf(const RTContext &rtx, const HitRecord &rec, const glm::vec3 &direction) const {
+            return 0.0f;
+        }
+
+        // Radiance emitted by the surface at rec towards the ray that hit it
+        virtual glm::vec3 emitted(const HitRecord &rec) const { return glm::vec3(0.0f); }
+
+        // Color of the surface without lighting, used as a denoiser guide
+        virtual glm::vec3 base_color() const { return glm::vec3(1.0f); }
+
+    public:
+        MaterialType type;
 };
 
 // Matte material
 class Lambertian : public Material {
     public:
-        Lambertian(const glm::vec3& a) : albedo(a) {}
+        Lambertian(const glm::vec3& a) : Material(MATERIAL_LAMBERTIAN), albedo(a) {}
 
         virtual bool scatter(
-            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered
+            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered,
+            Sampler &sampler
         ) const override {
             // Get random diffuse based on selected method
             glm::vec3 random_diffuse;
             if (rtx.diffuse_method == 0) {
-                random_diffuse = random_in_unit_sphere();
+                random_diffuse = random_in_unit_sphere(sampler);
             }
             else if (rtx.diffuse_method == 1) {
-                random_diffuse = random_unit_vector();
+                random_diffuse = random_unit_vector(sampler);
             }
             else if (rtx.diffuse_method == 2) {
-                random_diffuse = random_in_hemisphere(rec.normal);
+                random_diffuse = random_in_hemisphere(rec.normal, sampler);
             }
             else {
                 random_diffuse = glm::vec3(0.0f);
@@ -49,6 +83,28 @@ class Lambertian : public Material {
             return true;
         }
 
+        // The scattered direction is the normal plus a random offset. With
+        // c = cos(theta) to the normal, it has the density
+        // - 2 c^3 / pi for a point in the unit ball (method 0),
+        // - c / pi for a point on the unit sphere (method 1),
+        // - (8 c^3 - 1 / c^3) / (2 pi) for c >= 1 / sqrt(2), else 0, for a
+        //   point in the unit half-ball on the side of the normal (method 2).
+        // Since scatter() returns the albedo as the attenuation, the BRDF
+        // times cos is the albedo times this density.
+        virtual float scattering_pdf(const RTContext &rtx, const HitRecord &rec, const glm::vec3 &direction) const override {
+            float c = glm::dot(rec.normal, glm::normalize(direction));
+            if (c <= 0.0f) return 0.0f;
+            const float pi = glm::pi<float>();
+            if (rtx.diffuse_method == 0) return 2.0f * c * c * c / pi;
+            if (rtx.diffuse_method == 1) return c / pi;
+            if (rtx.diffuse_method == 2) {
+                return c * c >= 0.5f ? (8.0f * c * c * c - 1.0f / (c * c * c)) / (2.0f * pi) : 0.0f;
+            }
+            return 0.0f;
+        }
+
+        virtual glm::vec3 base_color() const override { return albedo; }
+
     public:
         glm::vec3 albedo;
 };
@@ -56,17 +112,20 @@ class Lambertian : public Material {
 // Reflective/glossy material
 class Metal : public Material {
     public:
-        Metal(const glm::vec3& a, float f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+        Metal(const glm::vec3& a, float f) : Material(MATERIAL_METAL), albedo(a), fuzz(f < 1 ? f : 1) {}
 
         virtual bool scatter(
-            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered
+            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered,
+            Sampler &sampler
         ) const override {
             glm::vec3 reflected = glm::reflect(glm::normalize(r_in.direction()), rec.normal);
-            scattered = Ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+            scattered = Ray(rec.p, reflected + fuzz*random_in_unit_sphere(sampler));
             attenuation = albedo;
             return (glm::dot(scattered.direction(), rec.normal) > 0);
         }
 
+        virtual glm::vec3 base_color() const override { return albedo; }
+
     public:
         glm::vec3 albedo;
         float fuzz;
@@ -75,10 +134,11 @@ class Metal : public Material {
 // Glass-like material
 class Dielectric : public Material {
     public:
-        Dielectric(float index_of_refraction) : ir(index_of_refraction) {}
+        Dielectric(float index_of_refraction) : Material(MATERIAL_DIELECTRIC), ir(index_of_refraction) {}
 
         virtual bool scatter(
-            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered
+            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered,
+            Sampler &sampler
         ) const override {
             attenuation = glm::vec3(1.0f, 1.0f, 1.0f);
             float refraction_ratio = rec.front_face ? (1.0/ir) : ir;
@@ -90,7 +150,7 @@ class Dielectric : public Material {
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
             glm::vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(sampler))
                 direction = glm::reflect(unit_direction, rec.normal);
             else
                 direction = glm::refract(unit_direction, rec.normal, refraction_ratio);
@@ -111,4 +171,49 @@ class Dielectric : public Material {
         }
 };
 
+// Emissive material of area lights, which emits on the front side and
+// absorbs all light that hits it. Spheres and triangles with this material
+// are also sampled as lights (see LightList).
+class DiffuseLight : public Material {
+    public:
+        DiffuseLight(const glm::vec3& e) : Material(MATERIAL_EMISSIVE), emit(e) {}
+
+        virtual bool scatter(
+            RTContext &rtx, const Ray& r_in, const HitRecord& rec, glm::vec3& attenuation, Ray& scattered,
+            Sampler &sampler
+        ) const override {
+            return false;
+        }
+
+        virtual glm::vec3 emitted(const HitRecord &rec) const override {
+            return rec.front_face ? emit : glm::vec3(0.0f);
+        }
+
+        virtual glm::vec3 base_color() const override { return glm::clamp(emit, 0.0f, 1.0f); }
+
+    public:
+        glm::vec3 emit;
+};
+
+// Materials of a scene. Primitives and hit records refer to materials by
+// their index in the table, so that no shared_ptr is copied (with atomic
+// reference counting) when a hit is recorded.
+class MaterialTable {
+    public:
+        // Adds a material and returns its index
+        std::uint32_t add(shared_ptr<Material> material) {
+            materials.push_back(material);
+            return std::uint32_t(materials.size() - 1);
+        }
+
+        const Material &operator[](std::uint32_t id) const { return *materials[id]; }
+
+        std::uint32_t size() const { return std::uint32_t(materials.size()); }
+
+        void clear() { materials.clear(); }
+
+    public:
+        std::vector<shared_ptr<Material>> materials;
+};
+
 }  // namespace rt
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "rt_ray.h"
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <limits>
+
+namespace rt {
+
+// Packet of up to max_size coherent rays (e.g., neighbouring primary rays),
+// stored as structure of arrays. The lane loops always run over all max_size
+// lanes so that they can be vectorized; unused lanes are copies of lane 0 and
+// are excluded through the active masks.
+struct RayPacket {
+    static const int max_size = 16;
+
+    int size = 0;
+    float ox[max_size], oy[max_size], oz[max_size];
+    float dx[max_size], dy[max_size], dz[max_size];
+    float inv_dx[max_size], inv_dy[max_size], inv_dz[max_size];
+
+    // Bounds of the origins and inverse directions over all lanes, used for
+    // conservative frustum culling of boxes with interval arithmetic
+    glm::vec3 org_min, org_max;
+    glm::vec3 inv_min, inv_max;
+    bool coherent;  // Direction signs agree for all lanes, so culling is valid
+    glm::vec3 mean_dir;  // Sum of the lane directions, for ordering children
+
+    void set(int lane, const Ray &r) {
+        ox[lane] = r.A.x; oy[lane] = r.A.y; oz[lane] = r.A.z;
+        dx[lane] = r.B.x; dy[lane] = r.B.y; dz[lane] = r.B.z;
+    }
+
+    Ray ray(int lane) const {
+        return Ray(glm::vec3(ox[lane], oy[lane], oz[lane]), glm::vec3(dx[lane], dy[lane], dz[lane]));
+    }
+
+    int all_mask() const { return (1 << size) - 1; }
+
+    // Call after set() for lanes [0, num_rays)
+    void finalize(int num_rays) {
+        size = num_rays;
+        for (int i = size; i < max_size; ++i) {
+            ox[i] = ox[0]; oy[i] = oy[0]; oz[i] = oz[0];
+            dx[i] = dx[0]; dy[i] = dy[0]; dz[i] = dz[0];
+        }
+        #pragma omp simd
+        for (int i = 0; i < max_size; ++i) {
+            inv_dx[i] = 1.0f / dx[i];
+            inv_dy[i] = 1.0f / dy[i];
+            inv_dz[i] = 1.0f / dz[i];
+        }
+
+        org_min = org_max = glm::vec3(ox[0], oy[0], oz[0]);
+        inv_min = inv_max = glm::vec3(inv_dx[0], inv_dy[0], inv_dz[0]);
+        glm::bvec3 positive = glm::greaterThanEqual(glm::vec3(dx[0], dy[0], dz[0]), glm::vec3(0.0f));
+        coherent = true;
+        mean_dir = glm::vec3(dx[0], dy[0], dz[0]);
+        for (int i = 1; i < size; ++i) {
+            mean_dir += glm::vec3(dx[i], dy[i], dz[i]);
+            glm::vec3 o(ox[i], oy[i], oz[i]);
+            glm::vec3 inv(inv_dx[i], inv_dy[i], inv_dz[i]);
+            org_min = glm::min(org_min, o);
+            org_max = glm::max(org_max, o);
+            inv_min = glm::min(inv_min, inv);
+            inv_max = glm::max(inv_max, inv);
+            if (glm::greaterThanEqual(glm::vec3(dx[i], dy[i], dz[i]), glm::vec3(0.0f)) != positive)
+                coherent = false;
+        }
+    }
+
+    // Largest t_max of the lanes in mask, or t_min if there are none
+    float max_t(float t_min, const float *t_max, int mask) const {
+        float t_far = t_min;
+        for (int i = 0; i < size; ++i) {
+            if (mask & (1 << i)) t_far = glm::max(t_far, t_max[i]);
+        }
+        return t_far;
+    }
+
+    // Returns false if no ray of the packet can hit the box before t_far,
+    // which should be the largest t_max of the active lanes
+    bool frustum_overlaps(const glm::vec3 &bmin, const glm::vec3 &bmax, float t_min, float t_far) const {
+        if (!coherent) return true;
+        float t_near = t_min;
+        for (int a = 0; a < 3; ++a) {
+            // Range of t over all lanes for the two slab planes, as interval
+            // products (plane - [org_min, org_max]) * [inv_min, inv_max]
+            float p0 = bmin[a] - org_max[a], p1 = bmin[a] - org_min[a];
+            float q0 = bmax[a] - org_max[a], q1 = bmax[a] - org_min[a];
+            float i0 = inv_min[a], i1 = inv_max[a];
+            float lo_min = glm::min(glm::min(p0 * i0, p0 * i1), glm::min(p1 * i0, p1 * i1));
+            float hi_min = glm::max(glm::max(p0 * i0, p0 * i1), glm::max(p1 * i0, p1 * i1));
+            float lo_max = glm::min(glm::min(q0 * i0, q0 * i1), glm::min(q1 * i0, q1 * i1));
+            float hi_max = glm::max(glm::max(q0 * i0, q0 * i1), glm::max(q1 * i0, q1 * i1));
+            // The near plane is bmin for positive directions and bmax otherwise
+            bool positive = i0 >= 0.0f;
+            t_near = glm::max(t_near, positive ? lo_min : lo_max);
+            t_far = glm::min(t_far, positive ? hi_max : hi_min);
+        }
+        return t_near <= t_far;
+    }
+
+    // Slab test of all lanes against the box. Returns the lanes of mask that
+    // hit the box before their t_max, and their smallest entry distance in
+    // t_enter.
+    int hit_box(const glm::vec3 &bmin, const glm::vec3 &bmax, float t_min, const float *t_max,
+                int mask, float &t_enter) const {
+        int hit[max_size];
+        float enter[max_size];
+        #pragma omp simd
+        for (int i = 0; i < max_size; ++i) {
+            float tx0 = (bmin.x - ox[i]) * inv_dx[i], tx1 = (bmax.x - ox[i]) * inv_dx[i];
+            float ty0 = (bmin.y - oy[i]) * inv_dy[i], ty1 = (bmax.y - oy[i]) * inv_dy[i];
+            float tz0 = (bmin.z - oz[i]) * inv_dz[i], tz1 = (bmax.z - oz[i]) * inv_dz[i];
+            float t_near = glm::max(glm::max(glm::min(tx0, tx1), glm::min(ty0, ty1)),
+                                    glm::max(glm::min(tz0, tz1), t_min));
+            float t_far = glm::min(glm::min(glm::max(tx0, tx1), glm::max(ty0, ty1)),
+                                   glm::min(glm::max(tz0, tz1), t_max[i]));
+            hit[i] = t_near <= t_far;
+            enter[i] = t_near;
+        }
+        for (int i = 0; i < max_size; ++i) {
+            if (!hit[i]) mask &= ~(1 << i);
+        }
+        mask &= all_mask();
+        t_enter = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < size; ++i) {
+            if (mask & (1 << i)) t_enter = glm::min(t_enter, enter[i]);
+        }
+        return mask;
+    }
+};
+
+}  // namespace rt
@@ -8,11 +8,28 @@
 #include "rt_weekend.h"
 #include "rt_material.h"
 #include "rt_bvh_node.h"
+#include "rt_hitable_bvh.h"
+#include "rt_triangle_mesh.h"
+#include "rt_instance.h"
+#include "rt_light.h"
+#include "rt_tile_scheduler.h"
+#include "rt_wavefront.h"
+#include "rt_denoiser.h"
+#include "rt_scene_cache.h"
 
 #include "cg_utils2.h"  // Used for OBJ-mesh loading
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <thread>
+
 namespace rt {
 
+static_assert(PerfCounters::num_material_types == NUM_MATERIAL_TYPES, "PerfCounters should count all material types");
+
 // Store scene (world) in a global variable for convenience
 struct Scene {
     Sphere ground;
@@ -22,6 +39,17 @@ struct Scene {
     // std::vector<Triangle> mesh;
     // Box mesh_bbox;
     HitableList world;
+    shared_ptr<HitableBvh> bvh;
+    std::vector<shared_ptr<TriangleMesh>> meshes;  // Meshes in the world, which have their own BVH
+    std::vector<shared_ptr<Instance>> instances;   // Instances in the world, and their transforms at time 0
+    std::vector<glm::mat4> instance_transforms;
+    float instance_time = 0.0f;  // Time that the instances are posed at
+    MaterialTable materials;
+    LightList lights;  // Emissive objects of the BVH and the environment, sampled at diffuse hits
+    Environment environment;
+    PrefilteredEnvironment prefiltered;  // Levels of the environment map for fast previews, if it has them
+    std::string environment_map;         // Directory of the loaded environment, see loadEnvironment()
+    SceneCache cache;
 } g_scene;
 
 bool hit_world(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec)
@@ -71,32 +99,122 @@ bool hit_world(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord
 //
 // if (hit_world(...)) {
 //     ...
-//     return color(rtx, r_bounce, max_bounces - 1);
+//     return color(rtx, r_bounce, max_bounces - 1, num_rays, bounces, sampler);
 // }
 //
 // See Chapter 7 in the "Ray Tracing in a Weekend" book
-glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces)
+//
+// num_rays counts all rays that are traced, including shadow rays, and
+// bounces is set to the depth of the last bounced ray of the path. The
+// bounce holds what a bounced ray r carries from the hit that scattered it
+// (see Bounce).
+struct Bounce;
+glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces, int &num_rays, int &bounces, Sampler &sampler,
+                const Bounce &bounce);
+
+// What a bounced ray carries from the hit that scattered it. Primary rays
+// have the defaults.
+struct Bounce {
+    float bsdf_pdf = 0.0f;     // Density of the ray, if it was scattered at a diffuse hit that also sampled the lights (for MIS)
+    bool prefiltered = false;  // If the ray misses, it sees miss_radiance instead of the environment
+    glm::vec3 miss_radiance = glm::vec3(0.0f);
+};
+
+// Color of a ray that did not hit anything
+glm::vec3 background(RTContext &rtx, const Ray &r)
+{
+    if (!g_scene.environment.empty()) { return rtx.environment_intensity * g_scene.environment.radiance(r.direction()); }
+    glm::vec3 unit_direction = glm::normalize(r.direction());
+    float t = 0.5f * (unit_direction.y + 1.0f);
+    return (1.0f - t) * rtx.ground_color + t * rtx.sky_color;
+}
+
+// True if diffuse and glossy bounces that miss see the prefiltered
+// environment (see RTContext::prefiltered_environment)
+bool usePrefilteredEnvironment(const RTContext &rtx)
+{
+    return rtx.prefiltered_environment && !g_scene.environment.empty() && !g_scene.prefiltered.empty();
+}
+
+// Phong exponent of the lobe of a fuzzy Metal, where the reflected direction
+// is offset by a random point in a ball of radius fuzz. The lobes match in
+// the mean of sin^2 of the angle to the mirror direction: 2 / (n + 3) for
+// the Phong lobe and about 2/5 fuzz^2 for the ball.
+float fuzzExponent(float fuzz)
+{
+    return 5.0f / glm::max(fuzz * fuzz, 1e-6f) - 3.0f;
+}
+
+// Prefiltered radiance that a ray scattered at rec sees if it misses, for
+// diffuse and fuzzy metal materials. Returns false for other materials.
+bool prefilteredMiss(RTContext &rtx, const Material &material, const Ray &r, const HitRecord &rec, glm::vec3 &radiance)
+{
+    if (material.type == MATERIAL_LAMBERTIAN) {
+        radiance = rtx.environment_intensity * g_scene.prefiltered.irradiance(rec.normal);
+        return true;
+    }
+    if (material.type == MATERIAL_METAL) {
+        float fuzz = static_cast<const Metal &>(material).fuzz;
+        if (fuzz <= 0.0f) return false;  // A mirror sees the environment itself
+        glm::vec3 reflected = glm::reflect(glm::normalize(r.direction()), rec.normal);
+        radiance = rtx.environment_intensity * g_scene.prefiltered.glossy(reflected, fuzzExponent(fuzz));
+        return true;
+    }
+    return false;
+}
+
+// Color of a ray that hit a surface. Bounced rays are traced with color().
+glm::vec3 shade(RTContext &rtx, const Ray &r, HitRecord &rec, int max_bounces, int &num_rays, int &bounces, Sampler &sampler,
+                const Bounce &bounce = Bounce())
+{
+    rec.normal = glm::normalize(rec.normal);    // Always normalise before use!
+    if (rtx.show_normals) { return rec.normal * 0.5f + 0.5f; }
+    const Material &material = g_scene.materials[rec.mat_id];
+    countHits(material.type);
+
+    // Emission, weighted against the light sample of the previous bounce
+    glm::vec3 c = material.emitted(rec);
+    if (c != glm::vec3(0.0f)) { c *= g_scene.lights.emission_weight(r, rec, bounce.bsdf_pdf); }
+
+    Ray scattered;
+    glm::vec3 attenuation;
+    if (!material.scatter(rtx, r, rec, attenuation, scattered, sampler)) return c;
+
+    // Diffuse hits also sample one light with a shadow ray, which is traced
+    // as a ray of the next bounce
+    Bounce next;
+    if (material.type == MATERIAL_LAMBERTIAN && rtx.light_sampling && !g_scene.lights.empty() && max_bounces > 0) {
+        auto trace = [&](const Ray &shadow_ray, HitRecord &light_rec) {
+            num_rays += 1;
+            countRays(rtx.max_bounces - max_bounces + 1);
+            return hit_world(rtx, shadow_ray, 0.001f, 9999.0f, light_rec);
+        };
+        auto sky = [&](const Ray &shadow_ray) { return background(rtx, shadow_ray); };
+        c += attenuation * g_scene.lights.sample_diffuse(rtx, rec, material, g_scene.materials, sampler, trace, sky);
+        next.bsdf_pdf = material.scattering_pdf(rtx, rec, scattered.direction());
+    }
+    if (usePrefilteredEnvironment(rtx)) { next.prefiltered = prefilteredMiss(rtx, material, r, rec, next.miss_radiance); }
+    return c + attenuation * color(rtx, scattered, max_bounces-1, num_rays, bounces, sampler, next);
+}
+
+glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces, int &num_rays, int &bounces, Sampler &sampler, const Bounce &bounce)
 {
     if (max_bounces < 0) return glm::vec3(0.0f);
+    num_rays += 1;
+    bounces = rtx.max_bounces - max_bounces;
+    countRays(bounces);
 
     HitRecord rec;
     if (hit_world(rtx, r, 0.001f, 9999.0f, rec)) {  // Set min to avoid "shadow acne" (floating point approximation error)
-        rec.normal = glm::normalize(rec.normal);    // Always normalise before use!
-        if (rtx.show_normals) { return rec.normal * 0.5f + 0.5f; }
-
-        // Implement lighting for materials here
-        // ...
-        Ray scattered;
-        glm::vec3 attenuation;
-        if (rec.mat_ptr->scatter(rtx, r, rec, attenuation, scattered))
-            return attenuation * color(rtx, scattered, max_bounces-1);
-        return glm::vec3(0.0f);
+        return shade(rtx, r, rec, max_bounces, num_rays, bounces, sampler, bounce);
     }
 
-    // If no hit, return sky color
-    glm::vec3 unit_direction = glm::normalize(r.direction());
-    float t = 0.5f * (unit_direction.y + 1.0f);
-    return (1.0f - t) * rtx.ground_color + t * rtx.sky_color;
+    // If no hit, return sky color, weighted against the light sample of the
+    // previous bounce
+    if (bounce.prefiltered) return bounce.miss_radiance;
+    glm::vec3 c = background(rtx, r);
+    if (bounce.bsdf_pdf > 0.0f) { c *= g_scene.lights.miss_weight(r, bounce.bsdf_pdf); }
+    return c;
 }
 
 // Old way of adding objects to the scene
@@ -150,21 +268,20 @@ glm::vec3 color(RTContext &rtx, const Ray &r, int max_bounces)
     // }
 // }
 
-HitableList custom_scene(const char *filename) {
+HitableList custom_scene(const char *filename, MaterialTable &materials) {
     // New way of adding objects to g_scene.world object
     HitableList world;
 
-    auto material_ground = make_shared<Lambertian>(glm::vec3(0.2f, 0.6f, 0.2f));
+    auto material_ground = materials.add(make_shared<Lambertian>(glm::vec3(0.2f, 0.6f, 0.2f)));
     
-    auto material_center = make_shared<Lambertian>(glm::vec3(0.7f, 0.3f, 0.3f));
-    auto material_left   = make_shared<Metal>(glm::vec3(0.8f, 0.8f, 0.8f), 0.1f);
-    auto material_right  = make_shared<Metal>(glm::vec3(0.8f, 0.6f, 0.2f), 0.5f);
+    auto material_left   = materials.add(make_shared<Metal>(glm::vec3(0.8f, 0.8f, 0.8f), 0.1f));
+    auto material_right  = materials.add(make_shared<Metal>(glm::vec3(0.8f, 0.6f, 0.2f), 0.5f));
 
-    auto material_blue_metal = make_shared<Metal>(glm::vec3(0.0f, 0.0f, 1.0f), 0.1f);
-    auto material_orange_metal = make_shared<Metal>(glm::vec3(1.0f, 0.6f, 0.0f), 0.6f);
-    auto material_red_matte = make_shared<Lambertian>(glm::vec3(1.0f, 0.0f, 0.0f));
+    auto material_blue_metal = materials.add(make_shared<Metal>(glm::vec3(0.0f, 0.0f, 1.0f), 0.1f));
+    auto material_orange_metal = materials.add(make_shared<Metal>(glm::vec3(1.0f, 0.6f, 0.0f), 0.6f));
+    auto material_red_matte = materials.add(make_shared<Lambertian>(glm::vec3(1.0f, 0.0f, 0.0f)));
 
-    auto material_glass = make_shared<Dielectric>(1.5);
+    auto material_glass = materials.add(make_shared<Dielectric>(1.5));
 
     // Ground sphere
     world.add(make_shared<Sphere>(glm::vec3(0.0f, -1000.5f, 0.0f), 1000.0f, material_ground));
@@ -179,25 +296,15 @@ HitableList custom_scene(const char *filename) {
     world.add(make_shared<Sphere>(glm::vec3(1.0f, 0.0f, -1.0f), 0.5f, material_red_matte));
 
     // Triangle mesh
-    cg::OBJMesh mesh;
-    cg::objMeshLoad(mesh, filename);
-    for (int i = 0; i < mesh.indices.size(); i += 3) {
-       int i0 = mesh.indices[i + 0];
-       int i1 = mesh.indices[i + 1];
-       int i2 = mesh.indices[i + 2];
-       glm::vec3 v0 = mesh.vertices[i0] + glm::vec3(0.0f, 0.135f, 0.0f);
-       glm::vec3 v1 = mesh.vertices[i1] + glm::vec3(0.0f, 0.135f, 0.0f);
-       glm::vec3 v2 = mesh.vertices[i2] + glm::vec3(0.0f, 0.135f, 0.0f);
-       world.add(make_shared<Triangle>(Triangle(v0, v1, v2, material_left)));
-    }
+    world.add(g_scene.cache.load_mesh(filename, glm::vec3(0.0f, 0.135f, 0.0f), material_left));
 
     return world;
 }
 
-HitableList semi_random_scene(const char *filename) {
+HitableList semi_random_scene(const char *filename, MaterialTable &materials) {
     HitableList world;
 
-    auto ground_material = make_shared<Lambertian>(glm::vec3(0.5f, 0.5f, 0.5f));
+    auto ground_material = materials.add(make_shared<Lambertian>(glm::vec3(0.5f, 0.5f, 0.5f)));
     world.add(make_shared<Sphere>(glm::vec3(0,-1000,0), 1000, ground_material));
 
     for (int a = -5; a < 5; a++) {
@@ -206,55 +313,45 @@ HitableList semi_random_scene(const char *filename) {
             glm::vec3 center(a + 0.3*random_double(), 0.2, b + 0.3*random_double());
 
             if ((center - glm::vec3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<Material> sphere_material;
+                std::uint32_t sphere_material;
 
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = random_vec3() * random_vec3();
-                    sphere_material = make_shared<Lambertian>(albedo);
+                    sphere_material = materials.add(make_shared<Lambertian>(albedo));
                     world.add(make_shared<Sphere>(center, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = random_vec3(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<Metal>(albedo, fuzz);
+                    sphere_material = materials.add(make_shared<Metal>(albedo, fuzz));
                     world.add(make_shared<Sphere>(center, 0.2, sphere_material));
                 } else {
                     // glass
-                    sphere_material = make_shared<Dielectric>(1.5);
+                    sphere_material = materials.add(make_shared<Dielectric>(1.5));
                     world.add(make_shared<Sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<Dielectric>(1.5);
+    auto material1 = materials.add(make_shared<Dielectric>(1.5));
     world.add(make_shared<Sphere>(glm::vec3(-1.25, 0.5, 0), 0.5, material1));
 
-    auto material2 = make_shared<Metal>(glm::vec3(0.8, 0.8, 0.8), 0.1);
+    auto material2 = materials.add(make_shared<Metal>(glm::vec3(0.8, 0.8, 0.8), 0.1));
     // Triangle mesh
-    cg::OBJMesh mesh;
-    cg::objMeshLoad(mesh, filename);
-    for (int i = 0; i < mesh.indices.size(); i += 3) {
-       int i0 = mesh.indices[i + 0];
-       int i1 = mesh.indices[i + 1];
-       int i2 = mesh.indices[i + 2];
-       glm::vec3 v0 = mesh.vertices[i0] + glm::vec3(0.0f, 0.5f, 0.0f);
-       glm::vec3 v1 = mesh.vertices[i1] + glm::vec3(0.0f, 0.5f, 0.0f);
-       glm::vec3 v2 = mesh.vertices[i2] + glm::vec3(0.0f, 0.5f, 0.0f);
-       world.add(make_shared<Triangle>(Triangle(v0, v1, v2, material2)));
-    }
-
-    auto material3 = make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0);
+    world.add(g_scene.cache.load_mesh(filename, glm::vec3(0.0f, 0.5f, 0.0f), material2));
+
+    auto material3 = materials.add(make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0));
     world.add(make_shared<Sphere>(glm::vec3(1.25, 0.5, 0), 0.5, material3));
 
     return world;
 }
 
-HitableList random_scene() {
+HitableList random_scene(MaterialTable &materials) {
     HitableList world;
 
-    auto ground_material = make_shared<Lambertian>(glm::vec3(0.5f, 0.5f, 0.5f));
+    auto ground_material = materials.add(make_shared<Lambertian>(glm::vec3(0.5f, 0.5f, 0.5f)));
     world.add(make_shared<Sphere>(glm::vec3(0,-1000,0), 1000, ground_material));
 
     for (int a = -11; a < 11; a++) {
@@ -263,59 +360,301 @@ HitableList random_scene() {
             glm::vec3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
 
             if ((center - glm::vec3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<Material> sphere_material;
+                std::uint32_t sphere_material;
 
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = random_vec3() * random_vec3();
-                    sphere_material = make_shared<Lambertian>(albedo);
+                    sphere_material = materials.add(make_shared<Lambertian>(albedo));
                     world.add(make_shared<Sphere>(center, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = random_vec3(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<Metal>(albedo, fuzz);
+                    sphere_material = materials.add(make_shared<Metal>(albedo, fuzz));
                     world.add(make_shared<Sphere>(center, 0.2, sphere_material));
                 } else {
                     // glass
-                    sphere_material = make_shared<Dielectric>(1.5);
+                    sphere_material = materials.add(make_shared<Dielectric>(1.5));
                     world.add(make_shared<Sphere>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<Dielectric>(1.5);
+    auto material1 = materials.add(make_shared<Dielectric>(1.5));
     world.add(make_shared<Sphere>(glm::vec3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<Lambertian>(glm::vec3(0.4, 0.2, 0.1));
+    auto material2 = materials.add(make_shared<Lambertian>(glm::vec3(0.4, 0.2, 0.1)));
     world.add(make_shared<Sphere>(glm::vec3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0);
+    auto material3 = materials.add(make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0));
     world.add(make_shared<Sphere>(glm::vec3(4, 1, 0), 1.0, material3));
 
     return world;
 }
 
+// A field of instances of one mesh on a jittered grid, with random
+// orientations, sizes and materials. All instances share the geometry and
+// BVH of the mesh.
+HitableList bunny_field_scene(const char *filename, MaterialTable &materials) {
+    HitableList world;
+
+    auto ground_material = materials.add(make_shared<Lambertian>(glm::vec3(0.5f, 0.5f, 0.5f)));
+    world.add(make_shared<Sphere>(glm::vec3(0.0f, -1000.5f, 0.0f), 1000.0f, ground_material));
+
+    std::uint32_t palette[8];
+    for (int i = 0; i < 6; ++i) palette[i] = materials.add(make_shared<Lambertian>(random_vec3(0.1, 0.9)));
+    palette[6] = materials.add(make_shared<Metal>(glm::vec3(0.8f, 0.8f, 0.8f), 0.1f));
+    palette[7] = materials.add(make_shared<Metal>(glm::vec3(0.8f, 0.6f, 0.2f), 0.3f));
+
+    auto mesh = g_scene.cache.load_mesh(filename, glm::vec3(0.0f), palette[0]);
+    AABB box;
+    if (!mesh->bounding_box(0, 0, box)) return world;
+
+    const int n = 100;  // Instances per side
+    const float spacing = 1.2f;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            float scale = float(random_double(0.5, 0.9));
+            glm::vec3 position((i - n / 2 + 0.5f + 0.3f * float(random_double(-1, 1))) * spacing,
+                               -0.5f - box.min().y * scale,
+                               (j - n / 2 + 0.5f + 0.3f * float(random_double(-1, 1))) * spacing);
+            glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+            transform = glm::rotate(transform, float(random_double(0, 2.0 * glm::pi<double>())), glm::vec3(0, 1, 0));
+            transform = glm::scale(transform, glm::vec3(scale));
+            world.add(make_shared<Instance>(mesh, transform, palette[random_int(0, 7)]));
+        }
+    }
+
+    return world;
+}
+
+// Adds the quad p, p + u, p + u + v, p + v as two triangles, which face the
+// side of cross(u, v)
+void addQuad(HitableList &world, const glm::vec3 &p, const glm::vec3 &u, const glm::vec3 &v, std::uint32_t mat_id)
+{
+    world.add(make_shared<Triangle>(p, p + u, p + u + v, mat_id));
+    world.add(make_shared<Triangle>(p, p + u + v, p + v, mat_id));
+}
+
+// A closed box in the style of the Cornell box, with the mesh and two spheres
+// inside, lit by a small quad light on the ceiling and a small sphere light.
+// No light from the sky reaches the inside, so all light comes from the area
+// lights. The front wall faces inside, and since triangles are one-sided,
+// the camera sees through it from outside.
+HitableList lights_scene(const char *filename, MaterialTable &materials) {
+    HitableList world;
+
+    auto white = materials.add(make_shared<Lambertian>(glm::vec3(0.73f, 0.73f, 0.73f)));
+    auto red = materials.add(make_shared<Lambertian>(glm::vec3(0.65f, 0.05f, 0.05f)));
+    auto green = materials.add(make_shared<Lambertian>(glm::vec3(0.12f, 0.45f, 0.15f)));
+    auto ceiling_light = materials.add(make_shared<DiffuseLight>(glm::vec3(15.0f, 13.0f, 10.0f)));
+    auto sphere_light = materials.add(make_shared<DiffuseLight>(glm::vec3(4.0f, 8.0f, 20.0f)));
+    auto glass = materials.add(make_shared<Dielectric>(1.5f));
+    auto metal = materials.add(make_shared<Metal>(glm::vec3(0.8f, 0.8f, 0.8f), 0.05f));
+
+    // Walls of the box [-1, 1]^3, facing inside
+    addQuad(world, glm::vec3(-1, -1, -1), glm::vec3(0, 0, 2), glm::vec3(2, 0, 0), white);  // Floor
+    addQuad(world, glm::vec3(-1, 1, -1), glm::vec3(2, 0, 0), glm::vec3(0, 0, 2), white);   // Ceiling
+    addQuad(world, glm::vec3(-1, -1, -1), glm::vec3(2, 0, 0), glm::vec3(0, 2, 0), white);  // Back
+    addQuad(world, glm::vec3(-1, -1, 1), glm::vec3(0, 2, 0), glm::vec3(2, 0, 0), white);   // Front
+    addQuad(world, glm::vec3(-1, -1, -1), glm::vec3(0, 2, 0), glm::vec3(0, 0, 2), red);    // Left
+    addQuad(world, glm::vec3(1, -1, -1), glm::vec3(0, 0, 2), glm::vec3(0, 2, 0), green);   // Right
+
+    // Lights
+    addQuad(world, glm::vec3(-0.25f, 0.999f, -0.25f), glm::vec3(0.5f, 0, 0), glm::vec3(0, 0, 0.5f), ceiling_light);
+    world.add(make_shared<Sphere>(glm::vec3(0.6f, -0.3f, -0.6f), 0.08f, sphere_light));
+
+    world.add(make_shared<Sphere>(glm::vec3(0.45f, -0.7f, 0.3f), 0.3f, glass));
+    world.add(make_shared<Sphere>(glm::vec3(-0.5f, -0.65f, -0.5f), 0.35f, metal));
+
+    // The mesh stands on the floor
+    auto mesh = g_scene.cache.load_mesh(filename, glm::vec3(0.0f), white);
+    AABB box;
+    if (mesh->bounding_box(0, 0, box)) {
+        float scale = 0.8f / glm::max(glm::max(box.max().x - box.min().x, box.max().y - box.min().y), 1e-6f);
+        glm::vec3 position(-0.2f - 0.5f * (box.min().x + box.max().x) * scale, -1.0f - box.min().y * scale,
+                           0.1f - 0.5f * (box.min().z + box.max().z) * scale);
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+        transform = glm::scale(transform, glm::vec3(scale));
+        world.add(make_shared<Instance>(mesh, transform));
+    }
+
+    return world;
+}
+
+const char *sceneName(int scene)
+{
+    const char *names[NUM_SCENES] = { "semi-random", "custom", "random", "bunnies", "lights" };
+    return scene >= 0 && scene < NUM_SCENES ? names[scene] : "";
+}
+
+const char *heatmapModeName(int mode)
+{
+    const char *names[NUM_HEATMAP_MODES] = { "off", "primary", "path" };
+    return mode >= 0 && mode < NUM_HEATMAP_MODES ? names[mode] : "";
+}
+
+const char *heatmapMetricName(int metric)
+{
+    const char *names[NUM_HEATMAP_METRICS] = { "nodes", "tests", "both" };
+    return metric >= 0 && metric < NUM_HEATMAP_METRICS ? names[metric] : "";
+}
+
 // MODIFY THIS FUNCTION!
 void setupScene(RTContext &rtx, const char *filename)
 {
     g_scene.world.clear();
+    g_scene.environment.clear();
+    g_scene.prefiltered.clear();
+    g_scene.environment_map.clear();
+    g_scene.cache.set_directory(rtx.scene_cache_dir);
 
     // custom_scene_old(filename);
-    // HitableList world = custom_scene(filename);
-    HitableList world = semi_random_scene(filename);
-    // HitableList world = random_scene();
+    g_scene.materials.clear();
+    HitableList world;
+    switch (rtx.scene) {
+    case SCENE_CUSTOM: world = custom_scene(filename, g_scene.materials); break;
+    case SCENE_RANDOM: world = random_scene(g_scene.materials); break;
+    case SCENE_BUNNY_FIELD: world = bunny_field_scene(filename, g_scene.materials); break;
+    case SCENE_LIGHTS: world = lights_scene(filename, g_scene.materials); break;
+    default: world = semi_random_scene(filename, g_scene.materials); break;
+    }
 
-    g_scene.world = HitableList(make_shared<BvhNode>(world, 0.0, 1.0));
+    // g_scene.world = HitableList(make_shared<BvhNode>(world, 0.0, 1.0));
+    // Meshes are collected once, also if they are shared by instances
+    g_scene.meshes.clear();
+    g_scene.instances.clear();
+    g_scene.instance_transforms.clear();
+    g_scene.instance_time = 0.0f;
+    for (const auto &object : world.objects) {
+        auto instance = std::dynamic_pointer_cast<Instance>(object);
+        if (instance) {
+            g_scene.instances.push_back(instance);
+            g_scene.instance_transforms.push_back(instance->transform);
+        }
+        auto mesh = std::dynamic_pointer_cast<TriangleMesh>(instance ? instance->object : object);
+        if (mesh && std::find(g_scene.meshes.begin(), g_scene.meshes.end(), mesh) == g_scene.meshes.end()) {
+            g_scene.meshes.push_back(mesh);
+        }
+    }
+    g_scene.bvh = make_shared<HitableBvh>();
+    g_scene.bvh->objects = world.objects;
+    g_scene.lights.build(world.objects, g_scene.materials);
+    if (!g_scene.lights.empty()) { std::cout << "Area lights: " << g_scene.lights.size() << std::endl; }
+    rebuildBvh(rtx);
+    g_scene.world = HitableList(g_scene.bvh);
+    loadEnvironment(rtx);
 }
 
-// MODIFY THIS FUNCTION!
-void updateLine(RTContext &rtx, int y)
+// Loads the environment map of rtx.environment_map and its prefiltered
+// levels, or removes it if that is empty or cannot be loaded. A directory
+// with only prefiltered levels (e.g., LarnacaCastle2) uses the sharpest
+// level as the map. Also call this when rtx.prefiltered_environment changes.
+void loadEnvironment(RTContext &rtx)
 {
-    int nx = rtx.width;
-    int ny = rtx.height;
-    float aspect = float(nx) / float(ny);
+    if (rtx.environment_map != g_scene.environment_map) {
+        const std::string &loaded = g_scene.environment_map = rtx.environment_map;
+        g_scene.environment.clear();
+        g_scene.prefiltered.clear();
+        if (!loaded.empty()) {
+            g_scene.prefiltered.load(loaded);
+            std::string dirname = loaded;
+            if (!std::ifstream((dirname + "/posx.png").c_str()) && std::ifstream((dirname + "/2048/posx.png").c_str())) {
+                dirname += "/2048";
+            }
+            if (g_scene.environment.load(dirname)) {
+                g_scene.prefiltered.match_mean(g_scene.environment);
+                std::cout << "Loaded environment map " << loaded
+                          << (g_scene.prefiltered.empty() ? "" : " with prefiltered levels") << std::endl;
+            }
+        }
+    }
+    // The prefiltered levels replace sampling the environment as a light
+    bool sample_environment = !g_scene.environment.empty() && !usePrefilteredEnvironment(rtx);
+    g_scene.lights.set_environment(sample_environment ? &g_scene.environment : nullptr);
+}
+
+BvhBuildOptions bvhBuildOptions(const RTContext &rtx)
+{
+    BvhBuildOptions options;
+    options.builder = rtx.bvh_builder;
+    options.max_leaf_size = glm::max(1, rtx.bvh_max_leaf_size);
+    options.traversal_cost = rtx.bvh_traversal_cost;
+    options.width = rtx.bvh_width;
+    return options;
+}
+
+const char *bvhSimdName(int width)
+{
+    return width == 2 ? "scalar" : wideBvhSimdName(width);
+}
+
+// Rebuilds the BVH of the scene with the builder settings in rtx
+void rebuildBvh(RTContext &rtx)
+{
+    if (!g_scene.bvh) return;
+
+    BvhBuildOptions options = bvhBuildOptions(rtx);
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &mesh : g_scene.meshes) {
+        g_scene.cache.build_bvh(*mesh, options);
+    }
+    g_scene.bvh->build(options);
+    double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    const char *builder_names[] = { "median split", "binned SAH", "parallel LBVH" };
+    std::cout << "Built BVH (" << builder_names[glm::clamp(options.builder, 0, 2)] << ") in "
+              << build_ms << " ms" << std::endl;
+    if (!g_scene.instances.empty()) {
+        std::cout << "Instances: " << g_scene.instances.size() << " of " << g_scene.meshes.size() << " mesh(es)"
+                  << std::endl;
+    }
+    std::cout << "Number of BVH nodes: " << g_scene.bvh->bvh.nodes.size()
+              << ", SAH cost: " << g_scene.bvh->bvh.sah_cost(options.traversal_cost) << std::endl;
+    if (options.width == 4 || options.width == 8) {
+        std::cout << "Collapsed to " << options.width << "-wide BVH (" << bvhSimdName(options.width) << ") with "
+                  << (options.width == 4 ? g_scene.bvh->bvh4.nodes.size() : g_scene.bvh->bvh8.nodes.size())
+                  << " nodes" << std::endl;
+    }
+    for (const auto &mesh : g_scene.meshes) {
+        std::cout << "Mesh with " << mesh->num_triangles() << " triangles: " << mesh->bvh.nodes.size()
+                  << " BVH nodes, SAH cost: " << mesh->bvh.sah_cost(options.traversal_cost) << ", "
+                  << float(mesh->geometry_bytes()) / glm::max(1u, mesh->num_triangles()) << " bytes/triangle"
+                  << std::endl;
+    }
+}
+
+// Turns each instance of the scene about its vertical axis at its own speed,
+// to the orientation at the given time in seconds. Only the top-level BVH
+// over the instances is rebuilt. updateFrame() calls this when
+// rtx.instance_time changes.
+void animateInstances(RTContext &rtx, float time)
+{
+    g_scene.instance_time = time;
+    if (!g_scene.bvh || g_scene.instances.empty()) return;
+    for (size_t i = 0; i < g_scene.instances.size(); ++i) {
+        float speed = 0.5f + float((i * 7919) % 100) / 100.0f;
+        g_scene.instances[i]->set_transform(
+            glm::rotate(g_scene.instance_transforms[i], time * speed, glm::vec3(0.0f, 1.0f, 0.0f)));
+    }
+    g_scene.bvh->build(bvhBuildOptions(rtx));
+}
+
+// Camera parameters shared by all pixels of a frame
+struct Camera {
+    glm::vec3 origin;
+    glm::vec3 horizontal;
+    glm::vec3 vertical;
+    glm::vec3 lower_left_corner;
+    glm::mat4 world_from_view;
+};
+
+Camera setupCamera(const RTContext &rtx)
+{
+    float aspect = float(rtx.width) / float(rtx.height);
 
     float theta = glm::radians(rtx.vfov);
     float h = tan(theta/2.0f);
@@ -324,75 +663,496 @@ void updateLine(RTContext &rtx, int y)
 
     float focal_length = 1.0f;
 
-    glm::vec3 origin(0.0f, 0.0f, 0.0f);
-    glm::vec3 horizontal(viewport_width, 0.0f, 0.0f);
-    glm::vec3 vertical(0.0f, viewport_height, 0.0f);
+    Camera cam;
+    cam.origin = glm::vec3(0.0f, 0.0f, 0.0f);
+    cam.horizontal = glm::vec3(viewport_width, 0.0f, 0.0f);
+    cam.vertical = glm::vec3(0.0f, viewport_height, 0.0f);
     // glm::vec3 lower_left_corner(-1.0f * aspect, -1.0f, -1.0f);
-    glm::vec3 lower_left_corner = origin - horizontal/2.0f - vertical/2.0f - glm::vec3(0, 0, focal_length);
-    glm::mat4 world_from_view = glm::inverse(rtx.view);
-
-    // You can try parallelising this loop by uncommenting this line:
-    #pragma omp parallel for schedule(dynamic)
-    for (int x = 0; x < nx; ++x) {
-        float u, v;
-        if (rtx.perform_antialiasing) {
-            // Add random jitter to u, v so that we get antialiasing from averaging color values between multiple frames
-            u = (float(x) + float(random_double())) / float(nx);
-            v = (float(y) + float(random_double())) / float(ny);
+    cam.lower_left_corner = cam.origin - cam.horizontal/2.0f - cam.vertical/2.0f - glm::vec3(0, 0, focal_length);
+    cam.world_from_view = glm::inverse(rtx.view);
+    return cam;
+}
+
+// Returns a primary ray through pixel (x, y)
+Ray cameraRay(const RTContext &rtx, const Camera &cam, int x, int y, Sampler &sampler)
+{
+    int nx = rtx.width;
+    int ny = rtx.height;
+
+    float u, v;
+    if (rtx.perform_antialiasing) {
+        // Add random jitter to u, v so that we get antialiasing from averaging color values between multiple frames
+        u = (float(x) + float(random_double(sampler))) / float(nx);
+        v = (float(y) + float(random_double(sampler))) / float(ny);
+    }
+    else {
+        u = (float(x) + 0.5f) / float(nx);
+        v = (float(y) + 0.5f) / float(ny);
+    }
+
+    Ray r(cam.origin, cam.lower_left_corner + u * cam.horizontal + v * cam.vertical);
+    r.A = glm::vec3(cam.world_from_view * glm::vec4(r.A, 1.0f));
+    r.B = glm::vec3(cam.world_from_view * glm::vec4(r.B, 0.0f));
+    return r;
+}
+
+// Returns the random number generator for the next sample of pixel (x, y)
+Sampler pixelSampler(const RTContext &rtx, int x, int y)
+{
+    return Sampler::for_pixel(std::uint32_t(x), std::uint32_t(y), std::uint32_t(rtx.current_frame), rtx.seed);
+}
+
+// AOVs of a primary ray and its closest hit
+SampleAovs firstHitAovs(const Ray &r, const HitRecord &rec)
+{
+    return SampleAovs::surface(r, rec, g_scene.materials[rec.mat_id].base_color());
+}
+
+// Adds a new sample for pixel (x, y), with its AOVs, to the image
+void accumulate(RTContext &rtx, int x, int y, const glm::vec3 &c, const SampleAovs &sample)
+{
+    // Note: in the RTOW book, they have an inner loop for the number of
+    // samples per pixel. Here, you do not need this loop, because we want
+    // some interactivity and accumulate samples over multiple frames
+    // instead (until the camera moves or the rendering is reset).
+
+    int nx = rtx.width;
+    if (rtx.current_frame <= 0) {
+        // Here we make the first frame blend with the old image,
+        // to smoothen the transition when resetting the accumulation
+        glm::vec4 old = rtx.image[y * nx + x];
+        rtx.image[y * nx + x] = glm::clamp(old / glm::max(1.0f, old.a), 0.0f, 1.0f);
+    }
+    rtx.image[y * nx + x] += glm::vec4(c, 1.0f);
+
+    // Statistics of the new samples for adaptive sampling, updated with
+    // Welford's method, since the sum of squares cancels badly in floats
+    float luminance = glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    glm::vec3 &stats = rtx.sample_stats[y * nx + x];
+    stats.x += 1.0f;
+    float delta = luminance - stats.y;
+    stats.y += delta / stats.x;
+    stats.z += delta * (luminance - stats.y);
+
+    AovBuffers &aovs = rtx.aovs;
+    int i = y * nx + x;
+    if (aovs.num_samples[i] == 0.0f) {
+        aovs.material_id[i] = sample.material_id;
+        aovs.object_id[i] = sample.object_id;
+        aovs.primitive_id[i] = sample.primitive_id;
+    }
+    aovs.num_samples[i] += 1.0f;
+    aovs.depth[i] += sample.distance;
+    aovs.normal[i] += sample.normal;
+    aovs.albedo[i] += sample.albedo;
+    aovs.bounces[i] += float(sample.bounces);
+}
+
+// Estimated noise of a pixel: the standard error of its mean luminance,
+// relative to the mean. The offset in the denominator keeps dark pixels
+// from being sampled forever.
+float pixelError(const glm::vec3 &stats)
+{
+    float n = stats.x;
+    if (n < 2.0f) return std::numeric_limits<float>::infinity();
+    float variance = stats.z / (n - 1.0f);
+    return glm::sqrt(variance / n) / (stats.y + 0.1f);
+}
+
+// Returns the indices of the tiles that still need samples, and updates
+// rtx.converged_fraction. A tile is converged when all its pixels have at
+// least adaptive_min_samples samples and an error below adaptive_threshold.
+std::vector<int> activeTiles(RTContext &rtx, int tile_size, int tiles_x, int tiles_y)
+{
+    std::vector<int> tiles;
+    if (!rtx.adaptive_sampling || rtx.current_frame <= 0) {
+        rtx.converged_fraction = 0.0f;
+        for (int i = 0; i < tiles_x * tiles_y; ++i) tiles.push_back(i);
+        return tiles;
+    }
+
+    std::size_t num_converged = 0;
+    for (int tile = 0; tile < tiles_x * tiles_y; ++tile) {
+        int x0 = (tile % tiles_x) * tile_size;
+        int y0 = (tile / tiles_x) * tile_size;
+        int x1 = glm::min(x0 + tile_size, rtx.width);
+        int y1 = glm::min(y0 + tile_size, rtx.height);
+        bool converged = true;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                const glm::vec3 &stats = rtx.sample_stats[y * rtx.width + x];
+                if (stats.x >= rtx.adaptive_min_samples && pixelError(stats) < rtx.adaptive_threshold) {
+                    num_converged += 1;
+                }
+                else {
+                    converged = false;
+                }
+            }
+        }
+        if (!converged) tiles.push_back(tile);
+    }
+    rtx.converged_fraction = float(num_converged) / float(rtx.width * rtx.height);
+    if (tiles.empty()) rtx.converged_fraction = 1.0f;
+    return tiles;
+}
+
+// Traces one new sample for pixel (x, y) and accumulates it into the image.
+// Returns the number of rays that were traced for the sample.
+int updatePixel(RTContext &rtx, const Camera &cam, int x, int y)
+{
+    Sampler sampler = pixelSampler(rtx, x, y);
+    Ray r = cameraRay(rtx, cam, x, y, sampler);
+    int num_rays = 1;
+    int bounces = 0;
+    countRays(0);
+    HitRecord rec;
+    if (hit_world(rtx, r, 0.001f, 9999.0f, rec)) {
+        SampleAovs aovs = firstHitAovs(r, rec);
+        glm::vec3 c = shade(rtx, r, rec, rtx.max_bounces, num_rays, bounces, sampler);
+        aovs.bounces = bounces;
+        accumulate(rtx, x, y, c, aovs);
+    }
+    else {
+        glm::vec3 c = background(rtx, r);
+        accumulate(rtx, x, y, c, SampleAovs::miss(r, c));
+    }
+    return num_rays;
+}
+
+// False color of a traversal cost on the scale of rtx, from blue (no cost)
+// over green to red (heatmap_max). Higher costs fade to white.
+glm::vec3 heatmapColor(const RTContext &rtx, float cost)
+{
+    float max_cost = glm::max(rtx.heatmap_max, 1.0f);
+    float t = rtx.heatmap_log ? glm::log(1.0f + cost) / glm::log(1.0f + max_cost) : cost / max_cost;
+    if (t > 1.0f) return glm::mix(glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(1.0f), glm::min(t - 1.0f, 1.0f));
+    return glm::clamp(1.5f - glm::abs(4.0f * t - glm::vec3(3.0f, 2.0f, 1.0f)), 0.0f, 1.0f);
+}
+
+// Cost of the traversals that were counted since `before`
+float traversalCost(const RTContext &rtx, const PerfCounters &before, const PerfCounters &after)
+{
+    float nodes = float(after.node_visits - before.node_visits);
+    float tests = float(after.primitive_tests - before.primitive_tests);
+    if (rtx.heatmap_metric == HEATMAP_NODES) return nodes;
+    if (rtx.heatmap_metric == HEATMAP_TESTS) return tests;
+    return nodes + tests;
+}
+
+// Heatmap version of updatePixel(), which accumulates the false color of the
+// traversal cost of the primary ray or of the whole path. The thread must
+// have counters (see updateFrame()).
+int updatePixelHeatmap(RTContext &rtx, const Camera &cam, int x, int y)
+{
+    const PerfCounters &counters = *threadCounters();
+    const PerfCounters before = counters;
+    Sampler sampler = pixelSampler(rtx, x, y);
+    Ray r = cameraRay(rtx, cam, x, y, sampler);
+    int num_rays = 1;
+    int bounces = 0;
+    countRays(0);
+    HitRecord rec;
+    if (hit_world(rtx, r, 0.001f, 9999.0f, rec)) {
+        SampleAovs aovs = firstHitAovs(r, rec);
+        if (rtx.heatmap == HEATMAP_PATH) { shade(rtx, r, rec, rtx.max_bounces, num_rays, bounces, sampler); }
+        aovs.bounces = bounces;
+        accumulate(rtx, x, y, heatmapColor(rtx, traversalCost(rtx, before, counters)), aovs);
+    }
+    else {
+        glm::vec3 c = heatmapColor(rtx, traversalCost(rtx, before, counters));
+        accumulate(rtx, x, y, c, SampleAovs::miss(r, c));
+    }
+    return num_rays;
+}
+
+// Number of pixels per primary ray packet, or 1 if packets are disabled.
+// Packets are not used for heatmaps, since their traversal cost is shared.
+int packetSize(const RTContext &rtx)
+{
+    if (rtx.heatmap != HEATMAP_OFF) return 1;
+    return glm::clamp(rtx.packet_size, 1, int(RayPacket::max_size));
+}
+
+// Traces one new sample for the pixels [x0, x0 + size) of line y. The primary
+// rays are traced together as a packet, while the bounced rays, which are no
+// longer coherent, are traced one by one.
+int updatePacket(RTContext &rtx, const Camera &cam, int x0, int y, int size)
+{
+    RayPacket packet;
+    Sampler samplers[RayPacket::max_size];
+    for (int i = 0; i < size; ++i) {
+        samplers[i] = pixelSampler(rtx, x0 + i, y);
+        packet.set(i, cameraRay(rtx, cam, x0 + i, y, samplers[i]));
+    }
+    packet.finalize(size);
+    countRays(0, size);
+
+    float t_max[RayPacket::max_size];
+    for (int i = 0; i < RayPacket::max_size; ++i) t_max[i] = 9999.0f;
+    HitRecord rec[RayPacket::max_size];
+    int hit_mask = g_scene.world.hit_packet(rtx, packet, 0.001f, t_max, rec, packet.all_mask());
+
+    int num_rays = 0;
+    for (int i = 0; i < size; ++i) {
+        Ray r = packet.ray(i);
+        if (hit_mask & (1 << i)) {
+            SampleAovs aovs = firstHitAovs(r, rec[i]);
+            int sample_rays = 1;
+            int bounces = 0;
+            glm::vec3 c = shade(rtx, r, rec[i], rtx.max_bounces, sample_rays, bounces, samplers[i]);
+            aovs.bounces = bounces;
+            num_rays += sample_rays;
+            accumulate(rtx, x0 + i, y, c, aovs);
         }
         else {
-            u = (float(x) + 0.5f) / float(nx);
-            v = (float(y) + 0.5f) / float(ny);
+            glm::vec3 c = background(rtx, r);
+            num_rays += 1;
+            accumulate(rtx, x0 + i, y, c, SampleAovs::miss(r, c));
         }
+    }
+    return num_rays;
+}
 
-        Ray r(origin, lower_left_corner + u * horizontal + v * vertical);
-        r.A = glm::vec3(world_from_view * glm::vec4(r.A, 1.0f));
-        r.B = glm::vec3(world_from_view * glm::vec4(r.B, 0.0f));
+// Traces one new sample for the pixels [x0, x1) x [y0, y1) of a tile, in
+// packets if enabled. Returns the number of rays that were traced.
+std::uint64_t updateTile(RTContext &rtx, const Camera &cam, int x0, int y0, int x1, int y1)
+{
+    int step = packetSize(rtx);
+    std::uint64_t num_rays = 0;
+    for (int y = y0; y < y1; ++y) {
+        if (step > 1) {
+            for (int x = x0; x < x1; x += step) {
+                num_rays += updatePacket(rtx, cam, x, y, glm::min(step, x1 - x));
+            }
+        }
+        else if (rtx.heatmap != HEATMAP_OFF) {
+            for (int x = x0; x < x1; ++x) {
+                num_rays += updatePixelHeatmap(rtx, cam, x, y);
+            }
+        }
+        else {
+            for (int x = x0; x < x1; ++x) {
+                num_rays += updatePixel(rtx, cam, x, y);
+            }
+        }
+    }
+    return num_rays;
+}
 
-        // Note: in the RTOW book, they have an inner loop for the number of
-        // samples per pixel. Here, you do not need this loop, because we want
-        // some interactivity and accumulate samples over multiple frames
-        // instead (until the camera moves or the rendering is reset).
+// Wavefront version of updateTile(), where all paths of the tile are traced
+// together bounce by bounce
+std::uint64_t updateTileWavefront(RTContext &rtx, const Camera &cam, int x0, int y0, int x1, int y1,
+                                  WavefrontIntegrator &integrator, std::vector<glm::vec3> &radiance,
+                                  std::vector<SampleAovs> &aovs)
+{
+    int tile_width = x1 - x0;
+    radiance.assign((x1 - x0) * (y1 - y0), glm::vec3(0.0f));
+    aovs.resize(radiance.size());
+    integrator.paths.clear();
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            Sampler sampler = pixelSampler(rtx, x, y);
+            Ray r = cameraRay(rtx, cam, x, y, sampler);
+            integrator.paths.push(r, glm::vec3(1.0f), (y - y0) * tile_width + (x - x0), sampler);
+        }
+    }
+
+    auto sky = [&](const Ray &r) { return background(rtx, r); };
+    std::uint64_t num_rays = integrator.trace(rtx, g_scene.world, g_scene.materials, g_scene.lights, rtx.max_bounces,
+                                             packetSize(rtx) > 1, sky, &radiance[0], &aovs[0]);
 
-        if (rtx.current_frame <= 0) {
-            // Here we make the first frame blend with the old image,
-            // to smoothen the transition when resetting the accumulation
-            glm::vec4 old = rtx.image[y * nx + x];
-            rtx.image[y * nx + x] = glm::clamp(old / glm::max(1.0f, old.a), 0.0f, 1.0f);
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            int i = (y - y0) * tile_width + (x - x0);
+            accumulate(rtx, x, y, radiance[i], aovs[i]);
         }
-        glm::vec3 c = color(rtx, r, rtx.max_bounces);
-        rtx.image[y * nx + x] += glm::vec4(c, 1.0f);
     }
+    return num_rays;
+}
+
+// Counters of one render thread, padded so that threads do not share cache
+// lines
+struct ThreadCounters {
+    PerfCounters counters;
+    char padding[64];
+};
+
+// Render thread pool, with the state of each worker that is kept between
+// passes
+struct RenderScheduler : public TileScheduler {
+    explicit RenderScheduler(int num_threads)
+        : TileScheduler(num_threads), thread_counters(size()), integrators(size()), radiance(size()), aovs(size())
+    {}
+
+    std::vector<ThreadCounters> thread_counters;  // Work of each worker, merged after the pass
+    std::vector<WavefrontIntegrator> integrators; // Queues of the wavefront integrator
+    std::vector<std::vector<glm::vec3>> radiance; // Radiance of the paths of the wavefront tile
+    std::vector<std::vector<SampleAovs>> aovs;    // AOVs of the paths of the wavefront tile
+    Denoiser denoiser;
+};
+
+// Returns the render thread pool, which is (re)created when the number of
+// threads in rtx changes
+RenderScheduler &renderScheduler(const RTContext &rtx)
+{
+    static std::unique_ptr<RenderScheduler> scheduler;
+    int num_threads = rtx.num_threads;
+    if (num_threads <= 0) { num_threads = glm::max(1, int(std::thread::hardware_concurrency())); }
+    if (!scheduler || scheduler->size() != num_threads) {
+        scheduler.reset();
+        scheduler.reset(new RenderScheduler(num_threads));
+    }
+    return *scheduler;
+}
+
+// Appends the counters of a pass to the CSV log of rtx.counters_csv, in one
+// row per rtx.counters_csv_interval seconds
+void logCounters(const RTContext &rtx, const PerfCounters &pass)
+{
+    typedef std::chrono::steady_clock Clock;
+    static std::string filename;
+    static PerfCounters unlogged;
+    static Clock::time_point start, last_row;
+    if (rtx.counters_csv.empty()) {
+        filename.clear();
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    if (filename != rtx.counters_csv) {
+        filename = rtx.counters_csv;
+        unlogged.reset();
+        start = last_row = now;
+    }
+    unlogged.add(pass);
+    if (std::chrono::duration<double>(now - last_row).count() < rtx.counters_csv_interval) return;
+    if (!appendCountersCsv(filename, unlogged, std::chrono::duration<double>(now - start).count())) {
+        std::cerr << "Error: cannot write " << filename << std::endl;
+    }
+    unlogged.reset();
+    last_row = now;
 }
 
+// Adds one sample to every pixel. The frame counter advances once per pass.
 void updateImage(RTContext &rtx)
+{
+    updateFrame(rtx);
+}
+
+void updateFrame(RTContext &rtx)
 {
     if (rtx.freeze) return;                    // Skip update
+    if (rtx.instance_time != g_scene.instance_time) { animateInstances(rtx, rtx.instance_time); }
     rtx.image.resize(rtx.width * rtx.height);  // Just in case...
+    rtx.sample_stats.resize(rtx.width * rtx.height);
+    rtx.aovs.resize(rtx.width * rtx.height);
+    rtx.dirty_rows.resize(rtx.height, 1);
+    if (rtx.current_frame <= 0) {
+        std::fill(rtx.sample_stats.begin(), rtx.sample_stats.end(), glm::vec3(0.0f));
+        rtx.aovs.reset();
+    }
+
+    // The frame is split into tiles that are distributed to a persistent
+    // pool of threads, so one pass needs only one fork and join and the
+    // threads can balance expensive (e.g., glass) regions between them
+    Camera cam = setupCamera(rtx);
+    // Heatmaps and prefiltered previews are traced path by path
+    const bool wavefront = rtx.wavefront && rtx.heatmap == HEATMAP_OFF && !usePrefilteredEnvironment(rtx);
+    int tile_size = glm::max(wavefront ? rtx.wavefront_tile_size : rtx.tile_size, 1);
+    int tiles_x = (rtx.width + tile_size - 1) / tile_size;
+    int tiles_y = (rtx.height + tile_size - 1) / tile_size;
+    std::vector<int> tiles = activeTiles(rtx, tile_size, tiles_x, tiles_y);
+    if (tiles.empty()) return;  // Converged
 
-    updateLine(rtx, rtx.current_line % rtx.height);
+    // Ray counts per worker, each on its own cache line
+    RenderScheduler &scheduler = renderScheduler(rtx);
+    const int stride = 64 / sizeof(std::uint64_t);
+    std::vector<std::uint64_t> num_rays(scheduler.size() * stride, 0);
 
-    if (rtx.current_frame < rtx.max_frames) {
-        rtx.current_line += 1;
-        if (rtx.current_line >= rtx.height) {
-            rtx.current_frame += 1;
-            rtx.current_line = rtx.current_line % rtx.height;
+    std::vector<ThreadCounters> &thread_counters = scheduler.thread_counters;
+    auto pass_start = std::chrono::steady_clock::now();
+
+    scheduler.run(int(tiles.size()), [&](int index, int worker) {
+        if (rtx.cancel && rtx.cancel->load(std::memory_order_relaxed)) return;
+        int tile = tiles[index];
+        int x0 = (tile % tiles_x) * tile_size;
+        int y0 = (tile / tiles_x) * tile_size;
+        int x1 = glm::min(x0 + tile_size, rtx.width);
+        int y1 = glm::min(y0 + tile_size, rtx.height);
+        // Heatmaps need the counters, also if they are not collected
+        bool count = rtx.collect_counters || rtx.heatmap != HEATMAP_OFF;
+        PerfCounters *counters = count ? &thread_counters[worker].counters : nullptr;
+        threadCounters() = counters;
+        auto tile_start = std::chrono::steady_clock::now();
+        if (wavefront) {
+            num_rays[worker * stride] += updateTileWavefront(rtx, cam, x0, y0, x1, y1, scheduler.integrators[worker],
+                                                             scheduler.radiance[worker], scheduler.aovs[worker]);
+        }
+        else {
+            num_rays[worker * stride] += updateTile(rtx, cam, x0, y0, x1, y1);
+        }
+        if (counters) {
+            counters->sample_seconds +=
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - tile_start).count();
         }
+        threadCounters() = nullptr;
+    });
+    for (int i = 0; i < scheduler.size(); ++i) {
+        rtx.num_rays += num_rays[i * stride];
+    }
+    if (rtx.collect_counters) {
+        rtx.pass_counters.reset();
+        for (int i = 0; i < scheduler.size(); ++i) {
+            rtx.pass_counters.add(thread_counters[i].counters);
+        }
+        rtx.pass_counters.passes = 1;
+        rtx.pass_counters.pass_seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - pass_start).count();
+        rtx.counters.add(rtx.pass_counters);
+        logCounters(rtx, rtx.pass_counters);
+    }
+    for (int i = 0; i < scheduler.size(); ++i) {
+        thread_counters[i].counters.reset();
     }
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        int y0 = (tiles[i] / tiles_x) * tile_size;
+        int y1 = glm::min(y0 + tile_size, rtx.height);
+        std::fill(rtx.dirty_rows.begin() + y0, rtx.dirty_rows.begin() + y1, std::uint8_t(1));
+    }
+    if (rtx.cancel && rtx.cancel->load()) return;  // The pass is incomplete
+
+    if (rtx.current_frame < rtx.max_frames) { rtx.current_frame += 1; }
+    rtx.current_line = 0;
+}
+
+// Filters the accumulated image into rtx.denoised_image
+void denoiseImage(RTContext &rtx)
+{
+    RenderScheduler &scheduler = renderScheduler(rtx);
+    scheduler.denoiser.denoise(rtx, scheduler, rtx.denoised_image);
 }
 
 void resetImage(RTContext &rtx)
 {
     rtx.image.clear();
     rtx.image.resize(rtx.width * rtx.height);
+    rtx.sample_stats.clear();
+    rtx.sample_stats.resize(rtx.width * rtx.height);
+    rtx.aovs.resize(rtx.width * rtx.height);
+    rtx.aovs.reset();
+    rtx.dirty_rows.assign(rtx.height, 1);
+    rtx.converged_fraction = 0.0f;
     rtx.current_frame = 0;
     rtx.current_line = 0;
+    rtx.num_rays = 0;
+    rtx.counters.reset();
+    rtx.pass_counters.reset();
     rtx.freeze = false;
 }
 
 void resetAccumulation(RTContext &rtx)
 {
     rtx.current_frame = -1;
+    rtx.converged_fraction = 0.0f;
 }
 
 }  // namespace rt
@@ -4,14 +4,100 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "rt_counters.h"
+
+#include <atomic>
 #include <vector>
+#include <cstdint>
+#include <string>
 
 namespace rt {
 
+// Scenes that setupScene() can build
+enum SceneId {
+    SCENE_SEMI_RANDOM = 0,  // Spheres around the mesh
+    SCENE_CUSTOM,
+    SCENE_RANDOM,           // Spheres only, as on the cover of "Ray Tracing in One Weekend"
+    SCENE_BUNNY_FIELD,      // 10,000 instances of the mesh
+    SCENE_LIGHTS,           // Closed room lit only by small area lights
+    NUM_SCENES
+};
+
+// Debug views that color each pixel by the traversal cost of its rays
+enum HeatmapMode {
+    HEATMAP_OFF = 0,
+    HEATMAP_PRIMARY,  // Cost of the primary ray
+    HEATMAP_PATH,     // Cost of all rays of the path
+    NUM_HEATMAP_MODES
+};
+
+// Measure of traversal cost shown by the heatmap
+enum HeatmapMetric {
+    HEATMAP_NODES = 0,           // BVH nodes visited
+    HEATMAP_TESTS,               // Primitive intersection tests
+    HEATMAP_NODES_AND_TESTS,
+    NUM_HEATMAP_METRICS
+};
+
+// Arbitrary output variables (AOVs) that are rendered in the same pass as
+// the image
+enum Aov {
+    AOV_DEPTH = 0,
+    AOV_NORMAL,
+    AOV_ALBEDO,
+    AOV_MATERIAL_ID,
+    AOV_OBJECT_ID,
+    AOV_PRIMITIVE_ID,
+    AOV_BOUNCES,
+    NUM_AOVS
+};
+
+// Per-pixel AOV buffers, one plane per variable next to RTContext::image.
+// Depth, normal, albedo and bounces are summed over the samples of the pixel
+// like the image, and the IDs are those of the first sample (~0u for the
+// background).
+struct AovBuffers {
+    std::vector<float> num_samples;
+    std::vector<float> depth;       // Distance to the first hit (1e4 for the background)
+    std::vector<glm::vec3> normal;  // First-hit normal, facing the camera
+    std::vector<glm::vec3> albedo;  // First-hit albedo, or the background color
+    std::vector<float> bounces;     // Number of bounces of the path
+    std::vector<std::uint32_t> material_id;
+    std::vector<std::uint32_t> object_id;
+    std::vector<std::uint32_t> primitive_id;
+
+    void resize(size_t n) {
+        num_samples.resize(n);
+        depth.resize(n);
+        normal.resize(n);
+        albedo.resize(n);
+        bounces.resize(n);
+        material_id.resize(n, ~0u);
+        object_id.resize(n, ~0u);
+        primitive_id.resize(n, ~0u);
+    }
+
+    // Removes all samples
+    void reset() {
+        size_t n = num_samples.size();
+        num_samples.assign(n, 0.0f);
+        depth.assign(n, 0.0f);
+        normal.assign(n, glm::vec3(0.0f));
+        albedo.assign(n, glm::vec3(0.0f));
+        bounces.assign(n, 0.0f);
+        material_id.assign(n, ~0u);
+        object_id.assign(n, ~0u);
+        primitive_id.assign(n, ~0u);
+    }
+};
+
 struct RTContext {
     int width = 500;
     int height = 500;
     std::vector<glm::vec4> image;
+    std::vector<glm::vec3> sample_stats;  // Per pixel: number of samples, mean of their luminance and sum of squared deviations from it
+    AovBuffers aovs;
+    std::vector<glm::vec4> denoised_image;    // Denoised copy of image for display, with alpha 1
     bool freeze = false;
     int current_frame = 0;
     int current_line = 0;
@@ -21,18 +107,71 @@ struct RTContext {
     glm::mat4 view = glm::mat4(1.0f);
     glm::vec3 ground_color = glm::vec3(0.5f, 0.5f, 0.5f);
     glm::vec3 sky_color = glm::vec3(0.5f, 0.7f, 1.0f);
+    std::string environment_map;       // Cubemap directory (e.g., cubemaps/Forrest) lighting the scene instead of the sky and ground colors, empty - None
+    float environment_intensity = 1.0f;  // Scale of the radiance of the environment map
+    bool light_sampling = true;        // Sample area lights and the environment map with shadow rays at diffuse hits
+    float instance_time = 0.0f;        // Time in seconds that the instances are posed at before each pass (see animateInstances())
+    bool prefiltered_environment = false;  // Fast preview: diffuse and fuzzy metal bounces that miss see prefiltered levels of the environment map (see loadEnvironment())
     bool show_normals = false;
+    int heatmap = HEATMAP_OFF;       // Show the traversal cost instead of shading (primary rays are not traced as packets)
+    int heatmap_metric = HEATMAP_NODES_AND_TESTS;
+    float heatmap_max = 64.0f;       // Cost at the top (red) of the color scale, higher costs are white
+    bool heatmap_log = false;        // Logarithmic color scale
     bool perform_antialiasing = true;
     bool perform_gamma_correction = true;
     int diffuse_method = 2; // 0 - Random in unit sphere, 1 - Normalized random in unit sphere, 2 - Random in unit hemisphere
     float vfov = 90.0f;     // Vertical field-of-view in degrees
     float vfov_step = 1.0f;
+    int bvh_builder = 1;             // 0 - Median split, 1 - Binned SAH, 2 - Parallel LBVH
+    int bvh_max_leaf_size = 4;       // Maximum number of primitives in a BVH leaf
+    float bvh_traversal_cost = 1.0f; // Cost of a BVH node visit relative to a primitive test
+    int bvh_width = 4;               // Children per BVH node: 2, 4 (SSE) or 8 (AVX if the CPU has it), see bvhSimdName()
+    int packet_size = 16;            // Primary rays traced together: 1 (no packets), 4, 8 or 16
+    int num_threads = 0;             // Render threads, 0 - one per hardware thread
+    int tile_size = 16;              // Width and height in pixels of the tiles given to the render threads
+    bool wavefront = false;          // Trace all paths of a tile bounce by bounce instead of one by one
+    int wavefront_tile_size = 64;    // Tile size in wavefront mode, where larger tiles give longer queues
+    bool adaptive_sampling = false;  // Stop sampling tiles whose pixels have converged
+    float adaptive_threshold = 0.02f;  // Relative standard error below which a pixel is converged
+    int adaptive_min_samples = 16;   // Samples per pixel before convergence is tested
+    float converged_fraction = 0.0f; // Fraction of converged pixels (adaptive sampling only)
+    bool denoise = false;            // Show the denoised image instead of the accumulated one
+    int denoise_iterations = 5;      // Passes of the a-trous filter, with a step of 1, 2, 4, ... pixels
+    float denoise_sigma_luminance = 4.0f;  // Luminance tolerance, in standard errors of the pixel
+    float denoise_sigma_normal = 128.0f;   // Exponent of the normal similarity
+    float denoise_sigma_depth = 1.0f;      // Depth tolerance, relative to the depth gradient
+    float denoise_sigma_albedo = 0.1f;     // Albedo tolerance
+    int display_aov = -1;            // AOV shown by the viewer instead of the image, -1 - None
+    int display_format = 0;          // Pixels handed to the viewer: 0 - RGBA32F, 1 - RGBA16F (resolved), 2 - RGBA8 (resolved and gamma corrected)
+    std::vector<std::uint8_t> dirty_rows;  // Rows of the image that got new samples since they were cleared
+    int scene = SCENE_SEMI_RANDOM;   // Scene built by setupScene()
+    std::string scene_cache_dir;     // Directory of cached meshes and BVHs, empty - No cache
+    std::uint32_t seed = 0;          // Seed of the per-pixel random number sequences
+    std::uint64_t num_rays = 0;  // Number of rays traced since the last reset
+    bool collect_counters = true;    // Count the work of each pass in pass_counters and counters
+    PerfCounters counters;           // Totals since the last reset
+    PerfCounters pass_counters;      // Of the last pass
+    std::string counters_csv;        // File that the counters are appended to, empty - No log
+    float counters_csv_interval = 1.0f;  // Seconds between the rows of the log, 0 - One row per pass
+    const std::atomic<bool> *cancel = nullptr;  // If set and true, updateFrame() abandons the pass
     // Add more settings and parameters here
     // ...
 };
 
 void setupScene(RTContext &rtx, const char *mesh_filename);
+const char *sceneName(int scene);
+const char *heatmapModeName(int mode);
+const char *heatmapMetricName(int metric);
+void rebuildBvh(RTContext &rtx);
+const char *bvhSimdName(int width);  // Instruction set of the BVH traversal on this CPU: SSE, AVX or scalar
+void loadEnvironment(RTContext &rtx);
+void animateInstances(RTContext &rtx, float time);
 void updateImage(RTContext &rtx);
+void updateFrame(RTContext &rtx);
+void denoiseImage(RTContext &rtx);
+const char *aovName(Aov aov);
+void aovImage(const RTContext &rtx, Aov aov, std::vector<glm::vec4> &output);
+bool saveAovs(const RTContext &rtx, const std::string &prefix);
 void resetImage(RTContext &rtx);
 void resetAccumulation(RTContext &rtx);
 
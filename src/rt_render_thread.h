@@ -0,0 +1,365 @@
+#pragma once
+
+#include "rt_raytracing.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <glm/gtc/packing.hpp>
+
+namespace rt {
+
+// Lock-free handoff of values from one writer thread to one reader thread.
+// The writer fills its back buffer and swaps it with the middle buffer, and
+// the reader swaps its front buffer with the middle buffer when that holds a
+// newer value, so neither side ever waits for the other.
+template <typename T>
+class TripleBuffer {
+  public:
+    TripleBuffer() : middle(1), back(2), front(0) {}
+
+    // Buffer that the writer fills before calling publish()
+    T &write_buffer() { return buffers[back]; }
+
+    void publish() { back = middle.exchange(back | FRESH) & INDEX_MASK; }
+
+    // Makes the latest published value the read buffer. Returns false if
+    // nothing was published since the last call.
+    bool update() {
+        if (!(middle.load() & FRESH)) return false;
+        front = middle.exchange(front) & INDEX_MASK;
+        return true;
+    }
+
+    const T &read_buffer() const { return buffers[front]; }
+
+  private:
+    enum { INDEX_MASK = 3, FRESH = 4 };
+
+    T buffers[3];
+    std::atomic<int> middle;  // Index of the middle buffer, and whether it is newer than the front buffer
+    int back;                 // Owned by the writer
+    int front;                // Owned by the reader
+};
+
+// Pixel formats of RenderedFrame, see RTContext::display_format
+enum FrameFormat { FRAME_RGBA32F, FRAME_RGBA16F, FRAME_RGBA8 };
+
+inline size_t framePixelSize(int format)
+{
+    return format == FRAME_RGBA32F ? 16 : format == FRAME_RGBA16F ? 8 : 4;
+}
+
+// A finished pass, as shown by the viewer
+struct RenderedFrame {
+    std::vector<unsigned char> pixels;  // Accumulated, denoised or AOV image, in format
+    int format = FRAME_RGBA32F;
+    bool gamma_corrected = false;       // Whether gamma correction was applied to the pixels
+    std::vector<std::uint8_t> dirty_rows;  // Rows that changed since the last frame returned by RenderThread::poll()
+    std::uint64_t sequence = 0;
+    int width = 0;
+    int height = 0;
+    int current_frame = 0;
+    float converged_fraction = 0.0f;
+    std::uint64_t num_rays = 0;
+    PerfCounters counters;       // Since the last reset
+    PerfCounters pass_counters;  // Of the latest pass
+};
+
+// Renders passes on a thread of its own (which is also worker 0 of the tile
+// scheduler), so that rendering continues while the GUI thread waits for
+// vsync or input, and the GUI stays responsive during long passes. Finished
+// passes are handed to the GUI through a TripleBuffer.
+//
+// Frames know which rows changed since the frame that the GUI polled last,
+// even if the GUI skipped frames in between, so that only those need to be
+// uploaded to the texture.
+//
+// The render thread owns its RTContext. The GUI sends its copy of the
+// settings with update(), and they are applied between passes. A reset (e.g.,
+// camera motion) cancels the pass in flight, unless that pass is the first
+// one after a reset, so that the viewer always gets an image of the latest
+// camera.
+class RenderThread {
+  public:
+    // Starts rendering. The scene must have been set up.
+    explicit RenderThread(const RTContext &settings) : rtx(settings), cancel(false), consumed(0) {
+        rtx.cancel = &cancel;
+        resetImage(rtx);
+        thread = std::thread(&RenderThread::thread_main, this);
+    }
+
+    ~RenderThread() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+            cancel.store(true);
+        }
+        cv.notify_all();
+        thread.join();
+    }
+
+    // Sends new settings to the render thread. If reset is set, the
+    // accumulation restarts.
+    void update(const RTContext &settings, bool reset) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = settings;
+            has_pending = true;
+            pending_reset |= reset;
+            if (reset) cancel.store(true);
+        }
+        cv.notify_all();
+    }
+
+    // Calls fn(rtx) on the calling thread while the render thread is paused
+    // between passes, e.g., to change the scene or read the AOVs. If
+    // cancel_pass is set, the pass in flight is abandoned, and the caller
+    // should reset the accumulation.
+    void synchronize(const std::function<void(RTContext &)> &fn, bool cancel_pass) {
+        if (cancel_pass) cancel.store(true);
+        std::lock_guard<std::mutex> render_lock(render_mutex);
+        std::lock_guard<std::mutex> lock(mutex);
+        fn(rtx);
+        cancel.store(pending_reset);
+        cv.notify_all();
+    }
+
+    // Makes the latest finished pass available in frame(). Returns false if
+    // there is no new pass since the last call.
+    bool poll() {
+        if (!frames.update()) return false;
+        consumed.store(frames.read_buffer().sequence);
+        return true;
+    }
+
+    const RenderedFrame &frame() const { return frames.read_buffer(); }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    bool needs_pass() const {
+        if (rtx.freeze) return false;
+        if (rtx.current_frame <= 0) return true;
+        if (rtx.adaptive_sampling && rtx.converged_fraction >= 1.0f) return false;
+        return rtx.current_frame < rtx.max_frames;
+    }
+
+    // Takes over new settings, but keeps the buffers and progress
+    void apply(const RTContext &settings) {
+        bool resized = settings.width != rtx.width || settings.height != rtx.height;
+        RTContext next = settings;
+        next.image.swap(rtx.image);
+        next.dirty_rows.swap(rtx.dirty_rows);
+        next.sample_stats.swap(rtx.sample_stats);
+        std::swap(next.aovs, rtx.aovs);
+        next.denoised_image.swap(rtx.denoised_image);
+        next.current_frame = rtx.current_frame;
+        next.current_line = rtx.current_line;
+        next.converged_fraction = rtx.converged_fraction;
+        next.num_rays = rtx.num_rays;
+        next.counters = rtx.counters;
+        next.pass_counters = rtx.pass_counters;
+        next.cancel = &cancel;
+        rtx = std::move(next);
+        if (resized) resetImage(rtx);
+    }
+
+    // Settings that change the published image without a new pass
+    struct DisplaySettings {
+        bool denoise;
+        int denoise_iterations;
+        float denoise_sigma[4];
+        int display_aov;
+        int display_format;
+        bool perform_gamma_correction;
+        int max_bounces;
+
+        explicit DisplaySettings(const RTContext &rtx)
+            : denoise(rtx.denoise), denoise_iterations(rtx.denoise_iterations), display_aov(rtx.display_aov),
+              display_format(rtx.display_format), perform_gamma_correction(rtx.perform_gamma_correction),
+              max_bounces(rtx.max_bounces)
+        {
+            denoise_sigma[0] = rtx.denoise_sigma_luminance;
+            denoise_sigma[1] = rtx.denoise_sigma_normal;
+            denoise_sigma[2] = rtx.denoise_sigma_depth;
+            denoise_sigma[3] = rtx.denoise_sigma_albedo;
+        }
+
+        bool operator==(const DisplaySettings &other) const {
+            for (int i = 0; i < 4; ++i) {
+                if (denoise_sigma[i] != other.denoise_sigma[i]) return false;
+            }
+            return denoise == other.denoise && denoise_iterations == other.denoise_iterations &&
+                   display_aov == other.display_aov && display_format == other.display_format &&
+                   perform_gamma_correction == other.perform_gamma_correction && max_bounces == other.max_bounces;
+        }
+    };
+
+    // Converts the image to the display format. Unless it is RGBA32F, the
+    // color is divided by the number of samples, and alpha is 1.
+    void convert(const std::vector<glm::vec4> &image, RenderedFrame &frame) const {
+        frame.format = rtx.display_format >= FRAME_RGBA32F && rtx.display_format <= FRAME_RGBA8 ? rtx.display_format
+                                                                                                  : FRAME_RGBA32F;
+        frame.gamma_corrected = frame.format == FRAME_RGBA8 && rtx.perform_gamma_correction;
+        const size_t n = image.size();
+        frame.pixels.resize(n * framePixelSize(frame.format));
+        if (n == 0) return;
+        if (frame.format == FRAME_RGBA32F) {
+            std::memcpy(&frame.pixels[0], &image[0], n * sizeof(glm::vec4));
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const glm::vec4 &c = image[i];
+            glm::vec3 rgb = c.a > 0.0f ? glm::vec3(c) / c.a : glm::vec3(0.0f);
+            if (frame.format == FRAME_RGBA16F) {
+                glm::uint64 half = glm::packHalf4x16(glm::vec4(rgb, 1.0f));
+                std::memcpy(&frame.pixels[i * 8], &half, 8);
+            }
+            else {
+                if (frame.gamma_corrected) { rgb = glm::pow(glm::max(rgb, 0.0f), glm::vec3(1.0f / 2.2f)); }
+                rgb = glm::clamp(rgb, 0.0f, 1.0f) * 255.0f + 0.5f;
+                unsigned char *p = &frame.pixels[i * 4];
+                p[0] = (unsigned char)rgb.r;
+                p[1] = (unsigned char)rgb.g;
+                p[2] = (unsigned char)rgb.b;
+                p[3] = 255;
+            }
+        }
+    }
+
+    // Sets the dirty rows of the frame to those that changed since the
+    // frame consumed by the GUI, from the rows changed by each frame since
+    // then. If all_dirty is set, all rows changed in this frame.
+    void track_dirty_rows(RenderedFrame &frame, bool all_dirty) {
+        std::vector<std::uint8_t> rows(rtx.height, 1);
+        if (!all_dirty && rtx.dirty_rows.size() == rows.size()) rows.swap(rtx.dirty_rows);
+        rtx.dirty_rows.assign(rtx.height, 0);
+
+        std::uint64_t last = consumed.load();
+        while (!dirty_history.empty() && dirty_history.front().first <= last) dirty_history.pop_front();
+        if (dirty_history.size() > 4) {
+            // The GUI is far behind, so the oldest frames are merged
+            std::vector<std::uint8_t> &merged = dirty_history[1].second;
+            const std::vector<std::uint8_t> &oldest = dirty_history[0].second;
+            for (size_t y = 0; y < merged.size() && y < oldest.size(); ++y) merged[y] |= oldest[y];
+            dirty_history.pop_front();
+        }
+        dirty_history.push_back(std::make_pair(frame.sequence, rows));
+
+        frame.dirty_rows.assign(rtx.height, 0);
+        for (size_t i = 0; i < dirty_history.size(); ++i) {
+            const std::vector<std::uint8_t> &changed = dirty_history[i].second;
+            for (size_t y = 0; y < changed.size() && y < frame.dirty_rows.size(); ++y) {
+                frame.dirty_rows[y] |= changed[y];
+            }
+        }
+    }
+
+    // Publishes the image, where all rows are dirty if full is set, e.g.,
+    // after the display settings changed
+    void publish(bool full) {
+        RenderedFrame &frame = frames.write_buffer();
+        if (rtx.display_aov >= 0 && rtx.display_aov < NUM_AOVS) {
+            aovImage(rtx, Aov(rtx.display_aov), display_image);
+            convert(display_image, frame);
+            full = true;
+        }
+        else if (rtx.denoise) {
+            // The filter spreads changes over many rows
+            denoiseImage(rtx);
+            convert(rtx.denoised_image, frame);
+            full = true;
+        }
+        else {
+            convert(rtx.image, frame);
+        }
+        frame.sequence = ++sequence;
+        track_dirty_rows(frame, full);
+        frame.width = rtx.width;
+        frame.height = rtx.height;
+        frame.current_frame = rtx.current_frame;
+        frame.converged_fraction = rtx.converged_fraction;
+        frame.num_rays = rtx.num_rays;
+        frame.counters = rtx.counters;
+        frame.pass_counters = rtx.pass_counters;
+        frames.publish();
+        last_publish = Clock::now();
+    }
+
+    void thread_main() {
+        DisplaySettings published(rtx);
+        bool display_changed = true;
+        bool unpublished = false;  // A rendered pass was not published yet
+        while (true) {
+            bool reset = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this]() { return quit || has_pending || needs_pass(); });
+                if (quit) return;
+                if (has_pending) {
+                    apply(pending);
+                    reset = pending_reset;
+                    has_pending = pending_reset = false;
+                    cancel.store(false);
+                }
+            }
+
+            std::lock_guard<std::mutex> render_lock(render_mutex);
+            if (reset) resetAccumulation(rtx);
+            display_changed |= !(DisplaySettings(rtx) == published);
+
+            bool rendered = false;
+            if (needs_pass()) {
+                // Only passes that refine an image can be canceled
+                rtx.cancel = rtx.current_frame > 0 ? &cancel : nullptr;
+                int frame = rtx.current_frame;
+                updateFrame(rtx);
+                rendered = rtx.current_frame != frame;
+                rtx.cancel = &cancel;
+            }
+            unpublished |= rendered;
+
+            // Denoising is expensive, so denoised images are published at
+            // most ten times per second while rendering. Once no more passes
+            // are needed (converged or max_frames reached), the last one is
+            // always published, even if no pass was rendered since.
+            bool throttled = rtx.denoise && needs_pass() && Clock::now() - last_publish < std::chrono::milliseconds(100);
+            if (display_changed || (unpublished && !throttled)) {
+                publish(display_changed);
+                published = DisplaySettings(rtx);
+                display_changed = false;
+                unpublished = false;
+            }
+        }
+    }
+
+    RTContext rtx;  // Only used by the render thread, or with render_mutex and mutex locked
+
+    std::mutex mutex;  // Guards the pending settings
+    std::condition_variable cv;
+    RTContext pending;
+    bool has_pending = false;
+    bool pending_reset = false;
+    bool quit = false;
+
+    std::mutex render_mutex;  // Held by the render thread during a pass
+    std::atomic<bool> cancel;
+    TripleBuffer<RenderedFrame> frames;
+    std::vector<glm::vec4> display_image;  // AOV image
+    std::uint64_t sequence = 0;            // Of the last published frame
+    std::atomic<std::uint64_t> consumed;   // Sequence of the frame last returned by poll()
+    std::deque<std::pair<std::uint64_t, std::vector<std::uint8_t> > > dirty_history;  // Rows changed by each frame that the GUI did not poll yet
+    Clock::time_point last_publish;
+    std::thread thread;
+};
+
+}  // namespace rt
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+
+namespace rt {
+
+// Per-path random number generator (PCG32, see https://www.pcg-random.org).
+// Each sample gets its own generator, seeded from the pixel and frame it
+// belongs to, so that rendering does not share any random state between
+// threads and gives the same image for any number of threads.
+class Sampler {
+  public:
+    Sampler(std::uint64_t seed = 0, std::uint64_t stream = 0) {
+        state = 0;
+        inc = (stream << 1) | 1u;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    // Sampler for one sample of pixel (x, y) in the given frame
+    static Sampler for_pixel(std::uint32_t x, std::uint32_t y, std::uint32_t frame, std::uint32_t seed) {
+        std::uint64_t key = (std::uint64_t(y) << 32) | x;
+        return Sampler(mix(key ^ mix((std::uint64_t(seed) << 32) | frame)));
+    }
+
+    // Returns a random integer in [0, 2^32)
+    std::uint32_t next_uint() {
+        std::uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        std::uint32_t xorshifted = std::uint32_t(((old >> 18u) ^ old) >> 27u);
+        std::uint32_t rot = std::uint32_t(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((32u - rot) & 31u));
+    }
+
+    // Returns a random real in [0,1)
+    float next_float() { return float(next_uint() >> 8) * (1.0f / 16777216.0f); }
+
+  private:
+    // SplitMix64 finalizer, which turns a key into a well-distributed seed
+    static std::uint64_t mix(std::uint64_t z) {
+        z += 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    std::uint64_t state;
+    std::uint64_t inc;
+};
+
+}  // namespace rt
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "rt_triangle_mesh.h"
+#include "cg_utils2.h"  // Used for memory-mapped files and OBJ-mesh loading
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rt {
+
+// 64-bit hash of a range of bytes, with the rounds of xxHash64
+inline std::uint64_t hashBytes(const void *data, size_t size, std::uint64_t seed = 0)
+{
+    const std::uint64_t p1 = 0x9E3779B185EBCA87ull, p2 = 0xC2B2AE3D27D4EB4Full, p3 = 0x165667B19E3779F9ull;
+    struct Round {
+        static std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+        static std::uint64_t apply(std::uint64_t h, std::uint64_t w) {
+            return rotl(h + w * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B185EBCA87ull;
+        }
+    };
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    std::uint64_t lanes[4] = { seed + p1 + p2, seed + p2, seed, seed - p1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int k = 0; k < 4; ++k) {
+            std::uint64_t w;
+            std::memcpy(&w, p + i + 8 * k, 8);
+            lanes[k] = Round::apply(lanes[k], w);
+        }
+    }
+    std::uint64_t h = seed + p3 + std::uint64_t(size);
+    if (size >= 32) {
+        h = Round::rotl(lanes[0], 1) + Round::rotl(lanes[1], 7) + Round::rotl(lanes[2], 12) + Round::rotl(lanes[3], 18);
+        for (int k = 0; k < 4; ++k) h = (h ^ Round::apply(0, lanes[k])) * p1 + 0x85EBCA77C2B2AE63ull;
+        h += std::uint64_t(size);
+    }
+    for (; i < size; ++i) h = Round::rotl(h ^ (p[i] * 0x27D4EB2F165667C5ull), 11) * p1;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+template <typename T>
+inline std::uint64_t hashValue(const T &value, std::uint64_t seed)
+{
+    return hashBytes(&value, sizeof(T), seed);
+}
+
+// Versioned binary file of arrays of plain structs, which is memory-mapped
+// for reading. The header identifies the kind of content and the hash of the
+// inputs it was made from, and the element size of each array is checked, so
+// that stale files or files from an incompatible build are never used.
+// Arrays are copied out of the mapping by read(), so the cache saves the time
+// to parse and build, but not memory: each process has its own copy.
+class CacheFile {
+  public:
+    static const std::uint32_t version = 1;
+
+    // Adds an array to be written. The array must outlive write().
+    template <typename T>
+    void add(const std::vector<T> &array) {
+        Section section;
+        section.offset = 0;
+        section.count = array.size();
+        section.element_size = sizeof(T);
+        pending.push_back(std::make_pair(static_cast<const void *>(array.empty() ? nullptr : &array[0]), section));
+    }
+
+    // Writes the added arrays to a temporary file that is then renamed, so
+    // that other processes never see a partial file
+    bool write(const std::string &filename, std::uint32_t kind, std::uint64_t key) const {
+        Header header;
+        std::memcpy(header.magic, "RTCACHE", 8);
+        header.version = version;
+        header.kind = kind;
+        header.key = key;
+        header.num_sections = pending.size();
+
+        std::vector<Section> sections(pending.size());
+        std::uint64_t offset = align(sizeof(Header) + sections.size() * sizeof(Section));
+        for (size_t i = 0; i < pending.size(); ++i) {
+            sections[i] = pending[i].second;
+            sections[i].offset = offset;
+            offset = align(offset + sections[i].count * sections[i].element_size);
+        }
+
+        std::string tmp_filename = filename + ".tmp";
+#if defined(__unix__) || defined(__APPLE__)
+        tmp_filename += std::to_string(::getpid());
+#endif
+        {
+            std::ofstream file(tmp_filename.c_str(), std::ios::binary);
+            if (!file) return false;
+            const char padding[alignment] = {};
+            file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+            if (!sections.empty()) {
+                file.write(reinterpret_cast<const char *>(&sections[0]), sections.size() * sizeof(Section));
+            }
+            std::uint64_t position = sizeof(Header) + sections.size() * sizeof(Section);
+            for (size_t i = 0; i < sections.size(); ++i) {
+                file.write(padding, std::streamsize(sections[i].offset - position));
+                std::uint64_t size = sections[i].count * sections[i].element_size;
+                if (size > 0) file.write(static_cast<const char *>(pending[i].first), std::streamsize(size));
+                position = sections[i].offset + size;
+            }
+            if (!file) {
+                file.close();
+                std::remove(tmp_filename.c_str());
+                return false;
+            }
+        }
+        std::remove(filename.c_str());  // Needed on Windows, where rename does not replace
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+            std::remove(tmp_filename.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Maps a file for reading. Returns false if it does not exist or is not
+    // of the given kind, version and key.
+    bool open(const std::string &filename, std::uint32_t kind, std::uint64_t key) {
+        file.reset(new cg::MappedFile(filename));
+        sections = nullptr;
+        num_sections = 0;
+        if (!file->is_open() || file->size() < sizeof(Header)) return false;
+
+        Header header;
+        std::memcpy(&header, file->data(), sizeof(Header));
+        if (std::memcmp(header.magic, "RTCACHE", 8) != 0 || header.version != version || header.kind != kind ||
+            header.key != key) {
+            return false;
+        }
+        if (header.num_sections > (file->size() - sizeof(Header)) / sizeof(Section)) return false;
+        sections = reinterpret_cast<const Section *>(file->data() + sizeof(Header));
+        num_sections = size_t(header.num_sections);
+        for (size_t i = 0; i < num_sections; ++i) {
+            const Section &s = sections[i];
+            if (s.offset > file->size() || s.element_size == 0) return false;
+            if (s.count > (file->size() - s.offset) / s.element_size) return false;
+        }
+        return true;
+    }
+
+    // Copies array i of the opened file. Returns false if it does not exist
+    // or has a different element type.
+    template <typename T>
+    bool read(size_t i, std::vector<T> &array) const {
+        if (i >= num_sections || sections[i].element_size != sizeof(T)) return false;
+        array.resize(size_t(sections[i].count));
+        if (!array.empty()) {
+            std::memcpy(static_cast<void *>(&array[0]), file->data() + sections[i].offset, array.size() * sizeof(T));
+        }
+        return true;
+    }
+
+  private:
+    static const size_t alignment = 64;
+
+    static std::uint64_t align(std::uint64_t offset) { return (offset + alignment - 1) / alignment * alignment; }
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t kind;
+        std::uint64_t key;
+        std::uint64_t num_sections;
+    };
+
+    struct Section {
+        std::uint64_t offset;  // From the start of the file, aligned to 64 bytes
+        std::uint64_t count;
+        std::uint64_t element_size;
+    };
+
+    std::vector<std::pair<const void *, Section>> pending;  // Arrays to write
+    std::unique_ptr<cg::MappedFile> file;
+    const Section *sections = nullptr;
+    size_t num_sections = 0;
+};
+
+// Cache of the geometry of triangle meshes and of their BVHs, which are
+// the slow parts of setting up a scene with large meshes. Files are named by
+// a hash of their inputs: the content of the OBJ file, the placement of the
+// mesh, and the BVH build options. They are written when a mesh is first
+// loaded or built, and read back on later runs.
+class SceneCache {
+  public:
+    enum Kind { MESH = 1, MESH_BVH = 2 };
+
+    // Sets the directory of the cache files, which is created if needed. An
+    // empty directory disables the cache.
+    void set_directory(const std::string &dir) {
+        directory = dir;
+#if defined(__unix__) || defined(__APPLE__)
+        if (!directory.empty()) ::mkdir(directory.c_str(), 0755);
+#endif
+    }
+
+    bool enabled() const { return !directory.empty(); }
+
+    // Returns the mesh of an OBJ file moved by offset, from the cache if
+    // possible
+    shared_ptr<TriangleMesh> load_mesh(const std::string &filename, const glm::vec3 &offset, std::uint32_t mat_id) {
+        auto mesh = make_shared<TriangleMesh>();
+        mesh->mat_id = mat_id;
+        if (enabled()) {
+            auto start = std::chrono::steady_clock::now();
+            cg::MappedFile obj(filename);
+            if (obj.is_open()) {
+                std::uint64_t key = hashBytes(obj.data(), obj.size(), CacheFile::version);
+                mesh->source_key = hashValue(offset, key);
+            }
+
+            CacheFile file;
+            if (mesh->source_key && file.open(path(mesh->source_key, ".mesh"), MESH, mesh->source_key) &&
+                file.read(0, mesh->vx) && file.read(1, mesh->vy) && file.read(2, mesh->vz) &&
+                file.read(3, mesh->indices) && mesh->vy.size() == mesh->vx.size() &&
+                mesh->vz.size() == mesh->vx.size() && mesh->indices.size() % 3 == 0 &&
+                validIndices(mesh->indices, mesh->vx.size())) {
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Loaded " << filename << " from the scene cache in " << ms << " ms" << std::endl;
+                std::cout << "Number of triangles: " << mesh->num_triangles() << std::endl;
+                return mesh;
+            }
+        }
+
+        cg::OBJMesh obj_mesh;
+        cg::objMeshLoad(obj_mesh, filename);
+        std::uint64_t source_key = mesh->source_key;
+        mesh = make_shared<TriangleMesh>(obj_mesh, offset, mat_id);
+        mesh->source_key = source_key;
+        if (enabled() && source_key) {
+            CacheFile file;
+            file.add(mesh->vx);
+            file.add(mesh->vy);
+            file.add(mesh->vz);
+            file.add(mesh->indices);
+            if (!file.write(path(source_key, ".mesh"), MESH, source_key)) {
+                std::cerr << "Could not write the scene cache in " << directory << std::endl;
+            }
+        }
+        return mesh;
+    }
+
+    // Builds the BVH of a mesh, or reads it from the cache. A cached BVH is
+    // only used if all its nodes are valid, since a truncated or corrupt file
+    // could otherwise make traversal read out of bounds.
+    void build_bvh(TriangleMesh &mesh, const BvhBuildOptions &options) {
+        if (!enabled() || !mesh.source_key) {
+            mesh.build(options);
+            return;
+        }
+
+        std::uint64_t key = hashValue(options.builder, mesh.source_key);
+        key = hashValue(options.max_leaf_size, key);
+        key = hashValue(options.traversal_cost, key);
+        key = hashValue(options.num_bins, key);
+        key = hashValue(options.width, key);
+        const std::string filename = path(key, ".bvh");
+
+        CacheFile file;
+        bool opened = file.open(filename, MESH_BVH, key);
+        if (opened && file.read(0, mesh.bvh.nodes) && file.read(1, mesh.bvh.prim_indices) &&
+            file.read(2, mesh.bvh4.nodes) && file.read(3, mesh.bvh4.prim_indices) && file.read(4, mesh.bvh8.nodes) &&
+            file.read(5, mesh.bvh8.prim_indices) && mesh.bvh.prim_indices.size() == mesh.num_triangles() &&
+            mesh.bvh.valid(mesh.num_triangles()) && mesh.bvh4.valid(mesh.num_triangles()) &&
+            mesh.bvh8.valid(mesh.num_triangles())) {
+            mesh.width = options.width;
+            return;
+        }
+        if (opened) std::cerr << "Ignoring invalid BVH in the scene cache: " << filename << std::endl;
+
+        mesh.build(options);
+        file.add(mesh.bvh.nodes);
+        file.add(mesh.bvh.prim_indices);
+        file.add(mesh.bvh4.nodes);
+        file.add(mesh.bvh4.prim_indices);
+        file.add(mesh.bvh8.nodes);
+        file.add(mesh.bvh8.prim_indices);
+        if (!file.write(filename, MESH_BVH, key)) {
+            std::cerr << "Could not write the scene cache in " << directory << std::endl;
+        }
+    }
+
+  private:
+    static bool validIndices(const std::vector<std::uint32_t> &indices, size_t num_vertices) {
+        for (std::uint32_t index : indices) {
+            if (index >= num_vertices) return false;
+        }
+        return true;
+    }
+
+    std::string path(std::uint64_t key, const char *extension) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+        return directory + "/" + name + extension;
+    }
+
+    std::string directory;
+};
+
+}  // namespace rt
@@ -8,19 +8,24 @@ namespace rt {
 class Sphere : public Hitable {
   public:
     Sphere() {}
-    Sphere(const glm::vec3 &cen, float r, shared_ptr<Material> m) : center(cen), radius(r), mat_ptr(m){};
+    Sphere(const glm::vec3 &cen, float r, std::uint32_t m) : center(cen), radius(r), mat_id(m){};
 
     virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const;
     
     virtual bool bounding_box(double time0, double time1, AABB& output_box) const override;
 
+    virtual bool sample_direction(const glm::vec3 &origin, Sampler &sampler, glm::vec3 &direction,
+                                  float &pdf) const override;
+
+    virtual float direction_pdf(const Ray &r, const HitRecord &rec) const override;
+
     glm::vec3 center;
     float radius;
-    shared_ptr<Material> mat_ptr;
+    std::uint32_t mat_id;
 };
 
 // Ray-sphere test from "Ray Tracing in a Weekend" book (page 16)
-bool Sphere::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const {
+inline bool Sphere::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const {
     glm::vec3 oc = r.origin() - center;
     float a = glm::dot(r.direction(), r.direction());
     float b = 2.0f * glm::dot(oc, r.direction());
@@ -35,18 +40,48 @@ bool Sphere::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitReco
             rec.p = r.point_at_parameter(rec.t);
             rec.normal = (rec.p - center) / radius;
             rec.set_face_normal(r, rec.normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_id = mat_id;
+            rec.prim_id = 0;
             return true;
         }
     }
     return false;
 }
 
-bool Sphere::bounding_box(double time0, double time1, AABB& output_box) const {
+inline bool Sphere::bounding_box(double time0, double time1, AABB& output_box) const {
     output_box = AABB(
         center - glm::vec3(radius, radius, radius),
         center + glm::vec3(radius, radius, radius));
     return true;
 }
 
+// Samples a direction uniformly in the cone of directions from origin that
+// hit the sphere. 1 - cos(theta_max) is computed without cancellation, so
+// that small or distant spheres keep their precision.
+inline bool Sphere::sample_direction(const glm::vec3 &origin, Sampler &sampler, glm::vec3 &direction,
+                                     float &pdf) const {
+    glm::vec3 to_center = center - origin;
+    float distance2 = glm::dot(to_center, to_center);
+    float sin2_max = radius * radius / distance2;
+    if (!(sin2_max < 1.0f)) return false;  // Inside the sphere
+    float one_minus_cos_max = sin2_max / (1.0f + glm::sqrt(1.0f - sin2_max));
+
+    float phi = 2.0f * glm::pi<float>() * sampler.next_float();
+    float cos_theta = 1.0f - sampler.next_float() * one_minus_cos_max;
+    float sin_theta = glm::sqrt(glm::max(0.0f, 1.0f - cos_theta * cos_theta));
+    glm::vec3 w = to_center / glm::sqrt(distance2);
+    glm::vec3 u = glm::normalize(glm::cross(glm::abs(w.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), w));
+    glm::vec3 v = glm::cross(w, u);
+    direction = sin_theta * (glm::cos(phi) * u + glm::sin(phi) * v) + cos_theta * w;
+    pdf = 1.0f / (2.0f * glm::pi<float>() * one_minus_cos_max);
+    return true;
+}
+
+inline float Sphere::direction_pdf(const Ray &r, const HitRecord &rec) const {
+    glm::vec3 to_center = center - r.origin();
+    float sin2_max = radius * radius / glm::dot(to_center, to_center);
+    if (!(sin2_max < 1.0f)) return 0.0f;
+    return 1.0f / (2.0f * glm::pi<float>() * sin2_max / (1.0f + glm::sqrt(1.0f - sin2_max)));
+}
+
 }  // namespace rt
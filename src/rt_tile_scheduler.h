@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rt {
+
+// Persistent pool of render threads that processes a set of tiles with work
+// stealing. Each run() splits the tiles into one contiguous range per worker.
+// A worker takes tiles from the front of its own range, and when that is
+// empty it steals the back half of the range of another worker. The calling
+// thread takes part as worker 0.
+class TileScheduler {
+  public:
+    // Called as fn(tile_index, worker_index)
+    typedef std::function<void(int, int)> TileFn;
+
+    explicit TileScheduler(int num_threads)
+        : num_workers(num_threads > 0 ? num_threads : 1), workers(num_workers)
+    {
+        for (int i = 1; i < num_workers; ++i) {
+            threads.push_back(std::thread(&TileScheduler::thread_main, this, i));
+        }
+    }
+
+    ~TileScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        start_cv.notify_all();
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+    }
+
+    int size() const { return num_workers; }
+
+    // Calls fn once for every tile in [0, num_tiles), and returns when all
+    // tiles are done. Must not be called from more than one thread at a time.
+    void run(int num_tiles, const TileFn &fn) {
+        if (num_tiles <= 0) return;
+        for (int i = 0; i < num_workers; ++i) {
+            std::uint32_t begin = std::uint32_t(std::int64_t(num_tiles) * i / num_workers);
+            std::uint32_t end = std::uint32_t(std::int64_t(num_tiles) * (i + 1) / num_workers);
+            workers[i].range.store(pack(begin, end));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tile_fn = &fn;
+            pending = num_workers - 1;
+            generation += 1;
+        }
+        start_cv.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this]() { return pending == 0; });
+        tile_fn = nullptr;
+    }
+
+  private:
+    // Range of tiles [begin, end) that is left for a worker, packed into one
+    // word so that the owner and thieves can update it with a single CAS.
+    // Padded to its own cache line to avoid false sharing between workers.
+    struct Worker {
+        std::atomic<std::uint64_t> range;
+        char padding[64 - sizeof(std::atomic<std::uint64_t>)];
+
+        Worker() : range(0) {}
+    };
+
+    static std::uint64_t pack(std::uint32_t begin, std::uint32_t end) { return (std::uint64_t(end) << 32) | begin; }
+    static std::uint32_t range_begin(std::uint64_t range) { return std::uint32_t(range); }
+    static std::uint32_t range_end(std::uint64_t range) { return std::uint32_t(range >> 32); }
+
+    // Takes the first tile of the worker's own range
+    bool pop(int w, int &tile) {
+        std::uint64_t range = workers[w].range.load();
+        while (range_begin(range) < range_end(range)) {
+            std::uint64_t next = pack(range_begin(range) + 1, range_end(range));
+            if (workers[w].range.compare_exchange_weak(range, next)) {
+                tile = int(range_begin(range));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Moves the back half of another worker's range to worker w, and takes
+    // the first tile of it. Returns false when there is nothing to steal.
+    bool steal(int w, int &tile) {
+        for (int k = 1; k < num_workers; ++k) {
+            Worker &victim = workers[(w + k) % num_workers];
+            std::uint64_t range = victim.range.load();
+            while (range_begin(range) < range_end(range)) {
+                std::uint32_t begin = range_begin(range), end = range_end(range);
+                std::uint32_t mid = end - (end - begin + 1) / 2;
+                if (victim.range.compare_exchange_weak(range, pack(begin, mid))) {
+                    workers[w].range.store(pack(mid + 1, end));
+                    tile = int(mid);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void work(int w) {
+        const TileFn &fn = *tile_fn;
+        int tile;
+        while (pop(w, tile) || steal(w, tile)) {
+            fn(tile, w);
+        }
+    }
+
+    void thread_main(int w) {
+        unsigned seen_generation = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [&]() { return quit || generation != seen_generation; });
+                if (quit) return;
+                seen_generation = generation;
+            }
+            work(w);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending -= 1;
+                if (pending == 0) done_cv.notify_one();
+            }
+        }
+    }
+
+    int num_workers;
+    std::vector<Worker> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const TileFn *tile_fn = nullptr;
+    unsigned generation = 0;
+    int pending = 0;
+    bool quit = false;
+};
+
+}  // namespace rt
@@ -7,20 +7,28 @@ namespace rt {
 class Triangle : public Hitable {
   public:
     Triangle() {}
-    Triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, shared_ptr<Material> m) : v0(a), v1(b), v2(c), mat_ptr(m){};
+    Triangle(const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, std::uint32_t m) : v0(a), v1(b), v2(c), mat_id(m){};
 
     virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const;
 
     virtual bool bounding_box(double time0, double time1, AABB& output_box) const override;
 
+    virtual int hit_packet(RTContext &rtx, const RayPacket &packet, float t_min, float *t_max,
+                           HitRecord *rec, int mask) const override;
+
+    virtual bool sample_direction(const glm::vec3 &origin, Sampler &sampler, glm::vec3 &direction,
+                                  float &pdf) const override;
+
+    virtual float direction_pdf(const Ray &r, const HitRecord &rec) const override;
+
     glm::vec3 v0;
     glm::vec3 v1;
     glm::vec3 v2;
-    shared_ptr<Material> mat_ptr;
+    std::uint32_t mat_id;
 };
 
 // Ray-triangle test adapted from "Real-Time Collision Detection" book (pages 191--192)
-bool Triangle::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const
+inline bool Triangle::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const
 {
     glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
     float d = glm::dot(-r.direction(), n);
@@ -37,7 +45,8 @@ bool Triangle::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRe
                     rec.p = r.point_at_parameter(rec.t);
                     rec.normal = n;
                     rec.set_face_normal(r, rec.normal);
-                    rec.mat_ptr = mat_ptr;
+                    rec.mat_id = mat_id;
+                    rec.prim_id = 0;
                     return true;
                 }
             }
@@ -46,13 +55,81 @@ bool Triangle::hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRe
     return false;
 }
 
+// Same test as Triangle::hit(), vectorized over the lanes of the packet
+inline int Triangle::hit_packet(RTContext &rtx, const RayPacket &packet, float t_min, float *t_max,
+                         HitRecord *rec, int mask) const
+{
+    glm::vec3 e1 = v1 - v0;
+    glm::vec3 e2 = v2 - v0;
+    glm::vec3 n = glm::cross(e1, e2);
+
+    float t[RayPacket::max_size];
+    int hit[RayPacket::max_size];
+    #pragma omp simd
+    for (int i = 0; i < RayPacket::max_size; ++i) {
+        float ax = packet.ox[i] - v0.x, ay = packet.oy[i] - v0.y, az = packet.oz[i] - v0.z;
+        float d = -(packet.dx[i] * n.x + packet.dy[i] * n.y + packet.dz[i] * n.z);
+        float temp = ax * n.x + ay * n.y + az * n.z;
+        // e = cross(-dir, origin - v0)
+        float ex = -(packet.dy[i] * az - packet.dz[i] * ay);
+        float ey = -(packet.dz[i] * ax - packet.dx[i] * az);
+        float ez = -(packet.dx[i] * ay - packet.dy[i] * ax);
+        float v = e2.x * ex + e2.y * ey + e2.z * ez;
+        float w = -(e1.x * ex + e1.y * ey + e1.z * ez);
+        t[i] = temp / d;
+        hit[i] = d > 0.0f && temp >= 0.0f && v >= 0.0f && v <= d && w >= 0.0f && v + w <= d &&
+                 t[i] < t_max[i] && t[i] > t_min;
+    }
+
+    int hit_mask = 0;
+    for (int i = 0; i < packet.size; ++i) {
+        if (!hit[i] || !(mask & (1 << i))) continue;
+        Ray r = packet.ray(i);
+        rec[i].t = t[i];
+        rec[i].p = r.point_at_parameter(t[i]);
+        rec[i].normal = n;
+        rec[i].set_face_normal(r, rec[i].normal);
+        rec[i].mat_id = mat_id;
+        rec[i].prim_id = 0;
+        t_max[i] = t[i];
+        hit_mask |= 1 << i;
+    }
+    return hit_mask;
+}
+
 // "Finding the bounding box for a triangle is a matter of finding the smallest and largest x, y, and z components from its three points."
 // http://raytracerchallenge.com/bonus/bounding-boxes.html
-bool Triangle::bounding_box(double time0, double time1, AABB& output_box) const {
+inline bool Triangle::bounding_box(double time0, double time1, AABB& output_box) const {
     output_box = AABB(
         glm::vec3(glm::min(v0.x, v1.x, v2.x), glm::min(v0.y, v1.y, v2.y), glm::min(v0.z, v1.z, v2.z)),
         glm::vec3(glm::max(v0.x, v1.x, v2.x), glm::max(v0.y, v1.y, v2.y), glm::max(v0.z, v1.z, v2.z)));
     return true;
 }
 
+// Samples a point uniformly on the triangle, and converts the density over
+// its area to solid angle at origin. The direction is not normalized, and
+// reaches the point at t = 1.
+inline bool Triangle::sample_direction(const glm::vec3 &origin, Sampler &sampler, glm::vec3 &direction,
+                                       float &pdf) const {
+    float su = glm::sqrt(sampler.next_float());
+    float u2 = sampler.next_float();
+    float b1 = su * (1.0f - u2);
+    float b2 = su * u2;
+    glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
+    direction = v0 + b1 * (v1 - v0) + b2 * (v2 - v0) - origin;
+    float distance2 = glm::dot(direction, direction);
+    float cosine = glm::abs(glm::dot(n, direction)) / (glm::length(n) * glm::sqrt(distance2));
+    if (!(cosine > 0.0f)) return false;
+    pdf = distance2 / (cosine * 0.5f * glm::length(n));
+    return true;
+}
+
+inline float Triangle::direction_pdf(const Ray &r, const HitRecord &rec) const {
+    glm::vec3 n = glm::cross(v1 - v0, v2 - v0);
+    glm::vec3 direction = rec.p - r.origin();
+    float distance2 = glm::dot(direction, direction);
+    float cosine = glm::abs(glm::dot(n, direction)) / (glm::length(n) * glm::sqrt(distance2));
+    return cosine > 0.0f ? distance2 / (cosine * 0.5f * glm::length(n)) : 0.0f;
+}
+
 }  // namespace rt
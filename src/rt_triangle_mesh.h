@@ -0,0 +1,263 @@
+#pragma once
+
+#include "rt_hitable.h"
+#include "rt_flat_bvh.h"
+#include "rt_wide_bvh.h"
+#include "cg_utils2.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace rt {
+
+// Indexed triangle mesh with a single material. Vertex positions are stored
+// as structure of arrays and shared between triangles, and the mesh has its
+// own BVH over the triangles, so a triangle costs about a fifth of the memory
+// of a Triangle object and is intersected without a virtual call.
+//
+// Call build() to create the BVH before tracing rays against the mesh.
+class TriangleMesh : public Hitable {
+  public:
+    TriangleMesh() {}
+    TriangleMesh(const cg::OBJMesh &mesh, const glm::vec3 &offset, std::uint32_t m)
+        : indices(mesh.indices), mat_id(m)
+    {
+        vx.resize(mesh.vertices.size());
+        vy.resize(mesh.vertices.size());
+        vz.resize(mesh.vertices.size());
+        for (size_t i = 0; i < mesh.vertices.size(); ++i) {
+            vx[i] = mesh.vertices[i].x + offset.x;
+            vy[i] = mesh.vertices[i].y + offset.y;
+            vz[i] = mesh.vertices[i].z + offset.z;
+        }
+    }
+
+    std::uint32_t num_triangles() const { return std::uint32_t(indices.size() / 3); }
+
+    glm::vec3 vertex(std::uint32_t i) const { return glm::vec3(vx[i], vy[i], vz[i]); }
+
+    void build(const BvhBuildOptions &options) {
+        std::vector<AABB> boxes(num_triangles());
+        for (std::uint32_t i = 0; i < num_triangles(); ++i) {
+            glm::vec3 a = vertex(indices[3 * i + 0]);
+            glm::vec3 b = vertex(indices[3 * i + 1]);
+            glm::vec3 c = vertex(indices[3 * i + 2]);
+            boxes[i] = AABB(glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)));
+        }
+        bvh.build(boxes, options);
+
+        width = options.width;
+        bvh4.nodes.clear();
+        bvh8.nodes.clear();
+        if (width == 4) bvh4.collapse(bvh);
+        if (width == 8) bvh8.collapse(bvh);
+    }
+
+    // Number of bytes used by the vertices and indices of the mesh
+    size_t geometry_bytes() const {
+        return (vx.size() + vy.size() + vz.size()) * sizeof(float) + indices.size() * sizeof(std::uint32_t);
+    }
+
+    virtual bool hit(RTContext &rtx, const Ray &r, float t_min, float t_max, HitRecord &rec) const override {
+        const glm::vec3 org = r.origin();
+        const ShearedRay sr = shear(r.direction());
+        std::uint32_t hit_triangle = 0;
+        auto intersect = [&](std::uint32_t tri, float t_lo, float &t_hi) {
+            float t;
+            if (!intersect_triangle(tri, org, sr, t_lo, t_hi, t)) return false;
+            t_hi = t;
+            hit_triangle = tri;
+            return true;
+        };
+
+        bool hit_anything;
+        if (width == 8) hit_anything = bvh8.traverse(r, t_min, t_max, intersect);
+        else if (width == 4) hit_anything = bvh4.traverse(r, t_min, t_max, intersect);
+        else hit_anything = bvh.traverse(r, t_min, t_max, intersect);
+        if (!hit_anything) return false;
+
+        set_hit_record(r, hit_triangle, t_max, rec);
+        return true;
+    }
+
+    // Traverses the BVH of the selected width with the packet. The triangle
+    // test is vectorized over the lanes that share the same ray-space axes.
+    virtual int hit_packet(RTContext &rtx, const RayPacket &packet, float t_min, float *t_max,
+                           HitRecord *rec, int mask) const override {
+        float sx[RayPacket::max_size], sy[RayPacket::max_size], sz[RayPacket::max_size];
+        int axes_mask[6] = { 0, 0, 0, 0, 0, 0 };
+        for (int i = 0; i < packet.size; ++i) {
+            ShearedRay sr = shear(glm::vec3(packet.dx[i], packet.dy[i], packet.dz[i]));
+            sx[i] = sr.sx;
+            sy[i] = sr.sy;
+            sz[i] = sr.sz;
+            axes_mask[axes_index(sr)] |= 1 << i;
+        }
+        for (int i = packet.size; i < RayPacket::max_size; ++i) {
+            sx[i] = sx[0];
+            sy[i] = sy[0];
+            sz[i] = sz[0];
+        }
+
+        std::uint32_t hit_triangle[RayPacket::max_size];
+        auto intersect = [&](std::uint32_t tri, int lanes) {
+            int tri_mask = 0;
+            for (int k = 0; k < 6; ++k) {
+                int group = axes_mask[k] & lanes;
+                if (group == 0) continue;
+                float t[RayPacket::max_size];
+                int group_hits = intersect_triangle_lanes(tri, packet, k, sx, sy, sz, t_min, t_max, t) & group;
+                for (int i = 0; i < packet.size; ++i) {
+                    if (!(group_hits & (1 << i))) continue;
+                    t_max[i] = t[i];
+                    hit_triangle[i] = tri;
+                }
+                tri_mask |= group_hits;
+            }
+            return tri_mask;
+        };
+        int hit_mask;
+        if (width == 8) hit_mask = bvh8.traverse_packet(packet, t_min, t_max, mask, intersect);
+        else if (width == 4) hit_mask = bvh4.traverse_packet(packet, t_min, t_max, mask, intersect);
+        else hit_mask = bvh.traverse_packet(packet, t_min, t_max, mask, intersect);
+
+        for (int i = 0; i < packet.size; ++i) {
+            if (hit_mask & (1 << i)) set_hit_record(packet.ray(i), hit_triangle[i], t_max[i], rec[i]);
+        }
+        return hit_mask;
+    }
+
+    virtual bool bounding_box(double time0, double time1, AABB &output_box) const override {
+        if (!bvh.nodes.empty()) {
+            output_box = AABB(bvh.nodes[0].bmin, bvh.nodes[0].bmax);
+            return true;
+        }
+        if (vx.empty()) return false;
+        glm::vec3 bmin = vertex(0), bmax = vertex(0);
+        for (std::uint32_t i = 1; i < vx.size(); ++i) {
+            bmin = glm::min(bmin, vertex(i));
+            bmax = glm::max(bmax, vertex(i));
+        }
+        output_box = AABB(bmin, bmax);
+        return true;
+    }
+
+  private:
+    // Per-ray constants of the watertight ray-triangle test: the axes of ray
+    // space (kz is the dominant axis of the ray direction), and the shear
+    // that maps the ray direction to the kz axis
+    struct ShearedRay {
+        int kx, ky, kz;
+        float sx, sy, sz;
+    };
+
+    static ShearedRay shear(const glm::vec3 &dir) {
+        glm::vec3 d = glm::abs(dir);
+        ShearedRay sr;
+        sr.kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+        sr.kx = (sr.kz + 1) % 3;
+        sr.ky = (sr.kx + 1) % 3;
+        if (dir[sr.kz] < 0.0f) std::swap(sr.kx, sr.ky);  // Preserve the winding order
+        sr.sx = dir[sr.kx] / dir[sr.kz];
+        sr.sy = dir[sr.ky] / dir[sr.kz];
+        sr.sz = 1.0f / dir[sr.kz];
+        return sr;
+    }
+
+    // Index in [0, 6) of the axes (kx, ky, kz) of a sheared ray
+    static int axes_index(const ShearedRay &sr) { return sr.kz * 2 + (sr.kx == (sr.kz + 1) % 3 ? 0 : 1); }
+
+    static ShearedRay axes_from_index(int index) {
+        ShearedRay sr;
+        sr.kz = index / 2;
+        sr.kx = (sr.kz + 1) % 3;
+        sr.ky = (sr.kx + 1) % 3;
+        if (index % 2) std::swap(sr.kx, sr.ky);
+        sr.sx = sr.sy = sr.sz = 0.0f;
+        return sr;
+    }
+
+    // Watertight ray-triangle test from "Watertight Ray/Triangle Intersection"
+    // (Woop, Benthin and Wald, JCGT 2013). Both sides of the triangle are hit.
+    bool intersect_triangle(std::uint32_t tri, const glm::vec3 &org, const ShearedRay &sr,
+                            float t_min, float t_max, float &t) const {
+        const glm::vec3 a = vertex(indices[3 * tri + 0]) - org;
+        const glm::vec3 b = vertex(indices[3 * tri + 1]) - org;
+        const glm::vec3 c = vertex(indices[3 * tri + 2]) - org;
+        const float ax = a[sr.kx] - sr.sx * a[sr.kz], ay = a[sr.ky] - sr.sy * a[sr.kz];
+        const float bx = b[sr.kx] - sr.sx * b[sr.kz], by = b[sr.ky] - sr.sy * b[sr.kz];
+        const float cx = c[sr.kx] - sr.sx * c[sr.kz], cy = c[sr.ky] - sr.sy * c[sr.kz];
+        const float u = cx * by - cy * bx;
+        const float v = ax * cy - ay * cx;
+        const float w = bx * ay - by * ax;
+        if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) return false;
+
+        // A zero determinant gives an infinite or NaN distance, which fails
+        // the range test below
+        const float det = u + v + w;
+        const float dist = (u * a[sr.kz] + v * b[sr.kz] + w * c[sr.kz]) * sr.sz;
+        t = dist / det;
+        return t > t_min && t < t_max;
+    }
+
+    // Same test as intersect_triangle() for all lanes of a packet, where the
+    // ray-space axes are given by axes_index() and the shears are per lane.
+    // Returns the mask of the lanes that hit the triangle.
+    int intersect_triangle_lanes(std::uint32_t tri, const RayPacket &packet, int axes, const float *sx,
+                                 const float *sy, const float *sz, float t_min, const float *t_max,
+                                 float *t) const {
+        const ShearedRay sr = axes_from_index(axes);
+        const float *org[3] = { packet.ox, packet.oy, packet.oz };
+        const float *ox = org[sr.kx], *oy = org[sr.ky], *oz = org[sr.kz];
+        const glm::vec3 va = vertex(indices[3 * tri + 0]);
+        const glm::vec3 vb = vertex(indices[3 * tri + 1]);
+        const glm::vec3 vc = vertex(indices[3 * tri + 2]);
+        const float vax = va[sr.kx], vay = va[sr.ky], vaz = va[sr.kz];
+        const float vbx = vb[sr.kx], vby = vb[sr.ky], vbz = vb[sr.kz];
+        const float vcx = vc[sr.kx], vcy = vc[sr.ky], vcz = vc[sr.kz];
+
+        int hit[RayPacket::max_size];
+        #pragma omp simd
+        for (int i = 0; i < RayPacket::max_size; ++i) {
+            const float az = vaz - oz[i], bz = vbz - oz[i], cz = vcz - oz[i];
+            const float ax = (vax - ox[i]) - sx[i] * az, ay = (vay - oy[i]) - sy[i] * az;
+            const float bx = (vbx - ox[i]) - sx[i] * bz, by = (vby - oy[i]) - sy[i] * bz;
+            const float cx = (vcx - ox[i]) - sx[i] * cz, cy = (vcy - oy[i]) - sy[i] * cz;
+            const float u = cx * by - cy * bx;
+            const float v = ax * cy - ay * cx;
+            const float w = bx * ay - by * ax;
+            const float det = u + v + w;
+            const float dist = (u * az + v * bz + w * cz) * sz[i];
+            t[i] = dist / det;
+            hit[i] = !((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) &&
+                     t[i] > t_min && t[i] < t_max[i];
+        }
+        int mask = 0;
+        for (int i = 0; i < RayPacket::max_size; ++i) mask |= hit[i] << i;
+        return mask;
+    }
+
+    void set_hit_record(const Ray &r, std::uint32_t tri, float t, HitRecord &rec) const {
+        const glm::vec3 a = vertex(indices[3 * tri + 0]);
+        const glm::vec3 b = vertex(indices[3 * tri + 1]);
+        const glm::vec3 c = vertex(indices[3 * tri + 2]);
+        rec.t = t;
+        rec.p = r.point_at_parameter(t);
+        rec.normal = glm::cross(b - a, c - a);
+        rec.set_face_normal(r, rec.normal);
+        rec.mat_id = mat_id;
+        rec.prim_id = tri;
+    }
+
+  public:
+    std::vector<float> vx, vy, vz;       // Vertex positions
+    std::vector<std::uint32_t> indices;  // Three vertex indices per triangle
+    std::uint32_t mat_id;
+    std::uint64_t source_key = 0;        // Hash of the inputs of the geometry in the SceneCache, 0 - Not cached
+    FlatBvh bvh;
+    WideBvh<4> bvh4;
+    WideBvh<8> bvh8;
+    int width = 2;
+};
+
+}  // namespace rt
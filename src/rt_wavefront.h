@@ -0,0 +1,281 @@
+#pragma once
+
+#include "rt_counters.h"
+#include "rt_hitable.h"
+#include "rt_light.h"
+#include "rt_material.h"
+#include "rt_ray_packet.h"
+#include "rt_sampler.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace rt {
+
+// Queue of path segments (rays) for the wavefront integrator, stored as
+// structure of arrays. Each entry also carries the throughput of its path,
+// the pixel it contributes to, its random number generator and the density
+// of its direction for MIS (see LightList::emission_weight()).
+struct PathQueue {
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<glm::vec3> throughput;
+    std::vector<std::uint32_t> pixel;
+    std::vector<Sampler> sampler;
+    std::vector<float> bsdf_pdf;
+    std::uint32_t size = 0;
+
+    void clear() { size = 0; }
+
+    void push(const Ray &r, const glm::vec3 &path_throughput, std::uint32_t pixel_index, const Sampler &path_sampler,
+              float direction_pdf = 0.0f) {
+        if (size == ox.size()) {
+            size_t capacity = glm::max(size_t(256), 2 * ox.size());
+            ox.resize(capacity); oy.resize(capacity); oz.resize(capacity);
+            dx.resize(capacity); dy.resize(capacity); dz.resize(capacity);
+            throughput.resize(capacity);
+            pixel.resize(capacity);
+            sampler.resize(capacity);
+            bsdf_pdf.resize(capacity);
+        }
+        ox[size] = r.A.x; oy[size] = r.A.y; oz[size] = r.A.z;
+        dx[size] = r.B.x; dy[size] = r.B.y; dz[size] = r.B.z;
+        throughput[size] = path_throughput;
+        pixel[size] = pixel_index;
+        sampler[size] = path_sampler;
+        bsdf_pdf[size] = direction_pdf;
+        size += 1;
+    }
+
+    Ray ray(std::uint32_t i) const { return Ray(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i])); }
+};
+
+// Closest hits of the rays in a PathQueue, stored at the same indices
+struct HitQueue {
+    std::vector<float> t;
+    std::vector<glm::vec3> p;
+    std::vector<glm::vec3> normal;  // Normalized, facing against the ray
+    std::vector<std::uint8_t> front_face;
+    std::vector<const Material *> material;  // nullptr if the ray missed
+    std::vector<std::uint32_t> mat_id, object_id, prim_id;
+
+    void resize(std::uint32_t n) {
+        if (t.size() >= n) return;
+        t.resize(n);
+        p.resize(n);
+        normal.resize(n);
+        front_face.resize(n);
+        material.resize(n);
+        mat_id.resize(n);
+        object_id.resize(n);
+        prim_id.resize(n);
+    }
+
+    void set(std::uint32_t i, const HitRecord &rec, const MaterialTable &materials) {
+        t[i] = rec.t;
+        p[i] = rec.p;
+        normal[i] = glm::normalize(rec.normal);
+        front_face[i] = rec.front_face;
+        material[i] = &materials[rec.mat_id];
+        mat_id[i] = rec.mat_id;
+        object_id[i] = rec.object_id;
+        prim_id[i] = rec.prim_id;
+    }
+
+    HitRecord record(std::uint32_t i) const {
+        HitRecord rec;
+        rec.t = t[i];
+        rec.p = p[i];
+        rec.normal = normal[i];
+        rec.front_face = front_face[i] != 0;
+        rec.mat_id = mat_id[i];
+        rec.object_id = object_id[i];
+        rec.prim_id = prim_id[i];
+        return rec;
+    }
+};
+
+// Wavefront (stream) path tracer. Instead of following one path at a time
+// through traversal, material evaluation and recursion, each bounce of all
+// paths in the queue is processed in stages: intersect all rays, sort the
+// hits by material type, and then shade each material type as one batch
+// that writes the rays of the next bounce into a new queue.
+//
+// Fill `paths` with the primary rays (throughput 1) and call trace().
+// Diffuse hits sample the lights with shadow rays as in shade() of
+// rt_raytracing.cpp, which are traced right away rather than queued.
+class WavefrontIntegrator {
+  public:
+    // Traces the paths in `paths` for up to max_bounces bounces and adds the
+    // radiance of each path to radiance[pixel]. Emissive hits add their
+    // emission, and diffuse hits sample `lights`. Misses are shaded with
+    // background(ray). The primary rays are intersected as packets if
+    // use_packets is set. If aovs is not null, the AOVs of each path are
+    // written to aovs[pixel]. Returns the number of rays that were traced.
+    template <typename BackgroundFn>
+    std::uint64_t trace(RTContext &rtx, const Hitable &world, const MaterialTable &materials, const LightList &lights,
+                        int max_bounces, bool use_packets, BackgroundFn background, glm::vec3 *radiance,
+                        SampleAovs *aovs = nullptr) {
+        std::uint64_t num_rays = 0;
+        for (int depth = 0; depth <= max_bounces && paths.size > 0; ++depth) {
+            num_rays += paths.size;
+            countRays(depth, paths.size);
+            intersect(rtx, world, materials, use_packets && depth == 0);
+            if (depth == 0 && aovs) {
+                for (std::uint32_t i = 0; i < paths.size; ++i) {
+                    const Material *material = hits.material[i];
+                    aovs[paths.pixel[i]] = material ? SampleAovs::surface(paths.ray(i), hits.record(i), material->base_color())
+                                                    : SampleAovs::miss(paths.ray(i), background(paths.ray(i)));
+                }
+            }
+            else if (aovs) {
+                for (std::uint32_t i = 0; i < paths.size; ++i) aovs[paths.pixel[i]].bounces = depth;
+            }
+
+            // Misses (and normals in preview mode) end the path here, hits
+            // are sorted by material type
+            for (int k = 0; k <= NUM_MATERIAL_TYPES; ++k) type_begin[k] = 0;
+            for (std::uint32_t i = 0; i < paths.size; ++i) {
+                const Material *material = hits.material[i];
+                if (material == nullptr) {
+                    radiance[paths.pixel[i]] += paths.throughput[i] * background(paths.ray(i)) *
+                                                lights.miss_weight(paths.ray(i), paths.bsdf_pdf[i]);
+                } else if (rtx.show_normals) {
+                    radiance[paths.pixel[i]] += paths.throughput[i] * (hits.normal[i] * 0.5f + 0.5f);
+                } else {
+                    type_begin[material->type + 1] += 1;
+                }
+            }
+            for (int k = 0; k < NUM_MATERIAL_TYPES; ++k) countHits(k, type_begin[k + 1]);
+            for (int k = 0; k < NUM_MATERIAL_TYPES; ++k) type_begin[k + 1] += type_begin[k];
+            sorted.resize(type_begin[NUM_MATERIAL_TYPES]);
+            std::uint32_t type_end[NUM_MATERIAL_TYPES];
+            for (int k = 0; k < NUM_MATERIAL_TYPES; ++k) type_end[k] = type_begin[k];
+            for (std::uint32_t i = 0; i < paths.size; ++i) {
+                const Material *material = hits.material[i];
+                if (material != nullptr && !rtx.show_normals) sorted[type_end[material->type]++] = i;
+            }
+
+            next.clear();
+            bool sample_lights = rtx.light_sampling && depth < max_bounces && !lights.empty();
+            ShadeContext context = { world, materials, lights, depth, sample_lights, radiance, 0 };
+            shade<Lambertian>(rtx, MATERIAL_LAMBERTIAN, context, background);
+            shade<Metal>(rtx, MATERIAL_METAL, context, background);
+            shade<Dielectric>(rtx, MATERIAL_DIELECTRIC, context, background);
+            shade<DiffuseLight>(rtx, MATERIAL_EMISSIVE, context, background);
+            shade<Material>(rtx, MATERIAL_OTHER, context, background);
+            num_rays += context.shadow_rays;
+            std::swap(paths, next);
+        }
+        paths.clear();
+        return num_rays;
+    }
+
+    PathQueue paths;
+
+  private:
+    // Finds the closest hit of every ray in the queue
+    void intersect(RTContext &rtx, const Hitable &world, const MaterialTable &materials, bool use_packets) {
+        hits.resize(paths.size);
+        const float t_min = 0.001f;  // Set min to avoid "shadow acne"
+        const float t_max = 9999.0f;
+
+        std::uint32_t i = 0;
+        if (use_packets) {
+            // Consecutive primary rays go through neighbouring pixels
+            for (; i + RayPacket::max_size <= paths.size; i += RayPacket::max_size) {
+                RayPacket packet;
+                for (int k = 0; k < RayPacket::max_size; ++k) packet.set(k, paths.ray(i + k));
+                packet.finalize(RayPacket::max_size);
+                float packet_t_max[RayPacket::max_size];
+                HitRecord rec[RayPacket::max_size];
+                for (int k = 0; k < RayPacket::max_size; ++k) packet_t_max[k] = t_max;
+                int hit_mask = world.hit_packet(rtx, packet, t_min, packet_t_max, rec, packet.all_mask());
+                for (int k = 0; k < RayPacket::max_size; ++k) {
+                    if (hit_mask & (1 << k)) hits.set(i + k, rec[k], materials);
+                    else hits.material[i + k] = nullptr;
+                }
+            }
+        }
+        for (; i < paths.size; ++i) {
+            HitRecord rec;
+            if (world.hit(rtx, paths.ray(i), t_min, t_max, rec)) hits.set(i, rec, materials);
+            else hits.material[i] = nullptr;
+        }
+    }
+
+    // Calls the scatter function of the concrete material class without a
+    // virtual call. Other materials are dispatched through the vtable.
+    template <typename MaterialClass>
+    static bool scatter(const MaterialClass *material, RTContext &rtx, const Ray &r_in, const HitRecord &rec,
+                        glm::vec3 &attenuation, Ray &scattered, Sampler &sampler) {
+        return material->MaterialClass::scatter(rtx, r_in, rec, attenuation, scattered, sampler);
+    }
+
+    static bool scatter(const Material *material, RTContext &rtx, const Ray &r_in, const HitRecord &rec,
+                        glm::vec3 &attenuation, Ray &scattered, Sampler &sampler) {
+        return material->scatter(rtx, r_in, rec, attenuation, scattered, sampler);
+    }
+
+    // Same for the emission, which is constant zero for most classes
+    template <typename MaterialClass>
+    static glm::vec3 emitted(const MaterialClass *material, const HitRecord &rec) {
+        return material->MaterialClass::emitted(rec);
+    }
+
+    static glm::vec3 emitted(const Material *material, const HitRecord &rec) { return material->emitted(rec); }
+
+    // State of one bounce that shade() needs for emission and light sampling
+    struct ShadeContext {
+        const Hitable &world;
+        const MaterialTable &materials;
+        const LightList &lights;
+        int depth;
+        bool sample_lights;  // False at the last bounce, where shadow rays would be too deep
+        glm::vec3 *radiance;
+        std::uint64_t shadow_rays;
+    };
+
+    // Scatters the hits with materials of the given type, and adds the
+    // scattered rays to the next queue. Emission is added to the radiance,
+    // weighted against the light sample of the previous bounce, and diffuse
+    // hits add the light sampled with a shadow ray.
+    template <typename MaterialClass, typename BackgroundFn>
+    void shade(RTContext &rtx, MaterialType type, ShadeContext &context, BackgroundFn background) {
+        for (std::uint32_t k = type_begin[type]; k < type_begin[type + 1]; ++k) {
+            std::uint32_t i = sorted[k];
+            const MaterialClass *material = static_cast<const MaterialClass *>(hits.material[i]);
+            HitRecord rec = hits.record(i);
+            glm::vec3 emission = emitted(material, rec);
+            if (emission != glm::vec3(0.0f)) {
+                context.radiance[paths.pixel[i]] +=
+                    paths.throughput[i] * emission * context.lights.emission_weight(paths.ray(i), rec, paths.bsdf_pdf[i]);
+            }
+            Ray scattered;
+            glm::vec3 attenuation;
+            if (!scatter(material, rtx, paths.ray(i), rec, attenuation, scattered, paths.sampler[i])) continue;
+
+            float scattered_pdf = 0.0f;
+            if (type == MATERIAL_LAMBERTIAN && context.sample_lights) {
+                auto trace = [&](const Ray &shadow_ray, HitRecord &light_rec) {
+                    context.shadow_rays += 1;
+                    countRays(context.depth + 1);
+                    return context.world.hit(rtx, shadow_ray, 0.001f, 9999.0f, light_rec);
+                };
+                context.radiance[paths.pixel[i]] +=
+                    paths.throughput[i] * attenuation *
+                    context.lights.sample_diffuse(rtx, rec, *material, context.materials, paths.sampler[i], trace,
+                                                  background);
+                scattered_pdf = material->scattering_pdf(rtx, rec, scattered.direction());
+            }
+            next.push(scattered, paths.throughput[i] * attenuation, paths.pixel[i], paths.sampler[i], scattered_pdf);
+        }
+    }
+
+    PathQueue next;
+    HitQueue hits;
+    std::vector<std::uint32_t> sorted;  // Indices of the hits, sorted by material type
+    std::uint32_t type_begin[NUM_MATERIAL_TYPES + 1];
+};
+
+}  // namespace rt
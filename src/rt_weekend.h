@@ -5,6 +5,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include "glm/ext.hpp"
 
+#include "rt_sampler.h"
+
 #include <cstdlib>
 #include <memory>
 #include <iostream>
@@ -35,7 +37,7 @@ inline static glm::vec3 random_vec3(double min, double max) {
 }
 
 // Returns a random glm::vec3 in a unit radius sphere using rejection method
-glm::vec3 random_in_unit_sphere() {
+inline glm::vec3 random_in_unit_sphere() {
     while (true) {
         auto p = random_vec3(-1,1);
         if (glm::length2(p) >= 1) continue;
@@ -44,12 +46,12 @@ glm::vec3 random_in_unit_sphere() {
 }
 
 // Returns a normalized random glm::vec3 in a unit radius sphere using rejection method (used for True Lambertian Reflection)
-glm::vec3 random_unit_vector() {
+inline glm::vec3 random_unit_vector() {
     return glm::normalize(random_in_unit_sphere());
 }
 
 // Returns a random glm::vec3 in a unit hemisphere
-glm::vec3 random_in_hemisphere(const glm::vec3& normal) {
+inline glm::vec3 random_in_hemisphere(const glm::vec3& normal) {
     glm::vec3 in_unit_sphere = random_in_unit_sphere();
     if (glm::dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
@@ -57,8 +59,41 @@ glm::vec3 random_in_hemisphere(const glm::vec3& normal) {
         return -in_unit_sphere;
 }
 
+// Versions of the functions above that draw from a Sampler instead of the
+// global rand() state. Use these for rendering; rand() is only used for
+// setting up scenes.
+
+// Returns a random real in [0,1).
+inline double random_double(Sampler &sampler) {
+    return sampler.next_float();
+}
+
+// Returns a random glm::vec3 in a unit radius sphere using rejection method
+inline glm::vec3 random_in_unit_sphere(Sampler &sampler) {
+    while (true) {
+        glm::vec3 p(sampler.next_float(), sampler.next_float(), sampler.next_float());
+        p = 2.0f * p - 1.0f;
+        if (glm::length2(p) >= 1) continue;
+        return p;
+    }
+}
+
+// Returns a normalized random glm::vec3 in a unit radius sphere
+inline glm::vec3 random_unit_vector(Sampler &sampler) {
+    return glm::normalize(random_in_unit_sphere(sampler));
+}
+
+// Returns a random glm::vec3 in a unit hemisphere
+inline glm::vec3 random_in_hemisphere(const glm::vec3& normal, Sampler &sampler) {
+    glm::vec3 in_unit_sphere = random_in_unit_sphere(sampler);
+    if (glm::dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+        return in_unit_sphere;
+    else
+        return -in_unit_sphere;
+}
+
 // Return true if the vector is close to zero in all dimensions.
-bool near_zero_vec3(glm::vec3 e) {
+inline bool near_zero_vec3(glm::vec3 e) {
     const auto s = 1e-8;
     return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
 }
@@ -0,0 +1,384 @@
+#pragma once
+
+#include "rt_flat_bvh.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+namespace rt {
+
+// Node of a W-wide BVH. The bounds of all children are stored as structure of
+// arrays, so that one ray can be tested against all of them with a single
+// vectorized slab test. Unused child slots have their bounds set to +inf,
+// which is never hit by any ray.
+template <int W>
+struct WideBvhNode {
+    float bmin_x[W], bmin_y[W], bmin_z[W];
+    float bmax_x[W], bmax_y[W], bmax_z[W];
+    std::uint32_t child[W];  // Index of child node (interior) or first primitive (leaf)
+    std::uint32_t count[W];  // Number of primitives, or 0 for interior nodes
+};
+
+// Tests the ray against all child boxes of the node, one at a time. Returns a
+// bit mask of the children that were hit, and their entry distances in
+// t_enter.
+template <int W>
+inline int hit_children_scalar(const WideBvhNode<W> &node, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                               float t_min, float t_max, float *t_enter)
+{
+    int mask = 0;
+    for (int i = 0; i < W; ++i) {
+        float tx0 = (node.bmin_x[i] - origin.x) * inv_dir.x;
+        float tx1 = (node.bmax_x[i] - origin.x) * inv_dir.x;
+        float ty0 = (node.bmin_y[i] - origin.y) * inv_dir.y;
+        float ty1 = (node.bmax_y[i] - origin.y) * inv_dir.y;
+        float tz0 = (node.bmin_z[i] - origin.z) * inv_dir.z;
+        float tz1 = (node.bmax_z[i] - origin.z) * inv_dir.z;
+        float t_near = glm::max(glm::max(glm::min(tx0, tx1), glm::min(ty0, ty1)),
+                                glm::max(glm::min(tz0, tz1), t_min));
+        float t_far = glm::min(glm::min(glm::max(tx0, tx1), glm::max(ty0, ty1)),
+                               glm::min(glm::max(tz0, tz1), t_max));
+        t_enter[i] = t_near;
+        if (t_near <= t_far) mask |= 1 << i;
+    }
+    return mask;
+}
+
+// Same as hit_children_scalar(), vectorized where the CPU supports it
+template <int W>
+inline int hit_children(const WideBvhNode<W> &node, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                        float t_min, float t_max, float *t_enter)
+{
+    return hit_children_scalar(node, origin, inv_dir, t_min, t_max, t_enter);
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// 4-wide slab test with SSE
+template <>
+inline int hit_children<4>(const WideBvhNode<4> &node, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                           float t_min, float t_max, float *t_enter)
+{
+    const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+    const __m128 ix = _mm_set1_ps(inv_dir.x), iy = _mm_set1_ps(inv_dir.y), iz = _mm_set1_ps(inv_dir.z);
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmin_x), ox), ix);
+    __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmax_x), ox), ix);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmin_y), oy), iy);
+    __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmax_y), oy), iy);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmin_z), oz), iz);
+    __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bmax_z), oz), iz);
+    __m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                               _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps(t_min)));
+    __m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                              _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+    _mm_storeu_ps(t_enter, t_near);
+    return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+}
+#endif
+
+// The 8-wide slab test uses AVX if the build targets it (e.g., with
+// RT_VIEWER_NATIVE_ARCH). Otherwise, GCC and Clang also compile an AVX
+// version, which is used if the CPU supports AVX at run time.
+#if defined(__AVX__)
+#define RT_AVX_TARGET
+#define RT_HAS_AVX_CODE 1
+inline bool cpuHasAvx() { return true; }
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define RT_AVX_TARGET __attribute__((target("avx")))
+#define RT_HAS_AVX_CODE 1
+inline bool cpuHasAvx()
+{
+    static const bool has_avx = __builtin_cpu_supports("avx");
+    return has_avx;
+}
+#else
+#define RT_HAS_AVX_CODE 0
+inline bool cpuHasAvx() { return false; }
+#endif
+
+#if RT_HAS_AVX_CODE
+// 8-wide slab test with AVX
+RT_AVX_TARGET inline int hit_children_avx(const WideBvhNode<8> &node, const glm::vec3 &origin,
+                                          const glm::vec3 &inv_dir, float t_min, float t_max, float *t_enter)
+{
+    const __m256 ox = _mm256_set1_ps(origin.x), oy = _mm256_set1_ps(origin.y), oz = _mm256_set1_ps(origin.z);
+    const __m256 ix = _mm256_set1_ps(inv_dir.x), iy = _mm256_set1_ps(inv_dir.y), iz = _mm256_set1_ps(inv_dir.z);
+    __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmin_x), ox), ix);
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmax_x), ox), ix);
+    __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmin_y), oy), iy);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmax_y), oy), iy);
+    __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmin_z), oz), iz);
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bmax_z), oz), iz);
+    __m256 t_near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+                                  _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(t_min)));
+    __m256 t_far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+                                 _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+    _mm256_storeu_ps(t_enter, t_near);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+}
+
+template <>
+inline int hit_children<8>(const WideBvhNode<8> &node, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                           float t_min, float t_max, float *t_enter)
+{
+    if (cpuHasAvx()) return hit_children_avx(node, origin, inv_dir, t_min, t_max, t_enter);
+    return hit_children_scalar(node, origin, inv_dir, t_min, t_max, t_enter);
+}
+#endif
+
+// Instruction set of the slab test of a W-wide BVH on this CPU, e.g., for
+// labels in the GUI
+inline const char *wideBvhSimdName(int width)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    if (width == 4) return "SSE";
+#endif
+    if (width == 8 && cpuHasAvx()) return "AVX";
+    return "scalar";
+}
+
+// BVH with W children per node, created by collapsing a binary FlatBvh. It
+// shares the primitive order of the binary BVH, and is traversed the same way.
+template <int W>
+class WideBvh {
+  public:
+    typedef WideBvhNode<W> Node;
+
+    // Each node visit can push up to W - 1 more entries than it pops, and the
+    // wide tree is never deeper than the binary tree it was collapsed from
+    static const int max_stack_depth = (W - 1) * FlatBvh::max_stack_depth + 1;
+
+    void collapse(const FlatBvh &bvh) {
+        nodes.clear();
+        prim_indices = bvh.prim_indices;
+        if (bvh.nodes.empty()) return;
+
+        nodes.reserve(bvh.nodes.size() / (W - 1) + 1);
+        nodes.push_back(Node());
+        collapse_node(bvh, 0, 0);
+    }
+
+    // Same checks as FlatBvh::valid(). Unused child slots (with infinite
+    // bounds) are skipped, since no ray hits them.
+    bool valid(size_t num_primitives) const {
+        for (std::uint32_t prim : prim_indices) {
+            if (prim >= num_primitives) return false;
+        }
+        if (nodes.empty()) return true;
+
+        const float inf = std::numeric_limits<float>::infinity();
+        std::vector<std::uint8_t> visited(nodes.size(), 0);
+        std::vector<std::pair<std::uint32_t, int>> stack(1, std::make_pair(0u, 1));  // Node and depth
+        while (!stack.empty()) {
+            std::uint32_t index = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (index >= nodes.size() || visited[index] || depth > FlatBvh::max_stack_depth) return false;
+            visited[index] = 1;
+            const Node &node = nodes[index];
+            for (int i = 0; i < W; ++i) {
+                if (node.count[i] > 0) {
+                    if (std::uint64_t(node.child[i]) + node.count[i] > prim_indices.size()) return false;
+                } else if (!(node.bmin_x[i] == inf && node.bmin_y[i] == inf && node.bmin_z[i] == inf)) {
+                    stack.push_back(std::make_pair(node.child[i], depth + 1));
+                }
+            }
+        }
+        return true;
+    }
+
+    // Same interface as FlatBvh::traverse(). The children that are hit are
+    // visited in order of their entry distance.
+    template <typename IntersectFn>
+    bool traverse(const Ray &r, float t_min, float &t_max, IntersectFn intersect) const {
+        if (nodes.empty()) return false;
+
+        const glm::vec3 origin = r.origin();
+        const glm::vec3 inv_dir = 1.0f / r.direction();
+
+        struct StackEntry {
+            std::uint32_t index;
+            std::uint32_t count;
+            float t_enter;
+        } stack[max_stack_depth];
+        stack[0].index = 0;
+        stack[0].count = 0;
+        stack[0].t_enter = t_min;
+        int stack_size = 1;
+
+        TraversalCount count;
+        bool hit_anything = false;
+        while (stack_size > 0) {
+            const StackEntry entry = stack[--stack_size];
+            if (entry.t_enter > t_max) continue;
+
+            count.nodes += 1;
+            if (entry.count > 0) {
+                count.primitives += entry.count;
+                for (std::uint32_t i = entry.index; i < entry.index + entry.count; ++i) {
+                    if (intersect(prim_indices[i], t_min, t_max)) hit_anything = true;
+                }
+                continue;
+            }
+
+            const Node &node = nodes[entry.index];
+            float t_enter[W];
+            int mask = hit_children(node, origin, inv_dir, t_min, t_max, t_enter);
+
+            // Push the children sorted by decreasing distance, so that the
+            // nearest one is popped first
+            int first = stack_size;
+            for (int i = 0; i < W; ++i) {
+                if (!(mask & (1 << i))) continue;
+                StackEntry child = { node.child[i], node.count[i], t_enter[i] };
+                int j = stack_size++;
+                while (j > first && stack[j - 1].t_enter < child.t_enter) {
+                    stack[j] = stack[j - 1];
+                    j -= 1;
+                }
+                stack[j] = child;
+            }
+        }
+        return hit_anything;
+    }
+
+    // Same interface as FlatBvh::traverse_packet(). The children that are
+    // hit by some lane are visited in order of the smallest entry distance
+    // of their lanes, with ties ordered along the mean direction of the
+    // packet.
+    template <typename IntersectFn>
+    int traverse_packet(const RayPacket &packet, float t_min, float *t_max, int mask,
+                        IntersectFn intersect) const {
+        if (nodes.empty() || mask == 0) return 0;
+
+        struct StackEntry {
+            std::uint32_t index;
+            std::uint32_t count;
+            int mask;
+            float t_enter;
+            float order;  // Position of the child center along the mean direction
+        } stack[max_stack_depth];
+        stack[0].index = 0;
+        stack[0].count = 0;
+        stack[0].mask = mask;
+        stack[0].t_enter = t_min;
+        stack[0].order = 0.0f;
+        int stack_size = 1;
+
+        const float inf = std::numeric_limits<float>::infinity();
+        TraversalCount count;
+        int hit_mask = 0;
+        while (stack_size > 0) {
+            const StackEntry entry = stack[--stack_size];
+            float t_far = packet.max_t(t_min, t_max, entry.mask);
+            if (entry.t_enter > t_far) continue;
+
+            count.nodes += 1;
+            if (entry.count > 0) {
+                count.primitives += entry.count;
+                for (std::uint32_t i = entry.index; i < entry.index + entry.count; ++i) {
+                    hit_mask |= intersect(prim_indices[i], entry.mask);
+                }
+                continue;
+            }
+
+            // Push the children sorted by decreasing distance, so that the
+            // nearest one is popped first
+            const Node &node = nodes[entry.index];
+            int first = stack_size;
+            for (int i = 0; i < W; ++i) {
+                if (node.bmin_x[i] == inf) continue;
+                glm::vec3 bmin(node.bmin_x[i], node.bmin_y[i], node.bmin_z[i]);
+                glm::vec3 bmax(node.bmax_x[i], node.bmax_y[i], node.bmax_z[i]);
+                if (!packet.frustum_overlaps(bmin, bmax, t_min, t_far)) continue;
+                StackEntry child = { node.child[i], node.count[i], 0, 0.0f,
+                                     glm::dot(bmin + bmax, packet.mean_dir) };
+                child.mask = packet.hit_box(bmin, bmax, t_min, t_max, entry.mask, child.t_enter);
+                if (child.mask == 0) continue;
+                int j = stack_size++;
+                while (j > first && (stack[j - 1].t_enter < child.t_enter ||
+                                     (stack[j - 1].t_enter == child.t_enter && stack[j - 1].order < child.order))) {
+                    stack[j] = stack[j - 1];
+                    j -= 1;
+                }
+                stack[j] = child;
+            }
+        }
+        return hit_mask;
+    }
+
+  private:
+    void collapse_node(const FlatBvh &bvh, std::uint32_t wide_index, std::uint32_t binary_index) {
+        // Open the binary node with the largest surface area until there
+        // are W children or only leaves left
+        std::uint32_t slots[W];
+        int num_slots = 0;
+        const FlatBvhNode &root = bvh.nodes[binary_index];
+        if (root.is_leaf()) {
+            slots[num_slots++] = binary_index;
+        } else {
+            slots[num_slots++] = root.left_first;
+            slots[num_slots++] = root.left_first + 1;
+        }
+        while (num_slots < W) {
+            int best = -1;
+            float best_area = -1.0f;
+            for (int i = 0; i < num_slots; ++i) {
+                const FlatBvhNode &node = bvh.nodes[slots[i]];
+                if (node.is_leaf()) continue;
+                float area = AABB(node.bmin, node.bmax).surface_area();
+                if (area > best_area) {
+                    best = i;
+                    best_area = area;
+                }
+            }
+            if (best < 0) break;
+            std::uint32_t left = bvh.nodes[slots[best]].left_first;
+            slots[best] = left;
+            slots[num_slots++] = left + 1;
+        }
+
+        const float inf = std::numeric_limits<float>::infinity();
+        Node node;
+        for (int i = 0; i < W; ++i) {
+            if (i < num_slots) {
+                const FlatBvhNode &child = bvh.nodes[slots[i]];
+                node.bmin_x[i] = child.bmin.x;
+                node.bmin_y[i] = child.bmin.y;
+                node.bmin_z[i] = child.bmin.z;
+                node.bmax_x[i] = child.bmax.x;
+                node.bmax_y[i] = child.bmax.y;
+                node.bmax_z[i] = child.bmax.z;
+                node.child[i] = child.left_first;
+                node.count[i] = child.count;
+            } else {
+                node.bmin_x[i] = node.bmin_y[i] = node.bmin_z[i] = inf;
+                node.bmax_x[i] = node.bmax_y[i] = node.bmax_z[i] = inf;
+                node.child[i] = 0;
+                node.count[i] = 0;
+            }
+        }
+
+        // Allocate the interior children before recursing into them
+        for (int i = 0; i < num_slots; ++i) {
+            if (node.count[i] > 0) continue;
+            node.child[i] = std::uint32_t(nodes.size());
+            nodes.push_back(Node());
+        }
+        nodes[wide_index] = node;
+        for (int i = 0; i < num_slots; ++i) {
+            if (node.count[i] > 0) continue;
+            collapse_node(bvh, node.child[i], slots[i]);
+        }
+    }
+
+  public:
+    std::vector<Node> nodes;
+    std::vector<std::uint32_t> prim_indices;
+};
+
+}  // namespace rt
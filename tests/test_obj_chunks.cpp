@@ -0,0 +1,93 @@
+// Tests that the chunked OBJ parser gives the same mesh for any number of
+// chunks, also when relative (negative) face indices refer to vertices in
+// earlier chunks.
+
+#include "cg_utils2.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &message)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << message << std::endl;
+        ++failures;
+    }
+}
+
+static std::string writeFile(const std::string &filename, const std::string &contents)
+{
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    file << contents;
+    return filename;
+}
+
+// Corners of the chunks, in order
+static std::vector<glm::i64vec3> corners(const std::vector<cg::OBJChunk> &chunks)
+{
+    std::vector<glm::i64vec3> result;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        result.insert(result.end(), chunks[i].corners.begin(), chunks[i].corners.end());
+    }
+    return result;
+}
+
+int main()
+{
+    // All vertices come first, so with several chunks the faces are in
+    // later chunks than the vertices they refer to
+    const int num_vertices = 300;
+    std::string all_first = "vt 0 0\nvn 0 0 1\n";
+    for (int i = 0; i < num_vertices; ++i) all_first += "v " + std::to_string(i) + " 0 0\n";
+    for (int i = 0; i < 100; ++i) all_first += "f -300 -299 -298/-1/-1\n";
+
+    // Vertices and faces interleaved, so that chunk boundaries fall between
+    // a face and the vertices just before it
+    std::string interleaved;
+    for (int i = 0; i < 200; ++i) {
+        interleaved += "v 0 0 0\nv 1 0 0\nv 0 1 0\nvt 0 0\nf -3/-1 -2/-1 -1/-1\n";
+    }
+
+    const std::string files[] = { writeFile("obj_chunks_all_first.obj", all_first),
+                                  writeFile("obj_chunks_interleaved.obj", interleaved) };
+    for (const std::string &filename : files) {
+        std::vector<cg::OBJChunk> chunks;
+        check(cg::parseOBJ(filename, true, chunks, 1), filename + ": parse with 1 chunk");
+        std::vector<glm::i64vec3> expected = corners(chunks);
+        for (size_t num_chunks = 2; num_chunks <= 16; ++num_chunks) {
+            std::string name = filename + " with " + std::to_string(num_chunks) + " chunks";
+            check(cg::parseOBJ(filename, true, chunks, num_chunks), name + ": parse");
+            check(corners(chunks) == expected, name + ": same corners as with 1 chunk");
+        }
+    }
+
+    // Relative indices resolve to the absolute ones
+    std::vector<cg::OBJChunk> chunks;
+    check(cg::parseOBJ(files[0], true, chunks, 8), "all_first: parse");
+    std::vector<glm::i64vec3> all = corners(chunks);
+    check(all.size() == 300, "all_first: 100 triangles");
+    for (size_t i = 0; i + 2 < all.size(); i += 3) {
+        if (all[i] != glm::i64vec3(0, -1, -1) || all[i + 1] != glm::i64vec3(1, -1, -1) ||
+            all[i + 2] != glm::i64vec3(2, 0, 0)) {
+            check(false, "all_first: corners of triangle " + std::to_string(i / 3));
+            break;
+        }
+    }
+    cg::OBJMesh mesh;
+    check(cg::objMeshLoad(mesh, files[1]) && mesh.indices.size() == 600, "interleaved: objMeshLoad");
+
+    // Relative indices before the first vertex are errors
+    std::string out_of_range = writeFile("obj_chunks_out_of_range.obj", "v 0 0 0\nv 1 0 0\nf -1 -2 -3\n");
+    for (size_t num_chunks = 1; num_chunks <= 3; ++num_chunks) {
+        check(!cg::parseOBJ(out_of_range, false, chunks, num_chunks), "out_of_range: rejected");
+    }
+
+    for (const std::string &filename : files) std::remove(filename.c_str());
+    std::remove(out_of_range.c_str());
+    if (failures == 0) std::cout << "All OBJ chunk tests passed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}